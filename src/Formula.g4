@@ -9,10 +9,17 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
+        | FUNCTION '(' (arg (',' arg)*)? ')'  # Function
         | CELL  # Cell
         | NUMBER  # Literal
         ;
 
+// a range is only allowed as an argument of a function
+arg
+        : CELL ':' CELL  # Range
+        | expr  # Argument
+        ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -26,5 +33,6 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+FUNCTION: 'SUM' | 'MIN' | 'MAX' | 'AVERAGE' | 'COUNT' ;
 CELL: [A-Z]+[0-9]+ ;
 WS: [ \t\n\r]+ -> skip ; 
\ No newline at end of file
@@ -4,11 +4,18 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
+#include <utility>
 
 namespace ASTImpl {
 
@@ -67,17 +74,31 @@ namespace ASTImpl {
 		/* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 	};
 
+	// Nodes live in the FormulaAST arena, which never runs destructors, so every
+	// node type has to stay trivially destructible. Cell references are stored
+	// as offsets from the cell the formula belongs to, the anchor, and become
+	// positions only when printed
 	class Expr {
 	public:
-		virtual ~Expr() = default;
-		virtual void Print(std::ostream& out) const = 0;
-		virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-		virtual double Evaluate(const std::function<double(Position)>& get_value_by_position) const = 0;
+		virtual void Print(std::ostream& out, Position anchor) const = 0;
+		virtual void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence precedence) const = 0;
+		// appends the postfix instructions evaluating this subtree
+		virtual void Compile(std::vector<Instruction>& program) const = 0;
+
+		// appends the instructions folding this subtree, an argument of the
+		// function, into the aggregate on top of the stack
+		virtual void CompileArgument(std::vector<Instruction>& program, Function function) const {
+			Compile(program);
+			Instruction instruction;
+			instruction.op = Instruction::OpCode::AccumulateValue;
+			instruction.function = function;
+			program.push_back(instruction);
+		}
 
 		// higher is tighter
 		virtual ExprPrecedence GetPrecedence() const = 0;
 
-		void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+		void PrintFormula(std::ostream& out, Position anchor, ExprPrecedence parent_precedence,
 			bool right_child = false) const {
 			auto precedence = GetPrecedence();
 			auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,15 +107,53 @@ namespace ASTImpl {
 				out << '(';
 			}
 
-			DoPrintFormula(out, precedence);
+			DoPrintFormula(out, anchor, precedence);
 
 			if (parens_needed) {
 				out << ')';
 			}
 		}
+
+	protected:
+		~Expr() = default;
 	};
 
 	namespace {
+		constexpr std::pair<std::string_view, Function> FUNCTION_NAMES[] = {
+			{ "SUM", Function::Sum },
+			{ "MIN", Function::Min },
+			{ "MAX", Function::Max },
+			{ "AVERAGE", Function::Average },
+			{ "COUNT", Function::Count },
+		};
+
+		std::optional<Function> FindFunction(std::string_view name) {
+			for (const auto& [function_name, function] : FUNCTION_NAMES) {
+				if (function_name == name) {
+					return function;
+				}
+			}
+			return std::nullopt;
+		}
+
+		std::string_view GetFunctionName(Function function) {
+			for (const auto& [function_name, candidate] : FUNCTION_NAMES) {
+				if (candidate == function) {
+					return function_name;
+				}
+			}
+			assert(false);
+			return {};
+		}
+
+		Position ParseCellPosition(std::string_view text) {
+			const auto value = Position::FromString(text);
+			if (!value.IsValid()) {
+				throw FormulaException("Invalid position: " + std::string(text));
+			}
+			return value;
+		}
+
 		class BinaryOpExpr final : public Expr {
 		public:
 			enum Type : char {
@@ -105,24 +164,24 @@ namespace ASTImpl {
 			};
 
 		public:
-			explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+			explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
 				: type_(type)
-				, lhs_(std::move(lhs))
-				, rhs_(std::move(rhs)) {
+				, lhs_(lhs)
+				, rhs_(rhs) {
 			}
 
-			void Print(std::ostream& out) const override {
+			void Print(std::ostream& out, Position anchor) const override {
 				out << '(' << static_cast<char>(type_) << ' ';
-				lhs_->Print(out);
+				lhs_->Print(out, anchor);
 				out << ' ';
-				rhs_->Print(out);
+				rhs_->Print(out, anchor);
 				out << ')';
 			}
 
-			void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-				lhs_->PrintFormula(out, precedence);
+			void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence precedence) const override {
+				lhs_->PrintFormula(out, anchor, precedence);
 				out << static_cast<char>(type_);
-				rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+				rhs_->PrintFormula(out, anchor, precedence, /* right_child = */ true);
 			}
 
 			ExprPrecedence GetPrecedence() const override {
@@ -142,36 +201,31 @@ namespace ASTImpl {
 				}
 			}
 
-			double Evaluate(const std::function<double(Position)>& get_value_by_position) const override {
-				using namespace std::literals;
-				const double lhs = lhs_->Evaluate(get_value_by_position);
-				const double rhs = rhs_->Evaluate(get_value_by_position);
-				double result;
-				switch (type_)
-				{
-				case Type::Add:
-					result = lhs + rhs;
+			void Compile(std::vector<Instruction>& program) const override {
+				lhs_->Compile(program);
+				rhs_->Compile(program);
+				Instruction instruction;
+				switch (type_) {
+				case Add:
+					instruction.op = Instruction::OpCode::Add;
 					break;
-				case Type::Subtract:
-					result = lhs - rhs;
+				case Subtract:
+					instruction.op = Instruction::OpCode::Subtract;
 					break;
-				case Type::Multiply:
-					result = lhs * rhs;
+				case Multiply:
+					instruction.op = Instruction::OpCode::Multiply;
 					break;
-				case Type::Divide:
-					result = lhs / rhs;
+				case Divide:
+					instruction.op = Instruction::OpCode::Divide;
 					break;
 				}
-				if (!std::isfinite(result)) {
-					throw FormulaError(FormulaError::Category::Div0);
-				}
-				return result;
+				program.push_back(instruction);
 			}
 
 		private:
 			Type type_;
-			std::unique_ptr<Expr> lhs_;
-			std::unique_ptr<Expr> rhs_;
+			const Expr* lhs_;
+			const Expr* rhs_;
 		};
 
 		class UnaryOpExpr final : public Expr {
@@ -182,65 +236,169 @@ namespace ASTImpl {
 			};
 
 		public:
-			explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+			explicit UnaryOpExpr(Type type, const Expr* operand)
 				: type_(type)
-				, operand_(std::move(operand)) {
+				, operand_(operand) {
 			}
 
-			void Print(std::ostream& out) const override {
+			void Print(std::ostream& out, Position anchor) const override {
 				out << '(' << static_cast<char>(type_) << ' ';
-				operand_->Print(out);
+				operand_->Print(out, anchor);
 				out << ')';
 			}
 
-			void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+			void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence precedence) const override {
 				out << static_cast<char>(type_);
-				operand_->PrintFormula(out, precedence);
+				operand_->PrintFormula(out, anchor, precedence);
 			}
 
 			ExprPrecedence GetPrecedence() const override {
 				return EP_UNARY;
 			}
 
-			double Evaluate(const std::function<double(Position)>& get_value_by_position) const override {
-				const double result = operand_->Evaluate(get_value_by_position);
-				return type_ == Type::UnaryMinus ? -result : result;
+			void Compile(std::vector<Instruction>& program) const override {
+				operand_->Compile(program);
+				if (type_ == Type::UnaryMinus) {
+					Instruction instruction;
+					instruction.op = Instruction::OpCode::Negate;
+					program.push_back(instruction);
+				}
 			}
 
 		private:
 			Type type_;
-			std::unique_ptr<Expr> operand_;
+			const Expr* operand_;
 		};
 
 		class CellExpr final : public Expr {
 		public:
-			explicit CellExpr(const Position* cell)
+			explicit CellExpr(Position cell)
 				: cell_(cell) {
 			}
 
-			void Print(std::ostream& out) const override {
-				if (!cell_->IsValid()) {
+			void Print(std::ostream& out, Position anchor) const override {
+				const Position cell = Translate(cell_, anchor);
+				if (!cell.IsValid()) {
 					out << FormulaError::Category::Ref;
 				}
 				else {
-					out << cell_->ToString();
+					out << cell.ToString();
 				}
 			}
 
-			void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-				Print(out);
+			void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence /* precedence */) const override {
+				Print(out, anchor);
+			}
+
+			ExprPrecedence GetPrecedence() const override {
+				return EP_ATOM;
+			}
+
+			void Compile(std::vector<Instruction>& program) const override {
+				Instruction instruction;
+				instruction.op = Instruction::OpCode::LoadCell;
+				instruction.cell = cell_;
+				program.push_back(instruction);
+			}
+
+			// SUM(A1) is SUM(A1:A1): empty and text cells are skipped
+			void CompileArgument(std::vector<Instruction>& program, Function function) const override {
+				Instruction instruction;
+				instruction.op = Instruction::OpCode::AccumulateRange;
+				instruction.function = function;
+				instruction.range = { cell_, cell_ };
+				program.push_back(instruction);
+			}
+
+		private:
+			Position cell_;
+		};
+
+		// The grammar only allows a range as an argument of a function
+		class RangeExpr final : public Expr {
+		public:
+			explicit RangeExpr(Range range)
+				: range_(range) {
+			}
+
+			void Print(std::ostream& out, Position anchor) const override {
+				out << Translate(range_, anchor).ToString();
+			}
+
+			void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence /* precedence */) const override {
+				Print(out, anchor);
 			}
 
 			ExprPrecedence GetPrecedence() const override {
 				return EP_ATOM;
 			}
 
-			double Evaluate(const std::function<double(Position)>& get_value_by_position) const override {
-				return get_value_by_position(*cell_);
+			void Compile(std::vector<Instruction>& /* program */) const override {
+				assert(false);
+			}
+
+			void CompileArgument(std::vector<Instruction>& program, Function function) const override {
+				Instruction instruction;
+				instruction.op = Instruction::OpCode::AccumulateRange;
+				instruction.function = function;
+				instruction.range = range_;
+				program.push_back(instruction);
 			}
 
 		private:
-			const Position* cell_;
+			Range range_;
+		};
+
+		class FunctionExpr final : public Expr {
+		public:
+			// args is an array of arg_count nodes in the same arena
+			FunctionExpr(Function function, const Expr* const* args, size_t arg_count)
+				: function_(function)
+				, args_(args)
+				, arg_count_(arg_count) {
+			}
+
+			void Print(std::ostream& out, Position anchor) const override {
+				out << '(' << GetFunctionName(function_);
+				for (size_t i = 0; i < arg_count_; ++i) {
+					out << ' ';
+					args_[i]->Print(out, anchor);
+				}
+				out << ')';
+			}
+
+			void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence /* precedence */) const override {
+				out << GetFunctionName(function_) << '(';
+				for (size_t i = 0; i < arg_count_; ++i) {
+					if (i > 0) {
+						out << ',';
+					}
+					// arguments are delimited by commas, so they never need parens
+					args_[i]->PrintFormula(out, anchor, EP_ADD);
+				}
+				out << ')';
+			}
+
+			ExprPrecedence GetPrecedence() const override {
+				return EP_ATOM;
+			}
+
+			void Compile(std::vector<Instruction>& program) const override {
+				Instruction instruction;
+				instruction.op = Instruction::OpCode::BeginAggregate;
+				instruction.function = function_;
+				program.push_back(instruction);
+				for (size_t i = 0; i < arg_count_; ++i) {
+					args_[i]->CompileArgument(program, function_);
+				}
+				instruction.op = Instruction::OpCode::EndAggregate;
+				program.push_back(instruction);
+			}
+
+		private:
+			Function function_;
+			const Expr* const* args_;
+			size_t arg_count_;
 		};
 
 		class NumberExpr final : public Expr {
@@ -249,11 +407,11 @@ namespace ASTImpl {
 				: value_(value) {
 			}
 
-			void Print(std::ostream& out) const override {
+			void Print(std::ostream& out, Position /* anchor */) const override {
 				out << value_;
 			}
 
-			void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+			void DoPrintFormula(std::ostream& out, Position /* anchor */, ExprPrecedence /* precedence */) const override {
 				out << value_;
 			}
 
@@ -261,8 +419,11 @@ namespace ASTImpl {
 				return EP_ATOM;
 			}
 
-			double Evaluate(const std::function<double(Position)>& /* get_value_by_position */) const override {
-				return value_;
+			void Compile(std::vector<Instruction>& program) const override {
+				Instruction instruction;
+				instruction.op = Instruction::OpCode::PushNumber;
+				instruction.number = value_;
+				program.push_back(instruction);
 			}
 
 		private:
@@ -271,23 +432,31 @@ namespace ASTImpl {
 
 		class ParseASTListener final : public FormulaBaseListener {
 		public:
-			std::unique_ptr<Expr> MoveRoot() {
+			const Expr* MoveRoot() {
 				assert(args_.size() == 1);
-				auto root = std::move(args_.front());
+				auto root = args_.front();
 				args_.clear();
 
 				return root;
 			}
 
-			std::forward_list<Position> MoveCells() {
-				return std::move(cells_);
+			std::vector<Position>& GetCells() {
+				return cells_;
+			}
+
+			std::vector<Range>& GetRanges() {
+				return ranges_;
+			}
+
+			Arena MoveArena() {
+				return std::move(arena_);
 			}
 
 		public:
 			void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
 				assert(args_.size() >= 1);
 
-				auto operand = std::move(args_.back());
+				auto operand = args_.back();
 
 				UnaryOpExpr::Type type;
 				if (ctx->SUB()) {
@@ -298,8 +467,7 @@ namespace ASTImpl {
 					type = UnaryOpExpr::UnaryPlus;
 				}
 
-				auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-				args_.back() = std::move(node);
+				args_.back() = arena_.Make<UnaryOpExpr>(type, operand);
 			}
 
 			void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -311,29 +479,42 @@ namespace ASTImpl {
 					throw ParsingError("Invalid number: " + valueStr);
 				}
 
-				auto node = std::make_unique<NumberExpr>(value);
-				args_.push_back(std::move(node));
+				args_.push_back(arena_.Make<NumberExpr>(value));
 			}
 
 			void exitCell(FormulaParser::CellContext* ctx) override {
-				auto value_str = ctx->CELL()->getSymbol()->getText();
-				auto value = Position::FromString(value_str);
-				if (!value.IsValid()) {
-					throw FormulaException("Invalid position: " + value_str);
-				}
+				const auto value = ParseCellPosition(ctx->CELL()->getSymbol()->getText());
+				cells_.push_back(value);
+				args_.push_back(arena_.Make<CellExpr>(value));
+			}
+
+			void exitRange(FormulaParser::RangeContext* ctx) override {
+				const auto first = ParseCellPosition(ctx->CELL(0)->getSymbol()->getText());
+				const auto last = ParseCellPosition(ctx->CELL(1)->getSymbol()->getText());
+				const auto range = Range::FromCorners(first, last);
+				ranges_.push_back(range);
+				args_.push_back(arena_.Make<RangeExpr>(range));
+			}
+
+			void exitFunction(FormulaParser::FunctionContext* ctx) override {
+				const auto function = FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+				assert(function);
+				const size_t arg_count = ctx->arg().size();
+				assert(args_.size() >= arg_count);
 
-				cells_.push_front(value);
-				auto node = std::make_unique<CellExpr>(&cells_.front());
-				args_.push_back(std::move(node));
+				const size_t args_begin = args_.size() - arg_count;
+				const Expr* const* args = arena_.MakeArray(args_.data() + args_begin, arg_count);
+				args_.resize(args_begin);
+				args_.push_back(arena_.Make<FunctionExpr>(*function, args, arg_count));
 			}
 
 			void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
 				assert(args_.size() >= 2);
 
-				auto rhs = std::move(args_.back());
+				auto rhs = args_.back();
 				args_.pop_back();
 
-				auto lhs = std::move(args_.back());
+				auto lhs = args_.back();
 
 				BinaryOpExpr::Type type;
 				if (ctx->ADD()) {
@@ -350,8 +531,7 @@ namespace ASTImpl {
 					type = BinaryOpExpr::Divide;
 				}
 
-				auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-				args_.back() = std::move(node);
+				args_.back() = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
 			}
 
 			void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -359,10 +539,667 @@ namespace ASTImpl {
 			}
 
 		private:
-			std::vector<std::unique_ptr<Expr>> args_;
-			std::forward_list<Position> cells_;
+			Arena arena_;
+			std::vector<const Expr*> args_;
+			std::vector<Position> cells_;
+			std::vector<Range> ranges_;
 		};
 
+		// Hand-written counterpart of the ANTLR lexer for Formula.g4: it walks the
+		// input in place and hands out tokens as views into it.
+		class Lexer {
+		public:
+			enum class TokenType {
+				Number,
+				Cell,
+				Add,
+				Sub,
+				Mul,
+				Div,
+				LeftParen,
+				RightParen,
+				Function,
+				Comma,
+				Colon,
+				End,
+			};
+
+			struct Token {
+				TokenType type;
+				std::string_view text;
+			};
+
+		public:
+			explicit Lexer(std::string_view input)
+				: input_(input) {
+			}
+
+			Token Next() {
+				while (pos_ < input_.size() && IsSpace(input_[pos_])) {
+					++pos_;
+				}
+				if (pos_ == input_.size()) {
+					return { TokenType::End, {} };
+				}
+
+				const size_t start = pos_;
+				const char c = input_[pos_];
+				switch (c) {
+				case '+':
+					return MakeToken(TokenType::Add, start, ++pos_);
+				case '-':
+					return MakeToken(TokenType::Sub, start, ++pos_);
+				case '*':
+					return MakeToken(TokenType::Mul, start, ++pos_);
+				case '/':
+					return MakeToken(TokenType::Div, start, ++pos_);
+				case '(':
+					return MakeToken(TokenType::LeftParen, start, ++pos_);
+				case ')':
+					return MakeToken(TokenType::RightParen, start, ++pos_);
+				case ',':
+					return MakeToken(TokenType::Comma, start, ++pos_);
+				case ':':
+					return MakeToken(TokenType::Colon, start, ++pos_);
+				default:
+					break;
+				}
+
+				if (IsUpper(c)) {
+					// CELL: [A-Z]+[0-9]+, FUNCTION: one of the names without digits
+					const size_t digits_start = SkipWhile(start, IsUpper);
+					pos_ = SkipWhile(digits_start, IsDigit);
+					if (pos_ == digits_start) {
+						if (!FindFunction(input_.substr(start, pos_ - start))) {
+							ThrowLexerError(start);
+						}
+						return MakeToken(TokenType::Function, start, pos_);
+					}
+					return MakeToken(TokenType::Cell, start, pos_);
+				}
+
+				// NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+				pos_ = SkipWhile(start, IsDigit);
+				if (pos_ < input_.size() && input_[pos_] == '.') {
+					const size_t fraction_end = SkipWhile(pos_ + 1, IsDigit);
+					if (fraction_end == pos_ + 1) {
+						// a dangling '.' can't start any token
+						ThrowLexerError(pos_);
+					}
+					pos_ = fraction_end;
+				}
+				if (pos_ == start) {
+					ThrowLexerError(start);
+				}
+				if (pos_ < input_.size() && (input_[pos_] == 'e' || input_[pos_] == 'E')) {
+					// the exponent is only a part of the token when it's complete,
+					// otherwise the lexer stops before 'e' like ANTLR does
+					size_t exponent_pos = pos_ + 1;
+					if (exponent_pos < input_.size() && (input_[exponent_pos] == '+' || input_[exponent_pos] == '-')) {
+						++exponent_pos;
+					}
+					const size_t exponent_end = SkipWhile(exponent_pos, IsDigit);
+					if (exponent_end != exponent_pos) {
+						pos_ = exponent_end;
+					}
+				}
+				return MakeToken(TokenType::Number, start, pos_);
+			}
+
+		private:
+			std::string_view input_;
+			size_t pos_ = 0;
+
+			static bool IsSpace(char c) {
+				return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+			}
+
+			static bool IsUpper(char c) {
+				return c >= 'A' && c <= 'Z';
+			}
+
+			static bool IsDigit(char c) {
+				return c >= '0' && c <= '9';
+			}
+
+			template <typename Predicate>
+			size_t SkipWhile(size_t pos, Predicate predicate) const {
+				while (pos < input_.size() && predicate(input_[pos])) {
+					++pos;
+				}
+				return pos;
+			}
+
+			Token MakeToken(TokenType type, size_t start, size_t end) const {
+				return { type, input_.substr(start, end - start) };
+			}
+
+			[[noreturn]] void ThrowLexerError(size_t pos) const {
+				throw ParsingError("Error when lexing: unexpected '" + std::string(1, input_[pos]) + "'");
+			}
+		};
+
+		// Pratt parser over the Lexer tokens. Builds the same tree as
+		// ParseASTListener does for the ANTLR parse tree: unary operators
+		// bind tighter than any binary one, binary operators are left-associative.
+		class Parser {
+		public:
+			// cells and ranges receive the references in the order of appearance,
+			// as offsets from anchor
+			Parser(std::string_view input, Position anchor, Arena& arena, std::vector<Position>& cells,
+				std::vector<Range>& ranges)
+				: lexer_(input)
+				, current_(lexer_.Next())
+				, anchor_(anchor)
+				, arena_(arena)
+				, cells_(cells)
+				, ranges_(ranges) {
+			}
+
+			// main: expr EOF
+			const Expr* ParseMain() {
+				auto root = ParseExpr(0);
+				if (current_.type != Lexer::TokenType::End) {
+					ThrowUnexpectedToken();
+				}
+				return root;
+			}
+
+		private:
+			using TokenType = Lexer::TokenType;
+
+			Lexer lexer_;
+			Lexer::Token current_;
+			Position anchor_;
+			Arena& arena_;
+			std::vector<Position>& cells_;
+			std::vector<Range>& ranges_;
+			// arguments of the functions being parsed, the innermost at the end
+			std::vector<const Expr*> args_;
+
+			void Advance() {
+				current_ = lexer_.Next();
+			}
+
+			Position ParseCellOffset(std::string_view text) const {
+				return Translate(ParseCellPosition(text), { -anchor_.row, -anchor_.col });
+			}
+
+			static int GetBindingPower(TokenType type) {
+				switch (type) {
+				case TokenType::Add:
+				case TokenType::Sub:
+					return 1;
+				case TokenType::Mul:
+				case TokenType::Div:
+					return 2;
+				default:
+					return 0;
+				}
+			}
+
+			static BinaryOpExpr::Type GetBinaryOpType(TokenType type) {
+				switch (type) {
+				case TokenType::Add:
+					return BinaryOpExpr::Add;
+				case TokenType::Sub:
+					return BinaryOpExpr::Subtract;
+				case TokenType::Mul:
+					return BinaryOpExpr::Multiply;
+				default:
+					assert(type == TokenType::Div);
+					return BinaryOpExpr::Divide;
+				}
+			}
+
+			const Expr* ParseExpr(int min_binding_power) {
+				return ParseInfix(ParsePrefix(), min_binding_power);
+			}
+
+			// continues the expression whose leftmost operand is already parsed
+			const Expr* ParseInfix(const Expr* lhs, int min_binding_power) {
+				for (int power = GetBindingPower(current_.type); power > min_binding_power;
+					power = GetBindingPower(current_.type)) {
+					const auto type = GetBinaryOpType(current_.type);
+					Advance();
+					const Expr* rhs = ParseExpr(power);
+					lhs = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+				}
+				return lhs;
+			}
+
+			const Expr* ParsePrefix() {
+				const auto token = current_;
+				switch (token.type) {
+				case TokenType::LeftParen: {
+					Advance();
+					auto expr = ParseExpr(0);
+					if (current_.type != TokenType::RightParen) {
+						ThrowUnexpectedToken();
+					}
+					Advance();
+					return expr;
+				}
+				case TokenType::Add:
+				case TokenType::Sub: {
+					Advance();
+					const auto type = token.type == TokenType::Sub ? UnaryOpExpr::UnaryMinus : UnaryOpExpr::UnaryPlus;
+					return arena_.Make<UnaryOpExpr>(type, ParsePrefix());
+				}
+				case TokenType::Number:
+					Advance();
+					return arena_.Make<NumberExpr>(ParseNumber(token.text));
+				case TokenType::Cell: {
+					Advance();
+					const auto value = ParseCellOffset(token.text);
+					cells_.push_back(value);
+					return arena_.Make<CellExpr>(value);
+				}
+				case TokenType::Function: {
+					Advance();
+					Expect(TokenType::LeftParen);
+					const size_t args_begin = args_.size();
+					if (current_.type != TokenType::RightParen) {
+						args_.push_back(ParseArgument());
+						while (current_.type == TokenType::Comma) {
+							Advance();
+							args_.push_back(ParseArgument());
+						}
+					}
+					Expect(TokenType::RightParen);
+
+					const size_t arg_count = args_.size() - args_begin;
+					const Expr* const* args = arena_.MakeArray(args_.data() + args_begin, arg_count);
+					args_.resize(args_begin);
+					return arena_.Make<FunctionExpr>(*FindFunction(token.text), args, arg_count);
+				}
+				default:
+					ThrowUnexpectedToken();
+				}
+			}
+
+			// arg: CELL ':' CELL | expr
+			const Expr* ParseArgument() {
+				if (current_.type != TokenType::Cell) {
+					return ParseExpr(0);
+				}
+				const auto first = ParseCellOffset(current_.text);
+				Advance();
+				if (current_.type != TokenType::Colon) {
+					cells_.push_back(first);
+					return ParseInfix(arena_.Make<CellExpr>(first), 0);
+				}
+				Advance();
+				if (current_.type != TokenType::Cell) {
+					ThrowUnexpectedToken();
+				}
+				const auto range = Range::FromCorners(first, ParseCellOffset(current_.text));
+				Advance();
+				ranges_.push_back(range);
+				return arena_.Make<RangeExpr>(range);
+			}
+
+			void Expect(TokenType type) {
+				if (current_.type != type) {
+					ThrowUnexpectedToken();
+				}
+				Advance();
+			}
+
+			static double ParseNumber(std::string_view text) {
+				double value = 0;
+				const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+				if (ec == std::errc::result_out_of_range) {
+					// leave the corner cases (overflow is an error, underflow is not)
+					// to the same conversion the ANTLR path uses
+					std::istringstream in{ std::string(text) };
+					in >> value;
+					if (!in) {
+						throw ParsingError("Invalid number: " + std::string(text));
+					}
+				}
+				else if (ec != std::errc{} || ptr != text.data() + text.size()) {
+					throw ParsingError("Invalid number: " + std::string(text));
+				}
+				return value;
+			}
+
+			[[noreturn]] void ThrowUnexpectedToken() const {
+				if (current_.type == TokenType::End) {
+					throw ParsingError("Error when parsing: unexpected end of formula");
+				}
+				throw ParsingError("Error when parsing: unexpected '" + std::string(current_.text) + "'");
+			}
+		};
+
+		// The first arena block of a formula is sized from its length so that
+		// the tree, the cell list and the program usually fit into one block:
+		// a typical formula takes 20-30 bytes per character of the input
+		size_t EstimateArenaSize(size_t input_size) {
+			return 128 + input_size * 24;
+		}
+
+		// Identifies a value computed by the program: equal keys compute equal
+		// values, since cells don't change while a formula is evaluated.
+		// Operands are the value numbers of the subexpressions; an aggregate is
+		// numbered as a chain of its arguments.
+		struct ValueKey {
+			Instruction::OpCode op = Instruction::OpCode::PushNumber;
+			Function function = Function::Sum;
+			std::uint32_t lhs = 0;
+			std::uint32_t rhs = 0;
+			std::uint64_t payload[2] = {};  // the bits of a number, a cell or a range
+
+			bool operator==(const ValueKey& other) const {
+				return op == other.op && function == other.function && lhs == other.lhs && rhs == other.rhs
+					&& payload[0] == other.payload[0] && payload[1] == other.payload[1];
+			}
+		};
+
+		struct ValueKeyHasher {
+			size_t operator()(const ValueKey& key) const {
+				std::uint64_t result = (static_cast<std::uint64_t>(key.op) << 8) | static_cast<std::uint64_t>(key.function);
+				for (std::uint64_t part : { std::uint64_t{ key.lhs } << 32 | key.rhs, key.payload[0], key.payload[1] }) {
+					result = (result ^ part) * 0x9E3779B97F4A7C15ull;
+					result ^= result >> 29;
+				}
+				return static_cast<size_t>(result);
+			}
+		};
+
+		template <typename T>
+		ValueKey MakeKey(Instruction::OpCode op, Function function, std::uint32_t lhs, std::uint32_t rhs, const T& payload) {
+			static_assert(sizeof(T) <= sizeof(ValueKey::payload));
+			ValueKey key{ op, function, lhs, rhs };
+			std::memcpy(key.payload, &payload, sizeof(T));
+			return key;
+		}
+
+		ValueKey MakeKey(Instruction::OpCode op, Function function, std::uint32_t lhs, std::uint32_t rhs = 0) {
+			return { op, function, lhs, rhs };
+		}
+
+		double ApplyBinary(Instruction::OpCode op, double lhs, double rhs) {
+			switch (op) {
+			case Instruction::OpCode::Add:
+				return lhs + rhs;
+			case Instruction::OpCode::Subtract:
+				return lhs - rhs;
+			case Instruction::OpCode::Multiply:
+				return lhs * rhs;
+			default:
+				assert(op == Instruction::OpCode::Divide);
+				return lhs / rhs;
+			}
+		}
+
+		// Whether some operation of the program has only constant operands: that
+		// is where constant folding starts. constants is scratch space.
+		bool HasConstantOperation(const std::vector<Instruction>& program, std::vector<char>& constants) {
+			using OpCode = Instruction::OpCode;
+			constants.clear();
+			for (const Instruction& instruction : program) {
+				switch (instruction.op) {
+				case OpCode::PushNumber:
+					constants.push_back(true);
+					break;
+				case OpCode::Negate:
+					if (constants.back()) {
+						return true;
+					}
+					break;
+				case OpCode::Add:
+				case OpCode::Subtract:
+				case OpCode::Multiply:
+				case OpCode::Divide: {
+					const bool rhs_constant = constants.back();
+					constants.pop_back();
+					if (constants.back() && rhs_constant) {
+						return true;
+					}
+					constants.back() = false;
+					break;
+				}
+				// an aggregate takes one entry that stays true while all of its
+				// arguments are constants
+				case OpCode::BeginAggregate:
+					constants.push_back(true);
+					break;
+				case OpCode::AccumulateValue: {
+					const bool argument_constant = constants.back();
+					constants.pop_back();
+					constants.back() = constants.back() && argument_constant;
+					break;
+				}
+				case OpCode::EndAggregate:
+					if (constants.back()) {
+						return true;
+					}
+					break;
+				case OpCode::AccumulateRange:
+					constants.back() = false;
+					break;
+				default:
+					assert(instruction.op == OpCode::LoadCell);
+					constants.push_back(false);
+					break;
+				}
+			}
+			return false;
+		}
+
+		// The program is replayed symbolically, keeping for every value on the
+		// stack where its code starts in the output. A subexpression of constants
+		// is replaced with its result when the result is finite, so #DIV/0! and
+		// the order in which errors are met stay with the run time. Every other
+		// value is numbered by its key; the first computation of a number is
+		// followed by a StoreLocal, and a later one is cut off and replaced with a
+		// PushLocal. A repeated subexpression has been computed in full before, so
+		// the code cut off never holds a first computation. StoreLocals nobody
+		// reads are dropped at the end and the locals are renumbered.
+		//
+		// Most formulas have neither constant operations nor repeats, and the
+		// value numbering isn't cheap next to the parser, so it's skipped when a
+		// quick pass finds no constant operation and no cell or range is
+		// referenced twice. Returns the number of locals.
+		size_t OptimizeProgram(std::vector<Instruction>& program, bool has_repeated_references) {
+			using OpCode = Instruction::OpCode;
+			static constexpr std::uint32_t NO_LOCAL = UINT32_MAX;
+			static constexpr std::uint32_t NO_ID = UINT32_MAX;
+
+			struct Value {
+				size_t start;
+				std::uint32_t id;
+				bool constant;
+				double number;
+			};
+			struct Aggregate {
+				size_t start;
+				std::uint32_t id;
+				bool constant;
+				double accumulator;
+				double count;
+			};
+
+			// the buffers are kept between calls; they are bound to references
+			// once, as every access to a thread_local goes through a wrapper
+			struct Scratch {
+				std::vector<Instruction> output;
+				std::vector<Value> values;
+				std::vector<Aggregate> aggregates;
+				// an open addressing hash table of the value numbers: there are at
+				// most as many keys as instructions, so it never fills up, and unlike
+				// a node based map it allocates nothing once the buffers have grown
+				std::vector<std::pair<ValueKey, std::uint32_t>> ids;
+				std::vector<std::uint32_t> locals;
+				std::vector<char> constants;
+			};
+			thread_local Scratch scratch;
+			if (!has_repeated_references && !HasConstantOperation(program, scratch.constants)) {
+				return 0;
+			}
+			std::vector<Instruction>& output = scratch.output;
+			std::vector<Value>& values = scratch.values;
+			std::vector<Aggregate>& aggregates = scratch.aggregates;
+			std::vector<std::pair<ValueKey, std::uint32_t>>& ids = scratch.ids;
+			std::vector<std::uint32_t>& locals = scratch.locals;
+			output.clear();
+			values.clear();
+			aggregates.clear();
+			locals.clear();
+			size_t id_capacity = 16;
+			while (id_capacity < program.size() * 2) {
+				id_capacity *= 2;
+			}
+			ids.assign(id_capacity, { ValueKey{}, NO_ID });
+			std::uint32_t local_count = 0;
+
+			auto get_id = [&ids, &locals, id_capacity](const ValueKey& key) {
+				for (size_t i = ValueKeyHasher{}(key) & (id_capacity - 1);; i = (i + 1) & (id_capacity - 1)) {
+					auto& [slot_key, id] = ids[i];
+					if (id == NO_ID) {
+						slot_key = key;
+						id = static_cast<std::uint32_t>(locals.size());
+						locals.push_back(NO_LOCAL);
+						return id;
+					}
+					if (slot_key == key) {
+						return id;
+					}
+				}
+			};
+			auto push_constant = [&](size_t start, double number) {
+				output.resize(start);
+				Instruction instruction;
+				instruction.number = number;
+				output.push_back(instruction);
+				values.push_back({ start, get_id(MakeKey(OpCode::PushNumber, Function::Sum, 0, 0, number)), true, number });
+			};
+			// instruction completes the value whose code starts at start
+			auto push_computed = [&](size_t start, const ValueKey& key, const Instruction& instruction) {
+				const std::uint32_t id = get_id(key);
+				Instruction local;
+				if (locals[id] != NO_LOCAL) {
+					output.resize(start);
+					local.op = OpCode::PushLocal;
+				}
+				else {
+					output.push_back(instruction);
+					locals[id] = local_count++;
+					local.op = OpCode::StoreLocal;
+				}
+				local.local = locals[id];
+				output.push_back(local);
+				values.push_back({ start, id, false, 0.0 });
+			};
+			auto pop_value = [&values] {
+				const Value value = values.back();
+				values.pop_back();
+				return value;
+			};
+
+			for (const Instruction& instruction : program) {
+				switch (instruction.op) {
+				case OpCode::PushNumber:
+					push_constant(output.size(), instruction.number);
+					break;
+				case OpCode::LoadCell:
+					push_computed(output.size(), MakeKey(instruction.op, Function::Sum, 0, 0, instruction.cell), instruction);
+					break;
+				case OpCode::Negate: {
+					const Value operand = pop_value();
+					if (operand.constant) {
+						push_constant(operand.start, -operand.number);
+					}
+					else {
+						push_computed(operand.start, MakeKey(instruction.op, Function::Sum, operand.id), instruction);
+					}
+					break;
+				}
+				case OpCode::Add:
+				case OpCode::Subtract:
+				case OpCode::Multiply:
+				case OpCode::Divide: {
+					const Value rhs = pop_value();
+					const Value lhs = pop_value();
+					if (lhs.constant && rhs.constant) {
+						const double result = ApplyBinary(instruction.op, lhs.number, rhs.number);
+						if (std::isfinite(result)) {
+							push_constant(lhs.start, result);
+							break;
+						}
+					}
+					push_computed(lhs.start, MakeKey(instruction.op, Function::Sum, lhs.id, rhs.id), instruction);
+					break;
+				}
+				case OpCode::BeginAggregate:
+					aggregates.push_back({ output.size(), get_id(MakeKey(instruction.op, instruction.function, 0)), true,
+						GetAggregateIdentity(instruction.function), 0.0 });
+					output.push_back(instruction);
+					break;
+				case OpCode::AccumulateValue: {
+					const Value argument = pop_value();
+					Aggregate& aggregate = aggregates.back();
+					aggregate.id = get_id(MakeKey(instruction.op, instruction.function, aggregate.id, argument.id));
+					if (aggregate.constant && argument.constant) {
+						AccumulateValues(instruction.function, aggregate.accumulator, aggregate.count, &argument.number, 1);
+					}
+					else {
+						aggregate.constant = false;
+					}
+					output.push_back(instruction);
+					break;
+				}
+				case OpCode::AccumulateRange: {
+					Aggregate& aggregate = aggregates.back();
+					aggregate.id = get_id(MakeKey(instruction.op, instruction.function, aggregate.id, 0, instruction.range));
+					aggregate.constant = false;
+					output.push_back(instruction);
+					break;
+				}
+				case OpCode::EndAggregate: {
+					const Aggregate aggregate = aggregates.back();
+					aggregates.pop_back();
+					if (aggregate.constant) {
+						const double result = FinishAggregate(instruction.function, aggregate.accumulator, aggregate.count);
+						if (std::isfinite(result)) {
+							push_constant(aggregate.start, result);
+							break;
+						}
+					}
+					push_computed(aggregate.start, MakeKey(instruction.op, instruction.function, aggregate.id), instruction);
+					break;
+				}
+				default:
+					assert(false);
+				}
+			}
+			assert(values.size() == 1 && aggregates.empty());
+
+			// drop the StoreLocals nobody reads and number the rest from zero
+			std::vector<std::uint32_t>& renumbered = locals;
+			renumbered.assign(local_count, NO_LOCAL);
+			for (const Instruction& instruction : output) {
+				if (instruction.op == OpCode::PushLocal) {
+					renumbered[instruction.local] = 0;
+				}
+			}
+			local_count = 0;
+			program.clear();
+			for (Instruction instruction : output) {
+				if (instruction.op == OpCode::StoreLocal) {
+					if (renumbered[instruction.local] == NO_LOCAL) {
+						continue;
+					}
+					renumbered[instruction.local] = local_count++;
+				}
+				if (instruction.op == OpCode::StoreLocal || instruction.op == OpCode::PushLocal) {
+					instruction.local = renumbered[instruction.local];
+				}
+				program.push_back(instruction);
+			}
+			return local_count;
+		}
 		class BailErrorListener : public antlr4::BaseErrorListener {
 		public:
 			void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
@@ -397,7 +1234,8 @@ FormulaAST ParseFormulaAST(std::istream& in) {
 	ASTImpl::ParseASTListener listener;
 	tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-	return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+	const ASTImpl::Expr* root = listener.MoveRoot();
+	return FormulaAST(listener.MoveArena(), root, listener.GetCells(), listener.GetRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -405,28 +1243,127 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
 	return ParseFormulaAST(in);
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
-	for (auto cell : cells_) {
-		out << cell.ToString() << ' ';
+FormulaAST ParseFormulaASTFast(std::string_view in, bool optimize) {
+	return ParseFormulaASTFast(in, Position{ 0, 0 }, optimize);
+}
+
+FormulaAST ParseFormulaASTFast(std::string_view in, Position anchor, bool optimize) {
+	// the reference lists are only scratch space until FormulaAST copies them
+	// into the arena, so their buffers are kept between calls
+	thread_local std::vector<Position> cells;
+	thread_local std::vector<Range> ranges;
+	cells.clear();
+	ranges.clear();
+	Arena arena(ASTImpl::EstimateArenaSize(in.size()));
+	ASTImpl::Parser parser(in, anchor, arena, cells, ranges);
+	const ASTImpl::Expr* root = parser.ParseMain();
+	return FormulaAST(std::move(arena), root, cells, ranges, optimize);
+}
+
+bool MakeRelativeFormulaKey(std::string_view in, Position anchor, std::string& key) {
+	using TokenType = ASTImpl::Lexer::TokenType;
+	key.clear();
+	try {
+		ASTImpl::Lexer lexer(in);
+		for (auto token = lexer.Next(); token.type != TokenType::End; token = lexer.Next()) {
+			// the separator keeps "1 2" and "12" apart
+			if (!key.empty()) {
+				key += ' ';
+			}
+			if (token.type != TokenType::Cell) {
+				key += token.text;
+				continue;
+			}
+			const Position cell = Position::FromString(token.text);
+			if (!cell.IsValid()) {
+				return false;
+			}
+			// 'R', 'C' and two ints with their signs
+			char buffer[2 + 2 * (std::numeric_limits<int>::digits10 + 2)];
+			buffer[0] = 'R';
+			const auto row = std::to_chars(buffer + 1, std::end(buffer) - 1, cell.row - anchor.row);
+			if (row.ec != std::errc()) {
+				return false;
+			}
+			char* end = row.ptr;
+			*end++ = 'C';
+			const auto col = std::to_chars(end, std::end(buffer), cell.col - anchor.col);
+			if (col.ec != std::errc()) {
+				return false;
+			}
+			key.append(buffer, col.ptr);
+		}
+	}
+	catch (const ParsingError&) {
+		return false;
 	}
+	return true;
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-	root_expr_->Print(out);
+void FormulaAST::PrintCells(std::ostream& out, Position anchor) const {
+	for (auto cell : GetCells()) {
+		out << ASTImpl::Translate(cell, anchor).ToString() << ' ';
+	}
+	for (const auto& range : GetRanges()) {
+		out << ASTImpl::Translate(range, anchor).ToString() << ' ';
+	}
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-	root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::Print(std::ostream& out, Position anchor) const {
+	root_expr_->Print(out, anchor);
 }
 
-double FormulaAST::Execute(const std::function<double(Position)>& get_value_by_position) const {
-	return root_expr_->Evaluate(get_value_by_position);
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+	root_expr_->PrintFormula(out, anchor, ASTImpl::EP_ATOM);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-	: root_expr_(std::move(root_expr))
-	, cells_(std::move(cells)) {
-	cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST::FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, std::vector<Position>& cells,
+	std::vector<Range>& ranges, bool optimize)
+	: arena_(std::move(arena))
+	, root_expr_(root_expr) {
+	// to avoid sorting in GetReferencedCells
+	std::sort(cells.begin(), cells.end());
+	bool has_repeated_references = std::adjacent_find(cells.begin(), cells.end()) != cells.end();
+	cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+	cells_ = arena_.MakeArray(cells.data(), cells.size());
+	cell_count_ = cells.size();
+	std::sort(ranges.begin(), ranges.end());
+	has_repeated_references = has_repeated_references || std::adjacent_find(ranges.begin(), ranges.end()) != ranges.end();
+	ranges.erase(std::unique(ranges.begin(), ranges.end()), ranges.end());
+	ranges_ = arena_.MakeArray(ranges.data(), ranges.size());
+	range_count_ = ranges.size();
+
+	thread_local std::vector<ASTImpl::Instruction> program;
+	program.clear();
+	root_expr_->Compile(program);
+	if (optimize) {
+		local_count_ = ASTImpl::OptimizeProgram(program, has_repeated_references);
+	}
+	program_ = arena_.MakeArray(program.data(), program.size());
+	program_size_ = program.size();
+
+	size_t depth = 0;
+	for (const auto& instruction : program) {
+		switch (instruction.op) {
+		case ASTImpl::Instruction::OpCode::PushNumber:
+		case ASTImpl::Instruction::OpCode::LoadCell:
+		case ASTImpl::Instruction::OpCode::PushLocal:
+			stack_size_ = std::max(stack_size_, ++depth);
+			break;
+		case ASTImpl::Instruction::OpCode::BeginAggregate:
+			depth += 2;
+			stack_size_ = std::max(stack_size_, depth);
+			break;
+		case ASTImpl::Instruction::OpCode::Negate:
+		case ASTImpl::Instruction::OpCode::AccumulateRange:
+		case ASTImpl::Instruction::OpCode::StoreLocal:
+			break;
+		default:
+			--depth;
+		}
+	}
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
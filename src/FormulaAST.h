@@ -1,14 +1,126 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "aggregate_kernels.h"
+#include "arena.h"
 #include "common.h"
 
-#include <forward_list>
-#include <functional>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
 	class Expr;
+
+	enum class Function : char {
+		Sum,
+		Min,
+		Max,
+		Average,
+		Count,
+	};
+
+	// A step of the compiled formula: the tree is lowered into a postfix
+	// sequence of these and evaluated by a stack machine
+	struct Instruction {
+		enum class OpCode : char {
+			PushNumber,
+			LoadCell,
+			Add,
+			Subtract,
+			Multiply,
+			Divide,
+			Negate,
+			// An aggregate keeps two slots on the stack, the accumulator and the
+			// number of values folded into it; Begin pushes them, Accumulate*
+			// fold an argument in, End replaces them with the result
+			BeginAggregate,
+			AccumulateValue,
+			AccumulateRange,
+			EndAggregate,
+			// Values computed more than once are kept in locals: StoreLocal
+			// copies the top of the stack into one, PushLocal pushes it back
+			StoreLocal,
+			PushLocal,
+		};
+
+		Instruction()
+			: number(0.0) {
+		}
+
+		OpCode op = OpCode::PushNumber;
+		Function function = Function::Sum;  // *Aggregate and Accumulate* operand
+		union {
+			double number;  // PushNumber operand
+			Position cell;  // LoadCell operand
+			Range range;    // AccumulateRange operand
+			std::uint32_t local;  // StoreLocal and PushLocal operand
+		};
+	};
+
+	// Formulas keep their references as offsets from the anchor, the cell of
+	// the formula; these turn an offset into a position and back (with a
+	// negated anchor)
+	inline Position Translate(Position offset, Position anchor) {
+		return { offset.row + anchor.row, offset.col + anchor.col };
+	}
+
+	inline Range Translate(Range offset, Position anchor) {
+		return { Translate(offset.first, anchor), Translate(offset.last, anchor) };
+	}
+
+	inline double GetAggregateIdentity(Function function) {
+		switch (function) {
+		case Function::Min:
+			return std::numeric_limits<double>::infinity();
+		case Function::Max:
+			return -std::numeric_limits<double>::infinity();
+		default:
+			return 0.0;
+		}
+	}
+
+	inline void AccumulateValues(Function function, double& accumulator, double& count,
+		const double* values, size_t value_count) {
+		switch (function) {
+		case Function::Sum:
+		case Function::Average:
+			accumulator += SumValues(values, value_count);
+			break;
+		case Function::Min:
+			accumulator = std::min(accumulator, MinValue(values, value_count));
+			break;
+		case Function::Max:
+			accumulator = std::max(accumulator, MaxValue(values, value_count));
+			break;
+		case Function::Count:
+			break;
+		}
+		count += static_cast<double>(value_count);
+	}
+
+	// AVERAGE of no values is NaN, which Execute reports as #DIV/0!
+	inline double FinishAggregate(Function function, double accumulator, double count) {
+		switch (function) {
+		case Function::Average:
+			return count > 0 ? accumulator / count : std::numeric_limits<double>::quiet_NaN();
+		case Function::Count:
+			return count;
+		case Function::Min:
+		case Function::Max:
+			return count > 0 ? accumulator : 0.0;
+		default:
+			return accumulator;
+		}
+	}
 }
 
 class ParsingError : public std::runtime_error {
@@ -17,33 +129,227 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-	explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-		std::forward_list<Position> cells);
-	FormulaAST(FormulaAST&&) = default;
-	FormulaAST& operator=(FormulaAST&&) = default;
+	// root_expr must live in the arena. The cells and the ranges are sorted and
+	// deduplicated in place and then copied into the arena, so the caller may
+	// reuse the vectors. The compiled program is optimized unless optimize is
+	// false: constant subexpressions are folded, repeated cell loads and
+	// repeated subexpressions are computed once. Either way evaluation gives
+	// bit-identical results. The references are offsets from the anchor the
+	// formula was parsed with
+	FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, std::vector<Position>& cells,
+		std::vector<Range>& ranges, bool optimize = true);
+	FormulaAST(FormulaAST&&);
+	FormulaAST& operator=(FormulaAST&&);
 	~FormulaAST();
 
-	double Execute(const std::function<double(Position)>& get_value_by_position) const;
-	void PrintCells(std::ostream& out) const;
-	void Print(std::ostream& out) const;
-	void PrintFormula(std::ostream& out) const;
+	// Either the computed number or the first error met during evaluation;
+	// errors travel as values, nothing is thrown
+	using Value = std::variant<double, FormulaError>;
+
+	// get_value_by_position is any callable taking the offset of a cell and
+	// returning Value; it's a template parameter so that the lookup can be
+	// inlined into the loop.
+	//
+	// for_each_range_values(Range range, Consumer consume) passes the numbers of
+	// the range, given by offsets as well, to consume(const double* values, size_t count), in one or more
+	// parts, skipping the cells that aren't numbers, and returns
+	// std::optional<FormulaError>: an error met in the range stops the formula.
+	template <typename Resolver, typename RangeResolver>
+	Value Execute(Resolver&& get_value_by_position, RangeResolver&& for_each_range_values) const;
+
+	// The same with the ranges read cell by cell, column by column, through
+	// get_value_by_position, so every cell of a range counts as a number or
+	// fails the formula
+	template <typename Resolver>
+	Value Execute(Resolver&& get_value_by_position) const;
+	// print the formula of the cell anchor
+	void PrintCells(std::ostream& out, Position anchor = { 0, 0 }) const;
+	void Print(std::ostream& out, Position anchor = { 0, 0 }) const;
+	void PrintFormula(std::ostream& out, Position anchor = { 0, 0 }) const;
+
+	// a view of an array stored in the arena
+	template <typename T>
+	class ArrayView {
+	public:
+		ArrayView(const T* begin, const T* end)
+			: begin_(begin)
+			, end_(end) {
+		}
 
-	std::forward_list<Position>& GetCells() {
-		return cells_;
+		const T* begin() const {
+			return begin_;
+		}
+		const T* end() const {
+			return end_;
+		}
+		size_t size() const {
+			return end_ - begin_;
+		}
+		bool empty() const {
+			return begin_ == end_;
+		}
+
+	private:
+		const T* begin_;
+		const T* end_;
+	};
+
+	// sorted lists of offsets without duplicates; the cells of the ranges
+	// aren't included into GetCells()
+	ArrayView<Position> GetCells() const {
+		return { cells_, cells_ + cell_count_ };
+	}
+
+	ArrayView<Range> GetRanges() const {
+		return { ranges_, ranges_ + range_count_ };
 	}
 
-	const std::forward_list<Position>& GetCells() const {
-		return cells_;
+	// the compiled program, for tests and benchmarks
+	ArrayView<ASTImpl::Instruction> GetProgram() const {
+		return { program_, program_ + program_size_ };
 	}
 
 private:
-	std::unique_ptr<ASTImpl::Expr> root_expr_;
+	// owns the tree, the cell list and the program below: a formula is parsed
+	// into one or two arena blocks instead of a heap allocation per node
+	Arena arena_;
+
+	const ASTImpl::Expr* root_expr_ = nullptr;
 
 	// physically stores cells so that they can be
 	// efficiently traversed without going through
 	// the whole AST
-	std::forward_list<Position> cells_;
+	const Position* cells_ = nullptr;
+	size_t cell_count_ = 0;
+	const Range* ranges_ = nullptr;
+	size_t range_count_ = 0;
+
+	// the tree above is kept for printing, evaluation runs this program
+	const ASTImpl::Instruction* program_ = nullptr;
+	size_t program_size_ = 0;
+	size_t stack_size_ = 0;
+	size_t local_count_ = 0;
 };
 
+template <typename Resolver, typename RangeResolver>
+FormulaAST::Value FormulaAST::Execute(Resolver&& get_value_by_position, RangeResolver&& for_each_range_values) const {
+	using OpCode = ASTImpl::Instruction::OpCode;
+
+	// the locals followed by the stack live on the machine stack unless the
+	// formula is unusually large
+	constexpr size_t INLINE_FRAME_SIZE = 32;
+	double inline_frame[INLINE_FRAME_SIZE];
+	std::vector<double> heap_frame;
+	double* locals = inline_frame;
+	if (local_count_ + stack_size_ > INLINE_FRAME_SIZE) {
+		heap_frame.resize(local_count_ + stack_size_);
+		locals = heap_frame.data();
+	}
+	double* stack = locals + local_count_;
+
+	size_t top = 0;
+	for (const auto* it = program_; it != program_ + program_size_; ++it) {
+		const auto& instruction = *it;
+		double result;
+		switch (instruction.op) {
+		case OpCode::PushNumber:
+			stack[top++] = instruction.number;
+			continue;
+		case OpCode::LoadCell: {
+			const Value value = get_value_by_position(instruction.cell);
+			if (const auto* error = std::get_if<FormulaError>(&value)) {
+				return *error;
+			}
+			stack[top++] = std::get<double>(value);
+			continue;
+		}
+		case OpCode::Negate:
+			stack[top - 1] = -stack[top - 1];
+			continue;
+		case OpCode::StoreLocal:
+			locals[instruction.local] = stack[top - 1];
+			continue;
+		case OpCode::PushLocal:
+			stack[top++] = locals[instruction.local];
+			continue;
+		case OpCode::BeginAggregate:
+			stack[top++] = ASTImpl::GetAggregateIdentity(instruction.function);
+			stack[top++] = 0.0;
+			continue;
+		case OpCode::AccumulateValue:
+			--top;
+			ASTImpl::AccumulateValues(instruction.function, stack[top - 2], stack[top - 1], &stack[top], 1);
+			continue;
+		case OpCode::AccumulateRange: {
+			double& accumulator = stack[top - 2];
+			double& count = stack[top - 1];
+			const std::optional<FormulaError> error = for_each_range_values(instruction.range,
+				[&accumulator, &count, function = instruction.function](const double* values, size_t value_count) {
+					ASTImpl::AccumulateValues(function, accumulator, count, values, value_count);
+				});
+			if (error) {
+				return *error;
+			}
+			continue;
+		}
+		case OpCode::EndAggregate:
+			result = ASTImpl::FinishAggregate(instruction.function, stack[top - 2], stack[top - 1]);
+			break;
+		case OpCode::Add:
+			result = stack[top - 2] + stack[top - 1];
+			break;
+		case OpCode::Subtract:
+			result = stack[top - 2] - stack[top - 1];
+			break;
+		case OpCode::Multiply:
+			result = stack[top - 2] * stack[top - 1];
+			break;
+		case OpCode::Divide:
+			result = stack[top - 2] / stack[top - 1];
+			break;
+		default:
+			assert(false);
+			result = 0.0;
+		}
+		if (!std::isfinite(result)) {
+			return FormulaError(FormulaError::Category::Div0);
+		}
+		stack[--top - 1] = result;
+	}
+	assert(top == 1);
+	return stack[0];
+}
+
+template <typename Resolver>
+FormulaAST::Value FormulaAST::Execute(Resolver&& get_value_by_position) const {
+	auto for_each_range_values = [&get_value_by_position](Range range, auto&& consume) -> std::optional<FormulaError> {
+		for (int col = range.first.col; col <= range.last.col; ++col) {
+			for (int row = range.first.row; row <= range.last.row; ++row) {
+				const Value value = get_value_by_position(Position{ row, col });
+				if (const auto* error = std::get_if<FormulaError>(&value)) {
+					return *error;
+				}
+				consume(&std::get<double>(value), 1);
+			}
+		}
+		return std::nullopt;
+	};
+	return Execute(get_value_by_position, for_each_range_values);
+}
+
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+FormulaAST ParseFormulaAST(const std::string& in_str);
+
+// Parses the same Formula.g4 grammar with a hand-written lexer and Pratt parser
+// instead of the ANTLR runtime; throws the same exceptions on invalid input.
+FormulaAST ParseFormulaASTFast(std::string_view in, bool optimize = true);
+// The same for the formula of the cell anchor: the references of the result are
+// offsets from anchor, like in the R1C1 notation. The tree doesn't depend on
+// anchor otherwise, so a formula copied down a column parses into equal trees
+FormulaAST ParseFormulaASTFast(std::string_view in, Position anchor, bool optimize = true);
+
+// Writes into key the tokens of the formula of the cell anchor with the cell
+// references replaced by their offsets from anchor. Formulas with equal keys
+// parse into equal trees given their anchors. Returns false when the formula
+// can't be lexed or references an invalid position: parsing reports the error
+bool MakeRelativeFormulaKey(std::string_view in, Position anchor, std::string& key);
\ No newline at end of file
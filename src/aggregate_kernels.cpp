@@ -0,0 +1,102 @@
+#include "aggregate_kernels.h"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AGGREGATE_KERNELS_SSE2
+#endif
+
+namespace {
+	struct SumOp {
+		static constexpr double IDENTITY = 0.0;
+
+		static double Apply(double lhs, double rhs) {
+			return lhs + rhs;
+		}
+#ifdef AGGREGATE_KERNELS_SSE2
+		static __m128d Apply(__m128d lhs, __m128d rhs) {
+			return _mm_add_pd(lhs, rhs);
+		}
+#endif
+	};
+
+	struct MinOp {
+		static constexpr double IDENTITY = std::numeric_limits<double>::infinity();
+
+		static double Apply(double lhs, double rhs) {
+			return std::min(lhs, rhs);
+		}
+#ifdef AGGREGATE_KERNELS_SSE2
+		static __m128d Apply(__m128d lhs, __m128d rhs) {
+			return _mm_min_pd(lhs, rhs);
+		}
+#endif
+	};
+
+	struct MaxOp {
+		static constexpr double IDENTITY = -std::numeric_limits<double>::infinity();
+
+		static double Apply(double lhs, double rhs) {
+			return std::max(lhs, rhs);
+		}
+#ifdef AGGREGATE_KERNELS_SSE2
+		static __m128d Apply(__m128d lhs, __m128d rhs) {
+			return _mm_max_pd(lhs, rhs);
+		}
+#endif
+	};
+
+	// За одну итерацию обрабатывается BLOCK_SIZE чисел четырьмя независимыми
+	// аккумуляторами, чтобы задержка сложения не ограничивала пропускную
+	// способность. Хвост короче блока сворачивается по одному числу.
+	template <typename Op>
+	double Reduce(const double* values, std::size_t count) {
+		constexpr std::size_t BLOCK_SIZE = 8;
+		std::size_t i = 0;
+		double result = Op::IDENTITY;
+#ifdef AGGREGATE_KERNELS_SSE2
+		__m128d acc0 = _mm_set1_pd(Op::IDENTITY);
+		__m128d acc1 = acc0;
+		__m128d acc2 = acc0;
+		__m128d acc3 = acc0;
+		for (; i + BLOCK_SIZE <= count; i += BLOCK_SIZE) {
+			acc0 = Op::Apply(acc0, _mm_loadu_pd(values + i));
+			acc1 = Op::Apply(acc1, _mm_loadu_pd(values + i + 2));
+			acc2 = Op::Apply(acc2, _mm_loadu_pd(values + i + 4));
+			acc3 = Op::Apply(acc3, _mm_loadu_pd(values + i + 6));
+		}
+		double lanes[2];
+		_mm_storeu_pd(lanes, Op::Apply(Op::Apply(acc0, acc1), Op::Apply(acc2, acc3)));
+		result = Op::Apply(lanes[0], lanes[1]);
+#else
+		double acc[BLOCK_SIZE];
+		std::fill(acc, acc + BLOCK_SIZE, Op::IDENTITY);
+		for (; i + BLOCK_SIZE <= count; i += BLOCK_SIZE) {
+			for (std::size_t lane = 0; lane < BLOCK_SIZE; ++lane) {
+				acc[lane] = Op::Apply(acc[lane], values[i + lane]);
+			}
+		}
+		for (std::size_t lane = 0; lane < BLOCK_SIZE; ++lane) {
+			result = Op::Apply(result, acc[lane]);
+		}
+#endif
+		for (; i < count; ++i) {
+			result = Op::Apply(result, values[i]);
+		}
+		return result;
+	}
+}  // namespace
+
+double SumValues(const double* values, std::size_t count) {
+	return Reduce<SumOp>(values, count);
+}
+
+double MinValue(const double* values, std::size_t count) {
+	return Reduce<MinOp>(values, count);
+}
+
+double MaxValue(const double* values, std::size_t count) {
+	return Reduce<MaxOp>(values, count);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+
+// Свёртки плотных массивов чисел для агрегатных функций формул. Массив
+// обрабатывается несколькими независимыми полосами: на x86-64 это векторы SSE2
+// по два числа, на остальных платформах - отдельные переменные, которые
+// компилятор может векторизовать сам. Поэтому сумма складывается не в
+// порядке следования элементов и может отличаться от последовательной в
+// последних битах.
+double SumValues(const double* values, std::size_t count);
+// Для пустого массива возвращают +inf и -inf соответственно
+double MinValue(const double* values, std::size_t count);
+double MaxValue(const double* values, std::size_t count);
@@ -0,0 +1,47 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace {
+	std::atomic<std::size_t> allocation_count{ 0 };
+	std::atomic<std::size_t> live_bytes{ 0 };
+
+	// Перед каждым блоком хранится его размер, чтобы operator delete без
+	// размера мог вычесть его из счётчика живой памяти. Отступ сохраняет
+	// выравнивание, которое гарантирует malloc.
+	constexpr std::size_t HEADER_SIZE = alignof(std::max_align_t);
+}  // namespace
+
+std::size_t GetAllocationCount() {
+	return allocation_count.load(std::memory_order_relaxed);
+}
+
+std::size_t GetLiveHeapBytes() {
+	return live_bytes.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	if (void* raw = std::malloc(size + HEADER_SIZE)) {
+		*static_cast<std::size_t*>(raw) = size;
+		live_bytes.fetch_add(size, std::memory_order_relaxed);
+		return static_cast<char*>(raw) + HEADER_SIZE;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	if (!ptr) {
+		return;
+	}
+	void* raw = static_cast<char*>(ptr) - HEADER_SIZE;
+	live_bytes.fetch_sub(*static_cast<std::size_t*>(raw), std::memory_order_relaxed);
+	std::free(raw);
+}
+
+void operator delete(void* ptr, std::size_t /* size */) noexcept {
+	operator delete(ptr);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+
+// Число вызовов глобального operator new с начала работы программы.
+// Подсчёт ведёт замена operator new в allocation_counter.cpp.
+std::size_t GetAllocationCount();
+
+// Суммарный размер блоков, выделенных глобальным operator new и ещё не
+// освобождённых. Служебные заголовки блоков и накладные расходы malloc не
+// учитываются.
+std::size_t GetLiveHeapBytes();
+
+// Считает выделения памяти, сделанные за время жизни объекта
+class AllocationCounter {
+public:
+	AllocationCounter()
+		: start_(GetAllocationCount()) {
+	}
+
+	std::size_t GetCount() const {
+		return GetAllocationCount() - start_;
+	}
+
+private:
+	std::size_t start_;
+};
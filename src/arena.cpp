@@ -0,0 +1,59 @@
+#include "arena.h"
+
+#include <algorithm>
+
+Arena::Arena(std::size_t first_block_size)
+	: next_block_size_(std::max<std::size_t>(first_block_size, 1)) {
+}
+
+Arena::Arena(Arena&& other) noexcept
+	: last_block_(other.last_block_)
+	, cursor_(other.cursor_)
+	, end_(other.end_)
+	, next_block_size_(other.next_block_size_) {
+	other.last_block_ = nullptr;
+	other.cursor_ = nullptr;
+	other.end_ = nullptr;
+}
+
+Arena& Arena::operator=(Arena&& other) noexcept {
+	if (this != &other) {
+		Release();
+		last_block_ = std::exchange(other.last_block_, nullptr);
+		cursor_ = std::exchange(other.cursor_, nullptr);
+		end_ = std::exchange(other.end_, nullptr);
+		next_block_size_ = other.next_block_size_;
+	}
+	return *this;
+}
+
+Arena::~Arena() {
+	Release();
+}
+
+std::size_t Arena::GetBlockCount() const {
+	std::size_t result = 0;
+	for (const Block* block = last_block_; block; block = block->previous) {
+		++result;
+	}
+	return result;
+}
+
+void Arena::AddBlock(std::size_t min_size) {
+	const std::size_t size = std::max(next_block_size_, min_size);
+	auto* block = new (::operator new(sizeof(Block) + size)) Block{ last_block_, size };
+	last_block_ = block;
+	cursor_ = reinterpret_cast<std::byte*>(block + 1);
+	end_ = cursor_ + size;
+	next_block_size_ = size * 2;
+}
+
+void Arena::Release() {
+	while (last_block_) {
+		Block* previous = last_block_->previous;
+		::operator delete(last_block_);
+		last_block_ = previous;
+	}
+	cursor_ = nullptr;
+	end_ = nullptr;
+}
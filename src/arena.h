@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Линейный распределитель памяти: объекты размещаются подряд в крупных блоках
+// и освобождаются все разом вместе с распределителем. Деструкторы размещённых
+// объектов не вызываются, поэтому допускаются только тривиально разрушаемые
+// типы. При перемещении распределителя блоки остаются на месте, так что
+// указатели на размещённые объекты не теряют силу.
+class Arena {
+public:
+	static constexpr std::size_t DEFAULT_BLOCK_SIZE = 256;
+
+	// Первый блок выделяется при первом размещении, каждый следующий вдвое
+	// больше предыдущего
+	explicit Arena(std::size_t first_block_size = DEFAULT_BLOCK_SIZE);
+	Arena(Arena&& other) noexcept;
+	Arena& operator=(Arena&& other) noexcept;
+	~Arena();
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* Allocate(std::size_t size, std::size_t alignment);
+
+	template <typename T, typename... Args>
+	T* Make(Args&&... args) {
+		static_assert(std::is_trivially_destructible_v<T>);
+		return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+
+	// Копирует count элементов, начиная с first. Для пустого массива
+	// возвращает nullptr и ничего не выделяет.
+	template <typename T>
+	T* MakeArray(const T* first, std::size_t count) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		if (count == 0) {
+			return nullptr;
+		}
+		T* result = static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+		std::memcpy(result, first, sizeof(T) * count);
+		return result;
+	}
+
+	std::size_t GetBlockCount() const;
+
+private:
+	// Заголовок в начале каждого блока; данные блока идут сразу за ним
+	struct alignas(std::max_align_t) Block {
+		Block* previous;
+		std::size_t size;
+	};
+
+	Block* last_block_ = nullptr;
+	std::byte* cursor_ = nullptr;
+	std::byte* end_ = nullptr;
+	std::size_t next_block_size_;
+
+	void AddBlock(std::size_t min_size);
+	void Release();
+};
+
+inline void* Arena::Allocate(std::size_t size, std::size_t alignment) {
+	assert(alignment <= alignof(Block) && (alignment & (alignment - 1)) == 0);
+	auto align = [alignment](std::byte* ptr) {
+		const auto address = reinterpret_cast<std::uintptr_t>(ptr);
+		return ptr + ((alignment - address % alignment) % alignment);
+	};
+	std::byte* result = cursor_ ? align(cursor_) : nullptr;
+	if (result == nullptr || result > end_ || static_cast<std::size_t>(end_ - result) < size) {
+		// начало нового блока выровнено по alignof(Block)
+		AddBlock(size);
+		result = cursor_;
+	}
+	cursor_ = result + size;
+	return result;
+}
@@ -0,0 +1,980 @@
+#include "benchmarks.h"
+
+#include "FormulaAST.h"
+#include "aggregate_kernels.h"
+#include "allocation_counter.h"
+#include "cell_storage.h"
+#include "dependency_graph.h"
+#include "log_duration.h"
+#include "numeric_columns.h"
+#include "sheet.h"
+#include "sheet_import.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+	template <typename Func>
+	double MeasureSeconds(Func func) {
+		const auto start = std::chrono::steady_clock::now();
+		func();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::vector<Position> MakeScatteredPositions(std::size_t count) {
+		std::mt19937 gen(42);
+		std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+		std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+		std::vector<Position> result(count);
+		for (auto& pos : result) {
+			pos = { rows(gen), cols(gen) };
+		}
+		return result;
+	}
+
+	// Память под указатели на ячейки в прежнем плотном представлении
+	// vector<vector<unique_ptr<Cell>>>, где каждая строка дорастает до
+	// максимального числа столбцов
+	std::size_t GetDenseMemoryUsage(Size size) {
+		return static_cast<std::size_t>(size.rows) * sizeof(std::vector<std::unique_ptr<Cell>>)
+			+ static_cast<std::size_t>(size.rows) * size.cols * sizeof(std::unique_ptr<Cell>);
+	}
+
+	void BenchmarkScatteredWrites(std::size_t count) {
+		Sheet sheet;
+		CellStorage storage;
+		Size bounds;
+		const auto positions = MakeScatteredPositions(count);
+		{
+			LOG_DURATION("sparse storage, "s + std::to_string(count) + " scattered writes"s);
+			for (Position pos : positions) {
+				storage[pos] = std::make_unique<Cell>(sheet, pos);
+				bounds.rows = std::max(bounds.rows, pos.row + 1);
+				bounds.cols = std::max(bounds.cols, pos.col + 1);
+			}
+		}
+		std::cerr << "  tiles: " << storage.GetTileCount()
+			<< ", sparse: " << storage.GetMemoryUsage() / 1024 << " KiB"
+			<< ", dense: " << GetDenseMemoryUsage(bounds) / 1024 << " KiB" << std::endl;
+	}
+
+	void BenchmarkBulkLoad(int rows, int cols) {
+		Sheet sheet;
+		LOG_DURATION("bulk load of "s + std::to_string(rows) + "x"s + std::to_string(cols) + " text cells"s);
+		for (int row = 0; row < rows; ++row) {
+			for (int col = 0; col < cols; ++col) {
+				sheet.SetCell({ row, col }, std::to_string(row + col));
+			}
+		}
+	}
+
+	// Столбцы-цепочки "=<ячейка выше>+1", записанные снизу вверх: при поячеечной
+	// загрузке каждая запись сбрасывает кэш всей уже загруженной части столбца
+	void BenchmarkBatchLoad(int rows, int cols) {
+		std::vector<std::string> texts;
+		std::vector<std::pair<Position, std::string_view>> cells;
+		texts.reserve(static_cast<std::size_t>(rows) * cols);
+		for (int row = rows - 1; row >= 0; --row) {
+			for (int col = 0; col < cols; ++col) {
+				texts.push_back(row == 0 ? "1"s : "="s + Position{ row - 1, col }.ToString() + "+1"s);
+			}
+		}
+		for (int row = rows - 1, i = 0; row >= 0; --row) {
+			for (int col = 0; col < cols; ++col) {
+				cells.push_back({ { row, col }, texts[i++] });
+			}
+		}
+
+		const std::string size = std::to_string(rows) + "x"s + std::to_string(cols);
+		const double serial_seconds = MeasureSeconds([&] {
+			Sheet sheet;
+			for (const auto& [pos, text] : cells) {
+				sheet.SetCell(pos, std::string(text));
+			}
+		});
+		const double batch_seconds = MeasureSeconds([&] {
+			Sheet sheet;
+			sheet.SetCells(cells);
+		});
+		std::cerr << "load "s << size << " formula chains: SetCell "s << serial_seconds * 1000 << " ms, SetCells "s
+			<< batch_seconds * 1000 << " ms"s << std::endl;
+	}
+
+	// Таблица, которая только считает переданные ей ячейки: измеряет разбор
+	// текста импортом без стоимости самой таблицы
+	class CountingSheet : public SheetInterface {
+	public:
+		void SetCell(Position /* pos */, std::string /* text */) override {
+			++cell_count_;
+		}
+		void SetCells(const std::vector<std::pair<Position, std::string_view>>& cells) override {
+			cell_count_ += cells.size();
+		}
+		const CellInterface* GetCell(Position /* pos */) const override {
+			return nullptr;
+		}
+		CellInterface* GetCell(Position /* pos */) override {
+			return nullptr;
+		}
+		void ClearCell(Position /* pos */) override {
+		}
+		Size GetPrintableSize() const override {
+			return {};
+		}
+		void PrintValues(std::ostream& /* output */) const override {
+		}
+		void PrintTexts(std::ostream& /* output */) const override {
+		}
+		void Recalculate() override {
+		}
+
+		std::size_t GetCellCount() const {
+			return cell_count_;
+		}
+
+	private:
+		std::size_t cell_count_ = 0;
+	};
+
+	// Загрузка текста в формате PrintTexts: построчно через SetCell, как
+	// пришлось бы без импорта, и импортом из потока и из файла. Отдельно
+	// измеряется разбор текста импортом без таблицы.
+	void BenchmarkImport(int rows, int cols) {
+		std::mt19937 gen(42);
+		std::uniform_int_distribution<int> kind_dist(0, 9);
+		std::string text;
+		for (int row = 0; row < rows; ++row) {
+			for (int col = 0; col < cols; ++col) {
+				if (col > 0) {
+					text += '\t';
+				}
+				const int kind = kind_dist(gen);
+				if (kind < 7 || col == 0) {
+					text += std::to_string(gen() % 1'000'000);
+				}
+				else if (kind < 9) {
+					text += "item "s + std::to_string(row);
+				}
+				else {
+					text += "="s + Position{ row, col - 1 }.ToString() + "+1"s;
+				}
+			}
+			text += '\n';
+		}
+		const double megabytes = static_cast<double>(text.size()) / (1 << 20);
+		auto report = [&](const std::string& name, double seconds) {
+			std::cerr << "import "s << rows << "x"s << cols << " ("s << megabytes << " MiB), "s << name << ": "s
+				<< seconds * 1000 << " ms, "s << megabytes / seconds << " MiB/s"s << std::endl;
+		};
+
+		report("SetCell per field"s, MeasureSeconds([&] {
+			Sheet sheet;
+			std::istringstream input(text);
+			std::string line;
+			for (int row = 0; std::getline(input, line); ++row) {
+				std::istringstream fields(line);
+				std::string field;
+				for (int col = 0; std::getline(fields, field, '\t'); ++col) {
+					if (!field.empty()) {
+						sheet.SetCell({ row, col }, field);
+					}
+				}
+			}
+		}));
+		CountingSheet counting_sheet;
+		report("ImportTexts, parsing only"s, MeasureSeconds([&] {
+			std::istringstream input(text);
+			ImportTexts(counting_sheet, input);
+		}));
+		report("ImportTexts"s, MeasureSeconds([&] {
+			Sheet sheet;
+			std::istringstream input(text);
+			ImportTexts(sheet, input);
+		}));
+		const auto path = std::filesystem::temp_directory_path() / "spreadsheet_import_benchmark.tsv";
+		std::ofstream(path, std::ios::binary) << text;
+		report("ImportTextsFile, parsing only"s, MeasureSeconds([&] {
+			ImportTextsFile(counting_sheet, path.string());
+		}));
+		report("ImportTextsFile"s, MeasureSeconds([&] {
+			Sheet sheet;
+			ImportTextsFile(sheet, path.string());
+		}));
+		std::filesystem::remove(path);
+	}
+
+	// Вывод таблицы в /dev/null: прежний способ через std::ostream ячейка за
+	// ячейкой, PrintValues в поток и запись прямо в файловый дескриптор
+	void BenchmarkExport(int rows, int cols) {
+		std::mt19937 gen(42);
+		std::uniform_int_distribution<int> kind_dist(0, 9);
+		std::vector<std::string> texts;
+		std::vector<std::pair<Position, std::string_view>> cells;
+		texts.reserve(static_cast<std::size_t>(rows) * cols);
+		for (int row = 0; row < rows; ++row) {
+			for (int col = 0; col < cols; ++col) {
+				const int kind = kind_dist(gen);
+				if (kind == 0) {
+					continue;
+				}
+				if (kind < 7 || col == 0) {
+					texts.push_back(std::to_string(gen() % 1'000'000));
+				}
+				else if (kind < 9) {
+					texts.push_back("item "s + std::to_string(row));
+				}
+				else {
+					texts.push_back("="s + Position{ row, col - 1 }.ToString() + "/7"s);
+				}
+				cells.push_back({ { row, col }, texts.back() });
+			}
+		}
+		Sheet sheet;
+		sheet.SetCells(cells);
+		std::ostringstream sizing;
+		sheet.PrintValues(sizing);
+		const double megabytes = static_cast<double>(sizing.str().size()) / (1 << 20);
+		auto report = [&](const std::string& name, double seconds) {
+			std::cerr << "export "s << rows << "x"s << cols << " values ("s << megabytes << " MiB) to /dev/null, "s << name
+				<< ": "s << seconds * 1000 << " ms, "s << megabytes / seconds << " MiB/s"s << std::endl;
+		};
+
+		std::ofstream null_stream("/dev/null");
+		report("std::ostream per cell"s, MeasureSeconds([&] {
+			const Size size = sheet.GetPrintableSize();
+			for (int row = 0; row < size.rows; ++row) {
+				for (int col = 0; col < size.cols; ++col) {
+					if (col > 0) {
+						null_stream << '\t';
+					}
+					if (const CellInterface* cell = sheet.GetCell({ row, col })) {
+						std::visit([&](const auto& value) {
+							null_stream << value;
+						}, cell->GetValue());
+					}
+				}
+				null_stream << '\n';
+			}
+			null_stream.flush();
+		}));
+		report("PrintValues"s, MeasureSeconds([&] {
+			sheet.PrintValues(null_stream);
+			null_stream.flush();
+		}));
+		std::FILE* null_file = std::fopen("/dev/null", "wb");
+		report("WriteValues"s, MeasureSeconds([&] {
+			sheet.WriteValues(fileno(null_file));
+		}));
+		report("WriteTexts"s, MeasureSeconds([&] {
+			sheet.WriteTexts(fileno(null_file));
+		}));
+		std::fclose(null_file);
+	}
+
+	// Таблица с вычисленными формулами восстанавливается из текста PrintTexts
+	// (импорт и пересчёт) и из двоичного снимка. Формулы протянуты вдоль
+	// строк, так что в снимке у них одна программа.
+	void BenchmarkSnapshot(int rows, int cols) {
+		std::mt19937 gen(42);
+		std::uniform_int_distribution<int> kind_dist(0, 9);
+		std::vector<std::string> texts;
+		std::vector<std::pair<Position, std::string_view>> cells;
+		texts.reserve(static_cast<std::size_t>(rows) * cols);
+		for (int row = 0; row < rows; ++row) {
+			for (int col = 0; col < cols; ++col) {
+				const int kind = kind_dist(gen);
+				if (kind < 6 || col == 0) {
+					texts.push_back(std::to_string(gen() % 1'000'000));
+				}
+				else if (kind < 8) {
+					texts.push_back("item "s + std::to_string(row));
+				}
+				else {
+					texts.push_back("="s + Position{ row, col - 1 }.ToString() + "/7"s);
+				}
+				cells.push_back({ { row, col }, texts.back() });
+			}
+		}
+		Sheet sheet;
+		sheet.SetCells(cells);
+		sheet.Recalculate();
+
+		const auto text_path = std::filesystem::temp_directory_path() / "spreadsheet_snapshot_benchmark.tsv";
+		const auto snapshot_path = std::filesystem::temp_directory_path() / "spreadsheet_snapshot_benchmark.bin";
+		{
+			std::ofstream text_file(text_path, std::ios::binary);
+			sheet.PrintTexts(text_file);
+		}
+		auto report = [&](const std::string& name, const std::filesystem::path& path, double seconds) {
+			std::cerr << "snapshot "s << rows << "x"s << cols << ", "s << name << " ("s
+				<< static_cast<double>(std::filesystem::file_size(path)) / (1 << 20) << " MiB): "s
+				<< seconds * 1000 << " ms"s << std::endl;
+		};
+		report("SaveSnapshot"s, snapshot_path, MeasureSeconds([&] {
+			std::ofstream snapshot_file(snapshot_path, std::ios::binary);
+			sheet.SaveSnapshot(snapshot_file);
+		}));
+		// таблица удаляется вне замера: это одинаковая для обоих способов
+		// стоимость освобождения объектов ячеек
+		std::unique_ptr<Sheet> loaded;
+		report("ImportTextsFile and Recalculate"s, text_path, MeasureSeconds([&] {
+			loaded = std::make_unique<Sheet>();
+			ImportTextsFile(*loaded, text_path.string());
+			loaded->Recalculate();
+		}));
+		loaded.reset();
+		report("LoadSnapshotFile"s, snapshot_path, MeasureSeconds([&] {
+			loaded = Sheet::LoadSnapshotFile(snapshot_path.string());
+		}));
+		loaded.reset();
+		std::filesystem::remove(text_path);
+		std::filesystem::remove(snapshot_path);
+	}
+
+	// Свёртка шириной cols: блок исходных чисел высотой rows и depth уровней
+	// формул такой же высоты, каждая ссылается на две ячейки уровня выше.
+	// Сравниваются ленивое вычисление при чтении и Recalculate на 1..N потоках.
+	void BenchmarkRecalculation(int rows, int cols, int depth) {
+		std::vector<std::string> texts;
+		std::vector<std::pair<Position, std::string_view>> cells;
+		texts.reserve(static_cast<std::size_t>(rows) * cols * (depth + 1));
+		for (int row = 0; row < rows * (depth + 1); ++row) {
+			for (int col = 0; col < cols; ++col) {
+				if (row < rows) {
+					texts.push_back(std::to_string((row * 31 + col) % 97));
+				}
+				else {
+					texts.push_back("=("s + Position{ row - rows, col }.ToString() + "+"s
+						+ Position{ row - rows, (col + 1) % cols }.ToString() + ")/2"s);
+				}
+				cells.push_back({ { row, col }, texts.back() });
+			}
+		}
+		auto touch = [](Sheet& sheet) {
+			sheet.SetCell({ 0, 0 }, "1000");
+			for (int col = 0; col < sheet.GetPrintableSize().cols; ++col) {
+				sheet.SetCell({ 1, col }, "1000");
+			}
+		};
+
+		const std::string name = "recalculate "s + std::to_string(cols) + "-column rollup, "s
+			+ std::to_string(rows * cols * depth) + " formulas"s;
+		{
+			Sheet sheet(1);
+			sheet.SetCells(cells);
+			touch(sheet);
+			const double seconds = MeasureSeconds([&] {
+				const Size size = sheet.GetPrintableSize();
+				for (int row = 0; row < size.rows; ++row) {
+					for (int col = 0; col < size.cols; ++col) {
+						sheet.GetCell({ row, col })->GetValueView();
+					}
+				}
+			});
+			std::cerr << name << ", lazy reads: "s << seconds * 1000 << " ms"s << std::endl;
+		}
+		std::vector<std::size_t> thread_counts = { 1 };
+		if (ThreadPool::GetDefaultThreadCount() > 1) {
+			thread_counts.push_back(ThreadPool::GetDefaultThreadCount());
+		}
+		for (std::size_t threads : thread_counts) {
+			Sheet sheet(threads);
+			sheet.SetCells(cells);
+			touch(sheet);
+			const double seconds = MeasureSeconds([&] {
+				sheet.Recalculate();
+			});
+			std::cerr << name << ", Recalculate on "s << threads << " threads: "s << seconds * 1000 << " ms"s << std::endl;
+		}
+	}
+
+	// Решётка префиксных сумм n x n: к нижней правой сумме от угла ведёт
+	// C(2n, n) путей, а сбросить кэш нужно у n * n ячеек
+	void BenchmarkPrefixSumInvalidation(int n) {
+		std::vector<std::string> texts;
+		std::vector<std::pair<Position, std::string_view>> cells;
+		texts.reserve(2 * static_cast<std::size_t>(n) * n);
+		for (int row = 0; row < n; ++row) {
+			for (int col = 0; col < n; ++col) {
+				texts.push_back(std::to_string(row + col));
+				cells.push_back({ { row, col }, texts.back() });
+				std::string text = "="s + Position{ row, col }.ToString();
+				if (row > 0) {
+					text += "+"s + Position{ row - 1, n + col }.ToString();
+				}
+				if (col > 0) {
+					text += "+"s + Position{ row, n + col - 1 }.ToString();
+				}
+				if (row > 0 && col > 0) {
+					text += "-"s + Position{ row - 1, n + col - 1 }.ToString();
+				}
+				texts.push_back(std::move(text));
+				cells.push_back({ { row, n + col }, texts.back() });
+			}
+		}
+		Sheet sheet;
+		sheet.SetCells(cells);
+		sheet.Recalculate();
+
+		const std::string name = std::to_string(n) + "x"s + std::to_string(n) + " prefix-sum grid"s;
+		const double invalidate_seconds = MeasureSeconds([&] {
+			sheet.SetCell({ 0, 0 }, "1"s);
+		});
+		const double repeated_seconds = MeasureSeconds([&] {
+			sheet.SetCell({ 0, 0 }, "2"s);
+		});
+		const double recalculate_seconds = MeasureSeconds([&] {
+			sheet.Recalculate();
+		});
+		std::cerr << "invalidate "s << name << ": "s << invalidate_seconds * 1000 << " ms, again while dirty: "s
+			<< repeated_seconds * 1000 << " ms, recalculate: "s << recalculate_seconds * 1000 << " ms"s << std::endl;
+	}
+
+	// Представление графа до перехода на DependencyGraph: ссылки и множества
+	// зависимых в хэш-таблицах по позиции, отдельный узел кучи на каждое ребро
+	class HashSetGraph {
+	public:
+		void SetReferences(Position pos, std::vector<Position> references) {
+			for (const Position& ref_pos : references) {
+				dependents_[ref_pos].insert(pos);
+			}
+			references_[pos] = std::move(references);
+		}
+
+		template <typename Callback>
+		void ForEachDependent(Position pos, Callback callback) const {
+			if (auto it = dependents_.find(pos); it != dependents_.end()) {
+				for (const Position& dependent_pos : it->second) {
+					callback(dependent_pos);
+				}
+			}
+		}
+
+	private:
+		std::unordered_map<Position, std::vector<Position>, PositionHasher> references_;
+		std::unordered_map<Position, std::unordered_set<Position, PositionHasher>, PositionHasher> dependents_;
+	};
+
+	// Граф из edge_count / 4 формул в таблице шириной GRAPH_WIDTH, каждая
+	// ссылается на четыре случайные ячейки из предыдущих GRAPH_WINDOW.
+	// Замеряется память на ячейку и обход всех зависимых от первых ячеек -
+	// то же, что делает сброс кэша после правки.
+	constexpr int GRAPH_WIDTH = 1000;
+	constexpr int GRAPH_WINDOW = 2000;
+	constexpr int GRAPH_ROOTS = 100;
+
+	template <typename Graph>
+	void BenchmarkGraphLayout(const std::string& name, int cell_count) {
+		auto position_of = [](int index) {
+			return Position{ index / GRAPH_WIDTH, index % GRAPH_WIDTH };
+		};
+		auto index_of = [](Position pos) {
+			return pos.row * GRAPH_WIDTH + pos.col;
+		};
+
+		std::size_t edge_count = 0;
+		const std::size_t bytes_before = GetLiveHeapBytes();
+		auto graph = std::make_unique<Graph>();
+		std::mt19937 gen(5);
+		const double build_seconds = MeasureSeconds([&] {
+			for (int i = 1; i < cell_count; ++i) {
+				std::uniform_int_distribution<int> previous(std::max(0, i - GRAPH_WINDOW), i - 1);
+				std::vector<Position> references;
+				for (int n = std::min(i, 4); static_cast<int>(references.size()) < n;) {
+					const Position ref_pos = position_of(previous(gen));
+					if (std::find(references.begin(), references.end(), ref_pos) == references.end()) {
+						references.push_back(ref_pos);
+					}
+				}
+				edge_count += references.size();
+				graph->SetReferences(position_of(i), std::move(references));
+			}
+		});
+		const std::size_t graph_bytes = GetLiveHeapBytes() - bytes_before;
+
+		std::vector<char> visited(cell_count);
+		std::vector<Position> stack;
+		std::size_t visited_count = 0;
+		const double traversal_seconds = MeasureSeconds([&] {
+			for (int i = 0; i < GRAPH_ROOTS; ++i) {
+				stack.push_back(position_of(i));
+				visited[i] = 1;
+			}
+			while (!stack.empty()) {
+				const Position pos = stack.back();
+				stack.pop_back();
+				++visited_count;
+				graph->ForEachDependent(pos, [&](Position dependent_pos) {
+					if (char& mark = visited[index_of(dependent_pos)]; !mark) {
+						mark = 1;
+						stack.push_back(dependent_pos);
+					}
+				});
+			}
+		});
+		const double release_seconds = MeasureSeconds([&] {
+			graph.reset();
+		});
+
+		std::cerr << name << " graph, "s << edge_count << " edges: "s
+			<< static_cast<double>(graph_bytes) / cell_count << " bytes/cell, "s
+			<< static_cast<double>(graph_bytes) / edge_count << " bytes/edge, build "s << build_seconds * 1000
+			<< " ms, traverse "s << visited_count << " cells "s << traversal_seconds * 1000
+			<< " ms, release "s << release_seconds * 1000 << " ms"s << std::endl;
+	}
+
+	void BenchmarkDependencyGraph(std::size_t edge_count) {
+		const int cell_count = static_cast<int>(std::min<std::size_t>(edge_count / 4 + 1,
+			static_cast<std::size_t>(Position::MAX_ROWS) * GRAPH_WIDTH));
+		BenchmarkGraphLayout<HashSetGraph>("hash-set"s, cell_count);
+		BenchmarkGraphLayout<DependencyGraph>("compact"s, cell_count);
+	}
+
+	// i-я ячейка цепочки; цепочка идёт по столбцам сверху вниз
+	Position GetChainPosition(int i) {
+		return { i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+	}
+
+	void BenchmarkDeepChainCycleCheck(int length) {
+		Sheet sheet;
+		sheet.SetCell(GetChainPosition(0), "1");
+		{
+			LOG_DURATION("build "s + std::to_string(length) + "-deep chain"s);
+			for (int i = 1; i < length; ++i) {
+				sheet.SetCell(GetChainPosition(i), "="s + GetChainPosition(i - 1).ToString() + "+1"s);
+			}
+		}
+		LOG_DURATION("reject cycle closing "s + std::to_string(length) + "-deep chain"s);
+		try {
+			sheet.SetCell(GetChainPosition(0), "="s + GetChainPosition(length - 1).ToString());
+		}
+		catch (const CircularDependencyException&) {
+		}
+	}
+
+	// Каждая ячейка ссылается на две ячейки предыдущей строки, так что число
+	// путей между первой и последней строкой растёт экспоненциально с глубиной
+	void BenchmarkDiamondLatticeCycleCheck(int rows, int cols) {
+		Sheet sheet;
+		const std::string size = std::to_string(rows) + "x"s + std::to_string(cols);
+		{
+			LOG_DURATION("build "s + size + " diamond lattice"s);
+			for (int col = 0; col < cols; ++col) {
+				sheet.SetCell({ 0, col }, "1");
+			}
+			for (int row = 1; row < rows; ++row) {
+				for (int col = 0; col < cols; ++col) {
+					sheet.SetCell({ row, col }, "="s + Position{ row - 1, col }.ToString()
+						+ "+"s + Position{ row - 1, (col + 1) % cols }.ToString());
+				}
+			}
+		}
+		LOG_DURATION("reject cycle closing "s + size + " diamond lattice"s);
+		try {
+			sheet.SetCell({ 0, 0 }, "="s + Position{ rows - 1, cols - 1 }.ToString());
+		}
+		catch (const CircularDependencyException&) {
+		}
+	}
+
+	void BenchmarkFormulaLoad(int rows, int cols) {
+		Sheet sheet;
+		LOG_DURATION("load "s + std::to_string(rows) + "x"s + std::to_string(cols) + " formula cells"s);
+		for (int row = 0; row < rows; ++row) {
+			for (int col = 0; col < cols; ++col) {
+				sheet.SetCell({ row, col + 1 }, "=("s + Position{ row, col }.ToString() + "+"s
+					+ Position{ row, 0 }.ToString() + ")*1.5-2/"s + std::to_string(row + 1));
+			}
+		}
+	}
+
+	std::vector<std::string> MakeFormulas(std::size_t count) {
+		std::mt19937 gen(7);
+		std::uniform_int_distribution<int> rows(0, 999);
+		std::uniform_int_distribution<int> cols(0, 25);
+		auto cell = [&] {
+			return Position{ rows(gen), cols(gen) }.ToString();
+		};
+		std::vector<std::string> result;
+		result.reserve(count);
+		for (std::size_t i = 0; i < count; ++i) {
+			result.push_back("("s + cell() + "+"s + cell() + ")*1.5-"s + cell() + "/("s
+				+ std::to_string(i % 100) + ".25+-"s + cell() + ")"s);
+		}
+		return result;
+	}
+
+	template <typename ParseFunc>
+	void BenchmarkParser(const std::string& name, const std::vector<std::string>& formulas, ParseFunc parse) {
+		const double seconds = MeasureSeconds([&] {
+			for (const auto& formula : formulas) {
+				parse(formula);
+			}
+		});
+		std::cerr << name << " parser: " << static_cast<long long>(formulas.size() / seconds)
+			<< " formulas/s" << std::endl;
+	}
+
+	void BenchmarkParsers(std::size_t count) {
+		const auto formulas = MakeFormulas(count);
+		BenchmarkParser("ANTLR", formulas, [](const std::string& formula) {
+			return ParseFormulaAST(formula);
+		});
+		BenchmarkParser("hand-written", formulas, [](const std::string& formula) {
+			return ParseFormulaASTFast(formula);
+		});
+	}
+
+	// Число выделений памяти и объём кучи на одну формулу, время разбора и
+	// вычисления готовых деревьев
+	void BenchmarkFormulaMemory(std::size_t count, int passes) {
+		const auto formulas = MakeFormulas(count);
+		std::vector<FormulaAST> asts;
+		asts.reserve(count);
+		const std::size_t live_bytes_before = GetLiveHeapBytes();
+		AllocationCounter counter;
+		const double parse_seconds = MeasureSeconds([&] {
+			for (const auto& formula : formulas) {
+				asts.push_back(ParseFormulaASTFast(formula));
+			}
+		});
+		const std::size_t allocations = counter.GetCount();
+		const std::size_t live_bytes = GetLiveHeapBytes() - live_bytes_before;
+
+		auto get_value = [](Position pos) -> FormulaAST::Value {
+			return static_cast<double>(pos.row + pos.col + 1);
+		};
+		double checksum = 0.0;
+		const double eval_seconds = MeasureSeconds([&] {
+			for (int pass = 0; pass < passes; ++pass) {
+				for (const auto& ast : asts) {
+					checksum += std::get<double>(ast.Execute(get_value));
+				}
+			}
+		});
+		const double destroy_seconds = MeasureSeconds([&] {
+			asts.clear();
+			asts.shrink_to_fit();
+		});
+		std::cerr << "formula AST memory: "s << static_cast<double>(allocations) / count << " allocations/formula, "s
+			<< (live_bytes - count * sizeof(FormulaAST)) / count << " heap bytes/formula; parse "s
+			<< parse_seconds * 1e9 / count << " ns, evaluate "s << eval_seconds * 1e9 / (count * passes)
+			<< " ns, destroy "s << destroy_seconds * 1e9 / count << " ns per formula (checksum "s << checksum << ")"s
+			<< std::endl;
+	}
+
+	// Разбор формул пулами разного размера: то же, что делает SetCells на
+	// этапе разбора
+	void BenchmarkParallelParsing(std::size_t count) {
+		const auto formulas = MakeFormulas(count);
+		std::vector<std::unique_ptr<FormulaInterface>> parsed(count);
+		std::vector<std::size_t> thread_counts = { 1 };
+		for (std::size_t threads = 2; threads <= ThreadPool::GetDefaultThreadCount(); threads *= 2) {
+			thread_counts.push_back(threads);
+		}
+		if (thread_counts.back() != ThreadPool::GetDefaultThreadCount()) {
+			thread_counts.push_back(ThreadPool::GetDefaultThreadCount());
+		}
+		double single_thread_seconds = 0.0;
+		for (std::size_t threads : thread_counts) {
+			ThreadPool pool(threads);
+			const double seconds = MeasureSeconds([&] {
+				pool.ParallelFor(count, 256, [&](std::size_t begin, std::size_t end) {
+					for (std::size_t i = begin; i < end; ++i) {
+						parsed[i] = ParseFormula(formulas[i]);
+					}
+				});
+			});
+			if (threads == 1) {
+				single_thread_seconds = seconds;
+			}
+			std::cerr << "parse "s << count << " formulas on "s << threads << " threads: "s
+				<< static_cast<std::size_t>(count / seconds) << " formulas/s, speedup "s
+				<< single_thread_seconds / seconds << std::endl;
+		}
+	}
+
+	template <typename Resolver>
+	void BenchmarkEvaluation(const std::string& name, const std::vector<FormulaAST>& asts, int passes, Resolver get_value) {
+		double checksum = 0.0;
+		const double seconds = MeasureSeconds([&] {
+			for (int pass = 0; pass < passes; ++pass) {
+				for (const auto& ast : asts) {
+					checksum += std::get<double>(ast.Execute(get_value));
+				}
+			}
+		});
+		std::cerr << "formula evaluation, " << name << ": " << static_cast<long long>(asts.size() * passes / seconds)
+			<< " evaluations/s (checksum " << checksum << ")" << std::endl;
+	}
+
+	void BenchmarkEvaluation(std::size_t formula_count, int passes) {
+		std::vector<FormulaAST> asts;
+		for (const auto& formula : MakeFormulas(formula_count)) {
+			asts.push_back(ParseFormulaASTFast(formula));
+		}
+		auto get_value = [](Position pos) -> FormulaAST::Value {
+			return static_cast<double>(pos.row + pos.col + 1);
+		};
+		BenchmarkEvaluation("std::function resolver", asts, passes, std::function<FormulaAST::Value(Position)>(get_value));
+		BenchmarkEvaluation("inlined resolver", asts, passes, get_value);
+	}
+
+	// Разбор и вычисление формул с константами и повторами с оптимизацией
+	// программы и без неё; ячейки читаются из хэш-таблицы, как из листа
+	void BenchmarkFormulaOptimization(std::size_t count, int passes) {
+		std::mt19937 gen(9);
+		std::uniform_int_distribution<int> coord(0, 99);
+		std::unordered_map<Position, double, PositionHasher> values;
+		std::vector<std::string> formulas;
+		formulas.reserve(count);
+		for (std::size_t i = 0; i < count; ++i) {
+			const std::string a = Position{ coord(gen), coord(gen) }.ToString();
+			const std::string b = Position{ coord(gen), coord(gen) }.ToString();
+			formulas.push_back("("s + a + "+"s + b + ")*("s + a + "+"s + b + ")/(2*3.5)+"s + a + "*"s + a + "-("s + a + "+"s + b
+				+ ")*(1+1/4)"s);
+		}
+		for (int row = 0; row < 100; ++row) {
+			for (int col = 0; col < 100; ++col) {
+				values[{ row, col }] = row * 0.5 + col;
+			}
+		}
+		auto get_value = [&values](Position pos) -> FormulaAST::Value {
+			return values.at(pos);
+		};
+		for (bool optimize : { false, true }) {
+			std::vector<FormulaAST> asts;
+			asts.reserve(count);
+			const double parse_seconds = MeasureSeconds([&] {
+				for (const auto& formula : formulas) {
+					asts.push_back(ParseFormulaASTFast(formula, optimize));
+				}
+			});
+			double checksum = 0.0;
+			const double eval_seconds = MeasureSeconds([&] {
+				for (int pass = 0; pass < passes; ++pass) {
+					for (const auto& ast : asts) {
+						checksum += std::get<double>(ast.Execute(get_value));
+					}
+				}
+			});
+			std::cerr << "formula program " << (optimize ? "optimized"s : "as written"s) << ": "
+				<< asts.front().GetProgram().size() << " instructions, parse " << parse_seconds * 1e9 / count
+				<< " ns, evaluate " << eval_seconds * 1e9 / (count * passes) << " ns per formula (checksum "
+				<< checksum << ")" << std::endl;
+		}
+	}
+
+	// Формулы, протянутые вниз по столбцам: =A1*B1, =A2*B2, ... Каждая разобранная
+	// отдельно формула хранит своё дерево и программу, в общей таблице листа
+	// все они делят одну программу
+	void BenchmarkFormulaInterning(int rows, int groups) {
+		std::vector<std::pair<Position, std::string>> texts;
+		for (int group = 0; group < groups; ++group) {
+			for (int row = 0; row < rows; ++row) {
+				const Position lhs{ row, group * 3 };
+				const Position rhs{ row, group * 3 + 1 };
+				texts.push_back({ { row, group * 3 + 2 }, lhs.ToString() + "*"s + rhs.ToString() });
+			}
+		}
+		const std::size_t count = texts.size();
+		std::vector<std::unique_ptr<FormulaInterface>> formulas(count);
+		auto measure = [&](const std::string& name, auto parse) {
+			const std::size_t live_bytes_before = GetLiveHeapBytes();
+			const double seconds = MeasureSeconds([&] {
+				for (std::size_t i = 0; i < count; ++i) {
+					formulas[i] = parse(texts[i].second, texts[i].first);
+				}
+			});
+			const std::size_t live_bytes = GetLiveHeapBytes() - live_bytes_before;
+			std::cerr << "fill-down of "s << count << " formulas, "s << name << ": parse "s << seconds * 1e9 / count
+				<< " ns, "s << live_bytes / count << " heap bytes per formula"s << std::endl;
+			formulas.clear();
+			formulas.resize(count);
+		};
+		measure("parsed separately"s, [](const std::string& text, Position /* pos */) {
+			return ParseFormula(text);
+		});
+		FormulaInterner interner;
+		measure("interned"s, [&interner](const std::string& text, Position pos) {
+			return interner.Parse(text, pos);
+		});
+
+		std::vector<std::string> cell_texts;
+		cell_texts.reserve(count);
+		std::vector<std::pair<Position, std::string_view>> cells;
+		cells.reserve(count);
+		for (const auto& [pos, text] : texts) {
+			cell_texts.push_back("="s + text);
+			cells.push_back({ pos, cell_texts.back() });
+		}
+		Sheet sheet;
+		const double load_seconds = MeasureSeconds([&] {
+			sheet.SetCells(cells);
+		});
+		std::cerr << "fill-down of "s << count << " formulas, SetCells: "s << load_seconds * 1e9 / count
+			<< " ns per formula, "s << sheet.GetFormulaProgramCount() << " program(s)"s << std::endl;
+	}
+
+	// Стоимость одной ссылки на ячейку при вычислении формулы через таблицу
+	void BenchmarkCellReference(int reference_count, int passes) {
+		Sheet sheet;
+		std::string text = "=A1"s;
+		sheet.SetCell({ 0, 0 }, "1");
+		for (int row = 1; row < reference_count; ++row) {
+			sheet.SetCell({ row, 0 }, std::to_string(row));
+			text += "+"s + Position{ row, 0 }.ToString();
+		}
+		const auto formula = ParseFormula(text.substr(1));
+		double checksum = 0.0;
+		const double seconds = MeasureSeconds([&] {
+			for (int pass = 0; pass < passes; ++pass) {
+				checksum += std::get<double>(formula->Evaluate(sheet));
+			}
+		});
+		std::cerr << "cell reference through the sheet: " << seconds * 1e9 / (static_cast<double>(reference_count) * passes)
+			<< " ns/reference (checksum " << checksum << ")" << std::endl;
+	}
+
+	// Сумма столбца длинной цепочкой сложений и функцией SUM по диапазону
+	void BenchmarkColumnSum(int rows, int passes) {
+		Sheet sheet;
+		std::string chain = Position{ 0, 0 }.ToString();
+		for (int row = 0; row < rows; ++row) {
+			sheet.SetCell({ row, 0 }, std::to_string(row % 100));
+			if (row > 0) {
+				chain += "+"s + Position{ row, 0 }.ToString();
+			}
+		}
+		const std::string range = "SUM("s + Position{ 0, 0 }.ToString() + ":"s + Position{ rows - 1, 0 }.ToString() + ")"s;
+		for (const auto& [name, text] : { std::pair{ "chain of additions"s, chain }, std::pair{ "SUM over a range"s, range } }) {
+			std::unique_ptr<FormulaInterface> formula;
+			const std::size_t live_bytes_before = GetLiveHeapBytes();
+			const double parse_seconds = MeasureSeconds([&] {
+				formula = ParseFormula(text);
+			});
+			const std::size_t live_bytes = GetLiveHeapBytes() - live_bytes_before;
+			double checksum = 0.0;
+			const double eval_seconds = MeasureSeconds([&] {
+				for (int pass = 0; pass < passes; ++pass) {
+					checksum += std::get<double>(formula->Evaluate(sheet));
+				}
+			});
+			std::cerr << "sum of " << rows << " cells, " << name << ": parse " << parse_seconds * 1e6 << " us, "
+				<< live_bytes << " heap bytes, evaluate " << eval_seconds * 1e9 / (static_cast<double>(rows) * passes)
+				<< " ns/cell (checksum " << checksum << ")" << std::endl;
+		}
+	}
+
+	// Пропускная способность суммы по столбцу: через объекты ячеек, напрямую по
+	// столбцам значений и формулой SUM, которая читает те же столбцы
+	void BenchmarkColumnScan(int rows, int passes) {
+		Sheet sheet;
+		for (int row = 0; row < rows; ++row) {
+			sheet.SetCell({ row, 0 }, row % 2 ? std::to_string(row % 100) : "=" + std::to_string(row % 100));
+		}
+		const Range column{ { 0, 0 }, { rows - 1, 0 } };
+		const auto formula = ParseFormula("SUM(" + column.ToString() + ")");
+		sheet.Recalculate();
+
+		auto report = [&](const std::string& name, auto sum) {
+			double checksum = 0.0;
+			const double seconds = MeasureSeconds([&] {
+				for (int pass = 0; pass < passes; ++pass) {
+					checksum += sum();
+				}
+			});
+			std::cerr << "column sum of " << rows << " cells, " << name << ": "
+				<< seconds * 1e9 / (static_cast<double>(rows) * passes) << " ns/cell (checksum " << checksum << ")" << std::endl;
+		};
+		report("through cell objects"s, [&] {
+			double result = 0.0;
+			for (int row = 0; row < rows; ++row) {
+				if (const CellInterface* cell = sheet.GetCell({ row, 0 })) {
+					const auto value = cell->GetNumericValue();
+					if (const auto* number = std::get_if<double>(&value)) {
+						result += *number;
+					}
+				}
+			}
+			return result;
+		});
+		const NumericColumns& columns = *sheet.GetNumericColumns();
+		report("numeric columns"s, [&] {
+			double result = 0.0;
+			columns.ForEachSegment(column, [&](Position, const double* numbers, const NumericColumns::Kind*, std::size_t count) {
+				result += SumValues(numbers, count);
+				return true;
+			});
+			return result;
+		});
+		report("SUM formula"s, [&] {
+			return std::get<double>(formula->Evaluate(sheet));
+		});
+	}
+
+	// Каждая строка - цепочка формул, начинающаяся либо с числа, либо с ошибки;
+	// error_share задаёт долю строк, по которым распространяется ошибка
+	void BenchmarkErrorPropagation(int rows, int cols, double error_share) {
+		Sheet sheet;
+		const int error_rows = static_cast<int>(rows * error_share);
+		for (int row = 0; row < rows; ++row) {
+			sheet.SetCell({ row, 0 }, row < error_rows ? "=1/0"s : "=1"s);
+			for (int col = 1; col < cols; ++col) {
+				sheet.SetCell({ row, col }, "="s + Position{ row, col - 1 }.ToString() + "*2+1"s);
+			}
+		}
+		LOG_DURATION("evaluate "s + std::to_string(rows) + "x"s + std::to_string(cols) + " formulas, "s
+			+ std::to_string(static_cast<int>(error_share * 100)) + "% in error"s);
+		for (int row = 0; row < rows; ++row) {
+			sheet.GetCell({ row, cols - 1 })->GetValue();
+		}
+	}
+
+}  // namespace
+
+void RunBenchmarks(std::size_t graph_edge_count) {
+	for (std::size_t count : { 1'000u, 10'000u, 100'000u }) {
+		BenchmarkScatteredWrites(count);
+	}
+	BenchmarkBulkLoad(1000, 100);
+	BenchmarkParsers(100'000);
+	BenchmarkFormulaMemory(200'000, 20);
+	BenchmarkEvaluation(10'000, 100);
+	BenchmarkFormulaOptimization(10'000, 100);
+	BenchmarkFormulaInterning(Position::MAX_ROWS, 12);
+	BenchmarkCellReference(100, 10'000);
+	BenchmarkColumnSum(500, 10'000);
+	BenchmarkColumnScan(Position::MAX_ROWS, 1000);
+	BenchmarkFormulaLoad(1000, 50);
+	BenchmarkBatchLoad(300, 100);
+	BenchmarkImport(Position::MAX_ROWS, 64);
+	BenchmarkExport(Position::MAX_ROWS, 64);
+	BenchmarkSnapshot(Position::MAX_ROWS, 64);
+	BenchmarkParallelParsing(200'000);
+	BenchmarkRecalculation(200, 500, 4);
+	BenchmarkPrefixSumInvalidation(500);
+	BenchmarkDependencyGraph(graph_edge_count);
+	BenchmarkErrorPropagation(1000, 100, 0.0);
+	BenchmarkErrorPropagation(1000, 100, 0.5);
+	BenchmarkDeepChainCycleCheck(100'000);
+	BenchmarkDiamondLatticeCycleCheck(200, 64);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+
+// Число рёбер графа зависимостей в замере его памяти и обхода
+constexpr std::size_t DEFAULT_GRAPH_BENCHMARK_EDGES = 10'000'000;
+
+// Запускает замеры производительности и выводит результаты в std::cerr.
+// Вызывается из main() при запуске с аргументом --bench; вторым аргументом
+// можно передать число рёбер для замера графа зависимостей.
+void RunBenchmarks(std::size_t graph_edge_count = DEFAULT_GRAPH_BENCHMARK_EDGES);
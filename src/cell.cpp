@@ -1,151 +1,346 @@
 ﻿#include "cell.h"
 #include "common.h"
+#include "sheet.h"
 
 #include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <optional>
+#include <type_traits>
 #include <variant>
 
+namespace {
+	bool IsSpace(char c) {
+		return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+	}
+
+	// Повторяет правила std::stod с помощью std::from_chars: ведущие пробелы и
+	// один знак допустимы, разбирается наибольший числовой префикс, включая
+	// шестнадцатеричный вида 0x1p4. Переполнение считается ошибкой.
+	FormulaInterface::Value ParseNumericText(std::string_view text) {
+		const FormulaError value_error(FormulaError::Category::Value);
+		while (!text.empty() && IsSpace(text.front())) {
+			text.remove_prefix(1);
+		}
+		bool negative = false;
+		if (!text.empty() && (text.front() == '+' || text.front() == '-')) {
+			negative = text.front() == '-';
+			text.remove_prefix(1);
+		}
+		if (text.empty() || text.front() == '+' || text.front() == '-') {
+			return value_error;
+		}
+
+		const char* first = text.data();
+		const char* last = text.data() + text.size();
+		double result = 0.0;
+		std::from_chars_result parsed{ first, std::errc::invalid_argument };
+		if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+			parsed = std::from_chars(first + 2, last, result, std::chars_format::hex);
+			if (parsed.ec == std::errc::invalid_argument) {
+				// "0x" без цифр - это просто ноль
+				parsed = std::from_chars(first, first + 1, result);
+			}
+		}
+		else {
+			parsed = std::from_chars(first, last, result);
+		}
+		if (parsed.ec != std::errc{}) {
+			return value_error;
+		}
+		return negative ? -result : result;
+	}
+
+	thread_local CacheStats* redirected_cache_stats = nullptr;
+}  // namespace
+
+CacheStats& CacheStats::operator+=(const CacheStats& other) {
+	hits += other.hits;
+	misses += other.misses;
+	invalidations += other.invalidations;
+	return *this;
+}
+
+CacheStatsRedirect::CacheStatsRedirect(CacheStats& stats)
+	: previous_(redirected_cache_stats) {
+	redirected_cache_stats = &stats;
+}
+
+CacheStatsRedirect::~CacheStatsRedirect() {
+	redirected_cache_stats = previous_;
+}
+
 class Cell::Impl {
 public:
-	virtual CellInterface::Value GetValue() const = 0;
-	virtual std::string GetText() const = 0;
+	virtual ~Impl() = default;
+	virtual bool IsEmpty() const = 0;
+	virtual CellInterface::ValueView GetValueView() const = 0;
+	virtual FormulaInterface::Value GetNumericValue() const = 0;
+	virtual std::string_view GetTextView() const = 0;
 	virtual void ClearCache() = 0;
+	virtual bool IsDirty() const = 0;
 	virtual std::vector<Position> GetReferencedCells() const = 0;
+	virtual std::vector<Range> GetReferencedRanges() const = 0;
+	virtual const FormulaInterface* GetFormula() const = 0;
 };
 
 class Cell::EmptyImpl : public Cell::Impl {
 public:
-	CellInterface::Value GetValue() const override {
-		return {};
+	bool IsEmpty() const override {
+		return true;
+	}
+	CellInterface::ValueView GetValueView() const override {
+		return std::string_view{};
+	}
+	FormulaInterface::Value GetNumericValue() const override {
+		return 0.0;
 	}
-	std::string GetText() const override {
+	std::string_view GetTextView() const override {
 		return {};
 	}
 	void ClearCache() override {}
+	bool IsDirty() const override {
+		return false;
+	}
 	std::vector<Position> GetReferencedCells() const override {
 		return {};
 	}
+	std::vector<Range> GetReferencedRanges() const override {
+		return {};
+	}
+	const FormulaInterface* GetFormula() const override {
+		return nullptr;
+	}
 };
 
 class Cell::TextImpl : public Cell::Impl {
 public:
 	TextImpl(std::string value)
-		: value_(std::move(value)) {
+		: value_(std::move(value))
+		, numeric_value_(ParseNumericText(std::get<std::string_view>(GetValueView()))) {
+	}
+	bool IsEmpty() const override {
+		return false;
+	}
+	CellInterface::ValueView GetValueView() const override {
+		std::string_view value = value_;
+		if (value.front() == ESCAPE_SIGN) {
+			value.remove_prefix(1);
+		}
+		return value;
 	}
-	CellInterface::Value GetValue() const override {
-		return value_.front() == ESCAPE_SIGN ? value_.substr(1) : value_;
+	FormulaInterface::Value GetNumericValue() const override {
+		return numeric_value_;
 	}
-	std::string GetText() const override {
+	std::string_view GetTextView() const override {
 		return value_;
 	}
 	void ClearCache() override {}
+	bool IsDirty() const override {
+		return false;
+	}
 	std::vector<Position> GetReferencedCells() const override {
 		return {};
 	}
+	std::vector<Range> GetReferencedRanges() const override {
+		return {};
+	}
+	const FormulaInterface* GetFormula() const override {
+		return nullptr;
+	}
 private:
 	std::string value_;
+	// текст разбирается как число один раз, при записи в ячейку
+	FormulaInterface::Value numeric_value_;
 };
 
 class Cell::FormulaImpl : public Cell::Impl {
 public:
-	FormulaImpl(const SheetInterface& sheet, std::string text)
-		: sheet_(sheet) {
-		using namespace std::literals;
-		try {
-			formula_ = ParseFormula(text);
+	FormulaImpl(const SheetInterface& sheet, CacheStats& stats, NumericColumns& columns, Position pos,
+		std::unique_ptr<FormulaInterface> formula)
+		: sheet_(sheet)
+		, stats_(stats)
+		, columns_(columns)
+		, pos_(pos)
+		, formula_(std::move(formula))
+		, text_(FORMULA_SIGN + formula_->GetExpression()) {
+		columns_.SetPending(pos_);
+	}
+	// Формула из снимка: выражение и значение уже известны
+	FormulaImpl(const SheetInterface& sheet, CacheStats& stats, NumericColumns& columns, Position pos,
+		std::unique_ptr<FormulaInterface> formula, std::string text, std::optional<FormulaInterface::Value> value)
+		: sheet_(sheet)
+		, stats_(stats)
+		, columns_(columns)
+		, pos_(pos)
+		, formula_(std::move(formula))
+		, text_(std::move(text))
+		, cached_value_(std::move(value)) {
+		if (cached_value_) {
+			columns_.SetValue(pos_, *cached_value_);
 		}
-		catch (...) {
-			throw FormulaException("Formula parsing error"s);
+		else {
+			columns_.SetPending(pos_);
 		}
 	}
-	CellInterface::Value GetValue() const override {
+	bool IsEmpty() const override {
+		return false;
+	}
+	CellInterface::ValueView GetValueView() const override {
+		CacheStats& stats = GetCacheStats();
 		if (cached_value_ != std::nullopt) {
-			return cached_value_.value();
-		}
-		auto result{ formula_->Evaluate(sheet_) };
-		if (std::holds_alternative<double>(result)) {
-			return std::get<double>(result);
+			++stats.hits;
 		}
 		else {
-			return std::get<FormulaError>(result);
+			++stats.misses;
+			cached_value_ = formula_->Evaluate(sheet_);
+			columns_.SetValue(pos_, *cached_value_);
 		}
+		if (const auto* value = std::get_if<double>(&*cached_value_)) {
+			return *value;
+		}
+		return std::get<FormulaError>(*cached_value_);
+	}
+	FormulaInterface::Value GetNumericValue() const override {
+		return std::visit([](auto value) -> FormulaInterface::Value {
+			if constexpr (std::is_same_v<decltype(value), std::string_view>) {
+				return FormulaError(FormulaError::Category::Value);
+			}
+			else {
+				return value;
+			}
+		}, GetValueView());
 	}
-	std::string GetText() const override {
-		return FORMULA_SIGN + formula_->GetExpression();
+	std::string_view GetTextView() const override {
+		return text_;
 	}
 	void ClearCache() override {
-		cached_value_ = std::nullopt;
+		if (cached_value_ != std::nullopt) {
+			cached_value_ = std::nullopt;
+			columns_.SetPending(pos_);
+			++GetCacheStats().invalidations;
+		}
+	}
+	bool IsDirty() const override {
+		return cached_value_ == std::nullopt;
 	}
 	std::vector<Position> GetReferencedCells() const override {
 		return formula_->GetReferencedCells();
 	}
+	std::vector<Range> GetReferencedRanges() const override {
+		return formula_->GetReferencedRanges();
+	}
+	const FormulaInterface* GetFormula() const override {
+		return formula_.get();
+	}
 private:
 	const SheetInterface& sheet_;
+	CacheStats& stats_;
+	// значение дублируется в столбец таблицы при каждом вычислении и сбросе
+	NumericColumns& columns_;
+	const Position pos_;
 	std::unique_ptr<FormulaInterface> formula_;
-	std::optional<CellInterface::Value> cached_value_;
+	// каноническое выражение строится один раз, а не при каждом чтении
+	const std::string text_;
+	mutable std::optional<FormulaInterface::Value> cached_value_;
+
+	CacheStats& GetCacheStats() const {
+		return redirected_cache_stats ? *redirected_cache_stats : stats_;
+	}
 };
 
-Cell::Cell(SheetInterface& sheet)
+Cell::Cell(Sheet& sheet, Position pos)
 	: impl_(std::make_unique<EmptyImpl>())
-	, sheet_(sheet) {
+	, sheet_(sheet)
+	, pos_(pos) {
 }
 
 Cell::~Cell() {}
 
 void Cell::Set(std::string text) {
-	std::unique_ptr<Impl> tmp;
 	if (text.empty()) {
-		tmp = std::make_unique<EmptyImpl>();
+		Clear();
 	}
 	else if (text[0] == FORMULA_SIGN && text.size() > 1u) {
-		tmp = std::make_unique<FormulaImpl>(sheet_, text.substr(1));
+		Set(sheet_.formulas_.Parse(std::string_view(text).substr(1), pos_));
 	}
 	else {
-		tmp = std::make_unique<TextImpl>(text);
+		impl_ = std::make_unique<TextImpl>(std::move(text));
+		const auto numeric_value = impl_->GetNumericValue();
+		if (std::holds_alternative<double>(numeric_value)) {
+			sheet_.numeric_columns_.SetValue(pos_, numeric_value);
+		}
+		else {
+			sheet_.numeric_columns_.SetText(pos_);
+		}
 	}
-	ClearDependentCellsCache();
-	UpdateDependencies(tmp);
-	impl_ = std::move(tmp);
+}
+
+void Cell::Set(std::unique_ptr<FormulaInterface> formula) {
+	impl_ = std::make_unique<FormulaImpl>(sheet_, sheet_.cache_stats_, sheet_.numeric_columns_, pos_, std::move(formula));
+}
+
+void Cell::Restore(std::unique_ptr<FormulaInterface> formula, std::string text,
+	std::optional<FormulaInterface::Value> value) {
+	impl_ = std::make_unique<FormulaImpl>(sheet_, sheet_.cache_stats_, sheet_.numeric_columns_, pos_, std::move(formula),
+		std::move(text), std::move(value));
 }
 
 void Cell::Clear() {
 	impl_ = std::make_unique<EmptyImpl>();
+	sheet_.numeric_columns_.SetEmpty(pos_);
+}
+
+bool Cell::IsEmpty() const {
+	return impl_->IsEmpty();
+}
+
+bool Cell::IsDirty() const {
+	return impl_->IsDirty();
 }
 
 Cell::Value Cell::GetValue() const {
-	return impl_->GetValue();
+	return std::visit([](auto value) -> Value {
+		if constexpr (std::is_same_v<decltype(value), std::string_view>) {
+			return std::string(value);
+		}
+		else {
+			return value;
+		}
+	}, impl_->GetValueView());
+}
+
+Cell::ValueView Cell::GetValueView() const {
+	return impl_->GetValueView();
+}
+
+std::variant<double, FormulaError> Cell::GetNumericValue() const {
+	return impl_->GetNumericValue();
 }
 
 std::string Cell::GetText() const {
-	return impl_->GetText();
+	return std::string(impl_->GetTextView());
+}
+
+std::string_view Cell::GetTextView() const {
+	return impl_->GetTextView();
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+	return impl_->GetFormula();
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-	return referenced_cells_;
+	return impl_->GetReferencedCells();
 }
 
-void Cell::ClearDependentCellsCache() {
-	for (auto dependent_cell : dependent_cells_) {
-		dependent_cell->impl_->ClearCache();
-		dependent_cell->ClearDependentCellsCache();
-	}
+std::vector<Range> Cell::GetReferencedRanges() const {
+	return impl_->GetReferencedRanges();
 }
 
-void Cell::UpdateDependencies(std::unique_ptr<Impl>& new_impl) {
-	for (const auto& ref_pos : GetReferencedCells()) {
-		Cell* cell_ptr = reinterpret_cast<Cell*>(sheet_.GetCell(ref_pos));
-		if (cell_ptr) {
-			cell_ptr->dependent_cells_.erase(this);
-		}
-	}
-	for (const auto& ref_pos : new_impl->GetReferencedCells()) {
-		Cell* cell_ptr = reinterpret_cast<Cell*>(sheet_.GetCell(ref_pos));
-		if (cell_ptr) {
-			cell_ptr->dependent_cells_.insert(this);
-		}
-	}
-	referenced_cells_ = new_impl->GetReferencedCells();
-}
\ No newline at end of file
+void Cell::ClearCache() {
+	impl_->ClearCache();
+}
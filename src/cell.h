@@ -2,13 +2,41 @@
 
 #include "common.h"
 #include "formula.h"
+#include "numeric_columns.h"
 
 #include <memory>
 #include <optional>
 #include <string>
-#include <unordered_set>
+#include <string_view>
 #include <vector>
 
+class Sheet;
+
+// Счётчики кэша значений формул, накапливаются за время жизни таблицы
+struct CacheStats {
+	std::size_t hits = 0;
+	std::size_t misses = 0;
+	std::size_t invalidations = 0;
+
+	CacheStats& operator+=(const CacheStats& other);
+};
+
+// Пока объект жив, обращения к кэшу формул на текущем потоке учитываются в
+// переданных счётчиках, а не в счётчиках таблицы. Счётчики таблицы не
+// атомарны, поэтому параллельный пересчёт копит их по потокам и складывает
+// после каждого уровня.
+class CacheStatsRedirect {
+public:
+	explicit CacheStatsRedirect(CacheStats& stats);
+	~CacheStatsRedirect();
+
+	CacheStatsRedirect(const CacheStatsRedirect&) = delete;
+	CacheStatsRedirect& operator=(const CacheStatsRedirect&) = delete;
+
+private:
+	CacheStats* previous_;
+};
+
 class Cell : public CellInterface {
 private:
 	class Impl;
@@ -17,23 +45,42 @@ private:
 	class FormulaImpl;
 
 public:
-	Cell(SheetInterface& sheet_);
+	Cell(Sheet& sheet, Position pos);
 	~Cell();
 
 	void Set(std::string text);
+	// Записывает в ячейку уже разобранную формулу
+	void Set(std::unique_ptr<FormulaInterface> formula);
+	// Записывает формулу из снимка таблицы: text - её выражение со знаком
+	// формулы, value - вычисленное значение, если оно было сохранено
+	void Restore(std::unique_ptr<FormulaInterface> formula, std::string text,
+		std::optional<FormulaInterface::Value> value);
 	void Clear();
 
+	bool IsEmpty() const;
+	// Формула, кэш которой сброшен и значение которой ещё не вычислено
+	bool IsDirty() const;
 	Value GetValue() const override;
+	ValueView GetValueView() const override;
+	std::variant<double, FormulaError> GetNumericValue() const override;
 	std::string GetText() const override;
+	std::string_view GetTextView() const;
+	// Формула ячейки или nullptr, если в ячейке не формула
+	const FormulaInterface* GetFormula() const;
 
 	std::vector<Position> GetReferencedCells() const override;
+	std::vector<Range> GetReferencedRanges() const override;
+	// Сбрасывает вычисленное значение формулы
+	void ClearCache();
 
 private:
-	std::unique_ptr<Impl> impl_;
-	SheetInterface& sheet_;
-	std::unordered_set<Cell*> dependent_cells_;
-	std::vector<Position> referenced_cells_;
+	friend class Sheet;
 
-	void ClearDependentCellsCache();
-	void UpdateDependencies(std::unique_ptr<Impl>& new_impl);
+	std::unique_ptr<Impl> impl_;
+	Sheet& sheet_;
+	// Ячейка сама поддерживает своё значение в столбцах таблицы
+	Position pos_;
+	// Номер ячейки среди грязных формул, действителен только внутри
+	// Sheet::Recalculate
+	mutable std::size_t recalculate_index_ = 0;
 };
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "cell_storage.h"
+
+#include "cell.h"
+
+CellStorage::CellStorage() = default;
+
+CellStorage::~CellStorage() = default;
+
+Cell* CellStorage::Find(Position pos) const {
+	auto it = tiles_.find(GetTileKey(pos));
+	if (it == tiles_.end()) {
+		return nullptr;
+	}
+	return (*it->second)[GetTileIndex(pos)].get();
+}
+
+const std::unique_ptr<Cell>* CellStorage::FindTileRow(Position pos) const {
+	auto it = tiles_.find(GetTileKey(pos));
+	if (it == tiles_.end()) {
+		return nullptr;
+	}
+	return it->second->data() + static_cast<std::size_t>(pos.row & TILE_MASK) * TILE_SIZE;
+}
+
+std::unique_ptr<Cell>& CellStorage::operator[](Position pos) {
+	auto& tile = tiles_[GetTileKey(pos)];
+	if (!tile) {
+		tile = std::make_unique<Tile>();
+	}
+	return (*tile)[GetTileIndex(pos)];
+}
+
+std::size_t CellStorage::GetTileCount() const {
+	return tiles_.size();
+}
+
+std::size_t CellStorage::GetMemoryUsage() const {
+	// узел хэш-таблицы: ключ, указатель на блок, указатель на следующий узел и хэш
+	const std::size_t node_size = sizeof(std::uint32_t) + sizeof(std::unique_ptr<Tile>) + 2 * sizeof(void*);
+	return sizeof(*this)
+		+ tiles_.bucket_count() * sizeof(void*)
+		+ tiles_.size() * (node_size + sizeof(Tile));
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+class Cell;
+
+// Разреженное хранилище ячеек. Таблица разбита на квадратные блоки
+// TILE_SIZE x TILE_SIZE, в памяти хранятся только блоки, в которые
+// была записана хотя бы одна ячейка. Поиск ячейки - одно обращение к
+// хэш-таблице блоков и индексация внутри блока.
+class CellStorage {
+public:
+	static constexpr int TILE_BITS = 3;
+	static constexpr int TILE_SIZE = 1 << TILE_BITS;
+
+	CellStorage();
+	~CellStorage();
+
+	Cell* Find(Position pos) const;
+	// Слоты строки pos.row в столбцах блока, в котором лежит pos: TILE_SIZE
+	// подряд идущих слотов, начиная со столбца, кратного TILE_SIZE, или
+	// nullptr, если блока нет
+	const std::unique_ptr<Cell>* FindTileRow(Position pos) const;
+	// Возвращает слот ячейки, создавая блок при необходимости
+	std::unique_ptr<Cell>& operator[](Position pos);
+
+	template <typename Callback>
+	void ForEach(Callback callback) const;
+
+	std::size_t GetTileCount() const;
+	// Оценка памяти, занимаемой блоками и хэш-таблицей (без самих ячеек)
+	std::size_t GetMemoryUsage() const;
+
+private:
+	static constexpr int TILE_MASK = TILE_SIZE - 1;
+	static constexpr int TILES_PER_ROW = Position::MAX_COLS >> TILE_BITS;
+
+	using Tile = std::array<std::unique_ptr<Cell>, TILE_SIZE * TILE_SIZE>;
+
+	std::unordered_map<std::uint32_t, std::unique_ptr<Tile>> tiles_;
+
+	static std::uint32_t GetTileKey(Position pos) {
+		return static_cast<std::uint32_t>(pos.row >> TILE_BITS) * TILES_PER_ROW
+			+ static_cast<std::uint32_t>(pos.col >> TILE_BITS);
+	}
+
+	static std::size_t GetTileIndex(Position pos) {
+		return static_cast<std::size_t>(pos.row & TILE_MASK) * TILE_SIZE + (pos.col & TILE_MASK);
+	}
+};
+
+template <typename Callback>
+void CellStorage::ForEach(Callback callback) const {
+	for (const auto& [key, tile] : tiles_) {
+		const int first_row = static_cast<int>(key / TILES_PER_ROW) << TILE_BITS;
+		const int first_col = static_cast<int>(key % TILES_PER_ROW) << TILE_BITS;
+		for (std::size_t i = 0; i < tile->size(); ++i) {
+			if ((*tile)[i]) {
+				callback(Position{ first_row + static_cast<int>(i / TILE_SIZE), first_col + static_cast<int>(i % TILE_SIZE) },
+					*(*tile)[i]);
+			}
+		}
+	}
+}
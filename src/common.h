@@ -1,10 +1,12 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -26,6 +28,24 @@ struct Position {
 	static const Position NONE;
 };
 
+// Прямоугольный диапазон ячеек вида A1:B5, обе угловые ячейки входят в него
+struct Range {
+	Position first;  // левый верхний угол
+	Position last;   // правый нижний угол
+
+	bool operator==(Range rhs) const;
+	bool operator<(Range rhs) const;
+
+	// Обе позиции допустимы и first не правее и не ниже last
+	bool IsValid() const;
+	bool Contains(Position pos) const;
+	size_t GetCellCount() const;
+	std::string ToString() const;
+
+	// Диапазон с углами в позициях a и b в любом порядке
+	static Range FromCorners(Position a, Position b);
+};
+
 struct Size {
 	int rows = 0;
 	int cols = 0;
@@ -106,6 +126,14 @@ public:
 	// В случае текстовой ячейки это её текст (без экранирующих символов). В
 	// случае формулы - числовое значение формулы или сообщение об ошибке.
 	virtual Value GetValue() const = 0;
+	// То же значение, но без копирования текста: string_view указывает на
+	// внутренний буфер ячейки и действителен, пока ячейка не изменена.
+	using ValueView = std::variant<std::string_view, double, FormulaError>;
+	virtual ValueView GetValueView() const = 0;
+	// Значение ячейки как операнда формулы: число либо ошибка. Текст трактуется
+	// как число по правилам std::stod (ведущие пробелы и знак допустимы,
+	// разбирается наибольший числовой префикс), иначе это ошибка #VALUE!.
+	virtual std::variant<double, FormulaError> GetNumericValue() const = 0;
 	// Возвращает внутренний текст ячейки, как если бы мы начали её
 	// редактирование. В случае текстовой ячейки это её текст (возможно,
 	// содержащий экранирующие символы). В случае формулы - её выражение.
@@ -113,14 +141,20 @@ public:
 
 	// Возвращает список ячеек, которые непосредственно задействованы в данной
 	// формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-	// ячеек. В случае текстовой ячейки список пуст.
+	// ячеек. В случае текстовой ячейки список пуст. Ячейки из диапазонов сюда
+	// не входят: диапазоны возвращаются целиком методом GetReferencedRanges().
 	virtual std::vector<Position> GetReferencedCells() const = 0;
+	// Возвращает диапазоны, которые задействованы в формуле, например в
+	// SUM(A1:A100). Список отсортирован и не содержит повторов.
+	virtual std::vector<Range> GetReferencedRanges() const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
 // Интерфейс таблицы
+class NumericColumns;
+
 class SheetInterface {
 public:
 	virtual ~SheetInterface() = default;
@@ -140,6 +174,16 @@ public:
 	// начать текст со знака "=", но чтобы он не интерпретировался как формула.
 	virtual void SetCell(Position pos, std::string text) = 0;
 
+	// Задаёт содержимое сразу нескольких ячеек. Результат тот же, что у
+	// последовательных вызовов SetCell(), но все формулы разбираются заранее, а
+	// граф зависимостей проверяется на циклы один раз для всего набора. Если
+	// какая-то формула синтаксически некорректна, бросается FormulaException,
+	// если набор порождает циклические зависимости - CircularDependencyException
+	// со списком всех ячеек, входящих в циклы. В обоих случаях таблица не
+	// изменяется. Если позиция встречается в наборе несколько раз, действует
+	// последнее значение.
+	virtual void SetCells(const std::vector<std::pair<Position, std::string_view>>& cells) = 0;
+
 	// Возвращает значение ячейки.
 	// Если ячейка пуста, может вернуть nullptr.
 	virtual const CellInterface* GetCell(Position pos) const = 0;
@@ -161,6 +205,19 @@ public:
 	// соответственно. Пустая ячейка представляется пустой строкой в любом случае.
 	virtual void PrintValues(std::ostream& output) const = 0;
 	virtual void PrintTexts(std::ostream& output) const = 0;
+
+	// Вычисляет значения всех формул, кэш которых сброшен. Формулы
+	// упорядочиваются по уровням графа зависимостей: формулы одного уровня
+	// ссылаются только на ячейки предыдущих уровней и вычисляются параллельно.
+	// Без этого вызова значения по-прежнему вычисляются лениво при чтении.
+	virtual void Recalculate() = 0;
+
+	// Столбцы последних вычисленных значений ячеек, через которые формулы
+	// читают ссылки и диапазоны, не обращаясь к объектам ячеек. Таблица, которая
+	// их не ведёт, возвращает nullptr, и формулы читают ячейки через GetCell().
+	virtual const NumericColumns* GetNumericColumns() const {
+		return nullptr;
+	}
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -0,0 +1,445 @@
+#include "dependency_graph.h"
+
+#include "snapshot_io.h"
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+#include <utility>
+
+using namespace std::literals;
+
+namespace {
+	// Узел в снимке; за записями всех узлов идут номера узлов, на которые они
+	// ссылаются, а за ними диапазоны, и то и другое в порядке узлов
+	struct NodeRecord {
+		Position pos;
+		std::uint32_t reference_count = 0;
+		std::uint32_t range_count = 0;
+	};
+
+	// Ссылки в том виде, в каком они хранятся в графе: без недопустимых
+	// позиций и повторов, по возрастанию
+	void NormalizeReferences(std::vector<Position>& references, std::vector<Range>& ranges) {
+		references.erase(std::remove_if(references.begin(), references.end(), [](Position ref_pos) {
+			return !ref_pos.IsValid();
+		}), references.end());
+		std::sort(references.begin(), references.end());
+		references.erase(std::unique(references.begin(), references.end()), references.end());
+		ranges.erase(std::remove_if(ranges.begin(), ranges.end(), [](const Range& range) {
+			return !range.IsValid();
+		}), ranges.end());
+		std::sort(ranges.begin(), ranges.end());
+		ranges.erase(std::unique(ranges.begin(), ranges.end()), ranges.end());
+	}
+}  // namespace
+
+DependencyGraph::EdgeList::EdgeList(EdgeList&& other) noexcept
+	: size_(other.size_)
+	, capacity_(other.capacity_) {
+	if (other.IsInline()) {
+		std::copy(other.inline_, other.inline_ + other.size_, inline_);
+	}
+	else {
+		heap_ = other.heap_;
+	}
+	other.size_ = 0;
+	other.capacity_ = INLINE_CAPACITY;
+}
+
+DependencyGraph::EdgeList& DependencyGraph::EdgeList::operator=(EdgeList&& other) noexcept {
+	if (this != &other) {
+		this->~EdgeList();
+		new (this) EdgeList(std::move(other));
+	}
+	return *this;
+}
+
+DependencyGraph::EdgeList::~EdgeList() {
+	if (!IsInline()) {
+		delete[] heap_;
+	}
+}
+
+void DependencyGraph::EdgeList::push_back(NodeId id) {
+	if (size_ == capacity_) {
+		const std::uint32_t new_capacity = capacity_ * 2;
+		NodeId* new_heap = new NodeId[new_capacity];
+		std::copy(begin(), end(), new_heap);
+		if (!IsInline()) {
+			delete[] heap_;
+		}
+		heap_ = new_heap;
+		capacity_ = new_capacity;
+	}
+	(IsInline() ? inline_ : heap_)[size_++] = id;
+}
+
+void DependencyGraph::EdgeList::Erase(NodeId id) {
+	NodeId* data = IsInline() ? inline_ : heap_;
+	NodeId* it = std::find(data, data + size_, id);
+	assert(it != data + size_);
+	*it = data[--size_];
+}
+
+void DependencyGraph::EdgeList::clear() {
+	if (!IsInline()) {
+		delete[] heap_;
+	}
+	size_ = 0;
+	capacity_ = INLINE_CAPACITY;
+}
+
+std::size_t DependencyGraph::EdgeList::GetHeapBytes() const {
+	return IsInline() ? 0 : capacity_ * sizeof(NodeId);
+}
+
+DependencyGraph::DependencyGraph()
+	: index_(16, EMPTY_SLOT) {
+}
+
+void DependencyGraph::SetReferences(Position pos, std::vector<Position> references, std::vector<Range> ranges) {
+	NodeId id = FindNode(pos);
+	if (id != NO_NODE) {
+		for (NodeId ref_id : nodes_[id].references) {
+			nodes_[ref_id].dependents.Erase(id);
+			ReleaseNodeIfUnused(ref_id);
+		}
+		edge_count_ -= nodes_[id].references.size();
+		nodes_[id].references.clear();
+		RemoveRanges(id);
+	}
+
+	NormalizeReferences(references, ranges);
+	if (references.empty() && ranges.empty()) {
+		if (id != NO_NODE) {
+			ReleaseNodeIfUnused(id);
+		}
+		return;
+	}
+
+	if (id == NO_NODE) {
+		id = GetOrCreateNode(pos);
+	}
+	for (const Position& ref_pos : references) {
+		// узлы создаются до того, как берутся ссылки на элементы nodes_
+		const NodeId ref_id = GetOrCreateNode(ref_pos);
+		nodes_[ref_id].dependents.push_back(id);
+		nodes_[id].references.push_back(ref_id);
+	}
+	edge_count_ += references.size();
+	if (!ranges.empty()) {
+		AddRanges(id, std::move(ranges));
+	}
+}
+
+bool DependencyGraph::HasDependents(Position pos) const {
+	bool result = false;
+	ForEachDependent(pos, [&result](Position) {
+		result = true;
+	});
+	return result;
+}
+
+bool DependencyGraph::HasReferences(Position pos) const {
+	const NodeId id = FindNode(pos);
+	return id != NO_NODE && HasReferences(id);
+}
+
+// Ссылки узла записываются в SetReferences по возрастанию позиций, и Save
+// сохраняет их порядок, так что списки сравниваются поэлементно
+bool DependencyGraph::HasSameReferences(Position pos, std::vector<Position> references, std::vector<Range> ranges) const {
+	NormalizeReferences(references, ranges);
+	const NodeId id = FindNode(pos);
+	if (id == NO_NODE) {
+		return references.empty() && ranges.empty();
+	}
+	const EdgeList& node_references = nodes_[id].references;
+	if (!std::equal(node_references.begin(), node_references.end(), references.begin(), references.end(),
+		[this](NodeId ref_id, Position ref_pos) {
+			return nodes_[ref_id].pos == ref_pos;
+		})) {
+		return false;
+	}
+	const auto it = node_ranges_.find(id);
+	return it != node_ranges_.end() ? it->second == ranges : ranges.empty();
+}
+
+std::size_t DependencyGraph::GetNodeCount() const {
+	return nodes_.size() - free_nodes_.size();
+}
+
+std::size_t DependencyGraph::GetEdgeCount() const {
+	return edge_count_;
+}
+
+std::size_t DependencyGraph::GetMemoryUsage() const {
+	std::size_t result = nodes_.capacity() * sizeof(Node)
+		+ free_nodes_.capacity() * sizeof(NodeId)
+		+ index_.capacity() * sizeof(std::uint64_t);
+	for (const Node& node : nodes_) {
+		result += node.references.GetHeapBytes() + node.dependents.GetHeapBytes();
+	}
+	for (const auto& [id, ranges] : node_ranges_) {
+		result += sizeof(std::pair<const NodeId, std::vector<Range>>) + ranges.capacity() * sizeof(Range);
+	}
+	for (const auto& [key, edges] : range_tiles_) {
+		result += sizeof(std::pair<const std::uint32_t, std::vector<RangeEdge>>) + edges.capacity() * sizeof(RangeEdge);
+	}
+	return result;
+}
+
+// Узлы записываются по возрастанию позиций
+void DependencyGraph::Save(SnapshotWriter& writer) const {
+	std::vector<bool> is_free(nodes_.size());
+	for (NodeId id : free_nodes_) {
+		is_free[id] = true;
+	}
+	std::vector<NodeId> live_nodes;
+	live_nodes.reserve(GetNodeCount());
+	for (NodeId id = 0; id < nodes_.size(); ++id) {
+		if (!is_free[id]) {
+			live_nodes.push_back(id);
+		}
+	}
+	std::sort(live_nodes.begin(), live_nodes.end(), [this](NodeId lhs, NodeId rhs) {
+		return GetKey(nodes_[lhs].pos) < GetKey(nodes_[rhs].pos);
+	});
+	std::vector<NodeId> new_ids(nodes_.size(), NO_NODE);
+	for (NodeId i = 0; i < live_nodes.size(); ++i) {
+		new_ids[live_nodes[i]] = i;
+	}
+
+	auto find_ranges = [this](NodeId id) -> const std::vector<Range>* {
+		if (node_ranges_.empty()) {
+			return nullptr;
+		}
+		auto it = node_ranges_.find(id);
+		return it != node_ranges_.end() ? &it->second : nullptr;
+	};
+	std::vector<NodeRecord> records;
+	records.reserve(live_nodes.size());
+	std::vector<NodeId> references;
+	references.reserve(edge_count_);
+	for (NodeId id : live_nodes) {
+		const Node& node = nodes_[id];
+		const auto* ranges = find_ranges(id);
+		records.push_back({ node.pos, node.references.size(), ranges ? static_cast<std::uint32_t>(ranges->size()) : 0 });
+		for (NodeId ref_id : node.references) {
+			references.push_back(new_ids[ref_id]);
+		}
+	}
+	writer.Write(static_cast<std::uint32_t>(records.size()));
+	writer.WriteArray(records.data(), records.size());
+	writer.WriteArray(references.data(), references.size());
+	for (NodeId id : live_nodes) {
+		if (const auto* ranges = find_ranges(id)) {
+			writer.WriteArray(ranges->data(), ranges->size());
+		}
+	}
+}
+
+// Узлы получают номера в порядке записи, то есть по возрастанию позиций.
+// Индекс сразу создаётся нужного размера, списки смежности заполняются без
+// поиска узлов по позициям.
+void DependencyGraph::Load(SnapshotReader& reader) {
+	assert(nodes_.empty());
+	const auto node_count = reader.Read<std::uint32_t>();
+	const auto records = reader.ReadArray<NodeRecord>(node_count);
+
+	std::size_t index_capacity = index_.size();
+	while (index_capacity < 2 * static_cast<std::size_t>(node_count)) {
+		index_capacity *= 2;
+	}
+	index_.assign(index_capacity, EMPTY_SLOT);
+	nodes_.resize(node_count);
+	std::size_t reference_count = 0;
+	std::size_t range_count = 0;
+	for (NodeId id = 0; id < node_count; ++id) {
+		const NodeRecord record = records[id];
+		// возрастание позиций исключает и повторы узлов
+		if (!record.pos.IsValid() || (id > 0 && GetKey(nodes_[id - 1].pos) >= GetKey(record.pos))) {
+			throw SnapshotException("Snapshot has an invalid graph node position"s);
+		}
+		nodes_[id].pos = record.pos;
+		const std::uint32_t key = GetKey(record.pos);
+		std::size_t slot = GetSlot(key);
+		while (index_[slot] != EMPTY_SLOT) {
+			slot = (slot + 1) & (index_.size() - 1);
+		}
+		index_[slot] = static_cast<std::uint64_t>(key) << 32 | id;
+		++index_size_;
+		reference_count += record.reference_count;
+		range_count += record.range_count;
+	}
+
+	const auto references = reader.ReadArray<NodeId>(reference_count);
+	std::size_t next = 0;
+	for (NodeId id = 0; id < node_count; ++id) {
+		for (std::uint32_t i = records[id].reference_count; i > 0; --i) {
+			const NodeId ref_id = references[next++];
+			if (ref_id >= node_count) {
+				throw SnapshotException("Snapshot has an invalid graph edge"s);
+			}
+			nodes_[id].references.push_back(ref_id);
+			nodes_[ref_id].dependents.push_back(id);
+		}
+	}
+	edge_count_ = reference_count;
+
+	const auto ranges = reader.ReadArray<Range>(range_count);
+	next = 0;
+	for (NodeId id = 0; id < node_count; ++id) {
+		const std::uint32_t count = records[id].range_count;
+		if (count == 0) {
+			continue;
+		}
+		std::vector<Range> node_ranges;
+		node_ranges.reserve(count);
+		for (std::uint32_t i = 0; i < count; ++i) {
+			node_ranges.push_back(ranges[next++]);
+			if (!node_ranges.back().IsValid()) {
+				throw SnapshotException("Snapshot has an invalid graph range"s);
+			}
+		}
+		AddRanges(id, std::move(node_ranges));
+	}
+}
+
+std::uint32_t DependencyGraph::GetKey(Position pos) {
+	return static_cast<std::uint32_t>(pos.row) * Position::MAX_COLS + static_cast<std::uint32_t>(pos.col);
+}
+
+// Фибоначчиево хэширование: соседние позиции расходятся по всей таблице
+std::size_t DependencyGraph::GetSlot(std::uint32_t key) const {
+	return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & (index_.size() - 1);
+}
+
+DependencyGraph::NodeId DependencyGraph::FindNode(Position pos) const {
+	const std::uint32_t key = GetKey(pos);
+	for (std::size_t slot = GetSlot(key);; slot = (slot + 1) & (index_.size() - 1)) {
+		const std::uint64_t entry = index_[slot];
+		if (entry == EMPTY_SLOT) {
+			return NO_NODE;
+		}
+		if (static_cast<std::uint32_t>(entry >> 32) == key) {
+			return static_cast<NodeId>(entry);
+		}
+	}
+}
+
+DependencyGraph::NodeId DependencyGraph::GetOrCreateNode(Position pos) {
+	if (const NodeId id = FindNode(pos); id != NO_NODE) {
+		return id;
+	}
+	if ((index_size_ + 1) * 2 > index_.size()) {
+		GrowIndex();
+	}
+
+	NodeId id;
+	if (!free_nodes_.empty()) {
+		id = free_nodes_.back();
+		free_nodes_.pop_back();
+		nodes_[id].pos = pos;
+	}
+	else {
+		id = static_cast<NodeId>(nodes_.size());
+		nodes_.push_back({ pos, {}, {} });
+	}
+
+	const std::uint32_t key = GetKey(pos);
+	std::size_t slot = GetSlot(key);
+	while (index_[slot] != EMPTY_SLOT) {
+		slot = (slot + 1) & (index_.size() - 1);
+	}
+	index_[slot] = static_cast<std::uint64_t>(key) << 32 | id;
+	++index_size_;
+	return id;
+}
+
+bool DependencyGraph::HasReferences(NodeId id) const {
+	return !nodes_[id].references.empty() || (!node_ranges_.empty() && node_ranges_.count(id));
+}
+
+void DependencyGraph::ReleaseNodeIfUnused(NodeId id) {
+	Node& node = nodes_[id];
+	if (HasReferences(id) || !node.dependents.empty()) {
+		return;
+	}
+	EraseFromIndex(GetKey(node.pos));
+	node.references.clear();
+	node.dependents.clear();
+	free_nodes_.push_back(id);
+}
+
+// Удаление без надгробий: элементы цепочки пробирования за удалённым
+// сдвигаются назад, если их место по хэшу не оказывается за дыркой
+void DependencyGraph::EraseFromIndex(std::uint32_t key) {
+	const std::size_t mask = index_.size() - 1;
+	std::size_t hole = GetSlot(key);
+	while (static_cast<std::uint32_t>(index_[hole] >> 32) != key) {
+		hole = (hole + 1) & mask;
+	}
+	for (std::size_t slot = (hole + 1) & mask; index_[slot] != EMPTY_SLOT; slot = (slot + 1) & mask) {
+		const std::size_t home = GetSlot(static_cast<std::uint32_t>(index_[slot] >> 32));
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			index_[hole] = index_[slot];
+			hole = slot;
+		}
+	}
+	index_[hole] = EMPTY_SLOT;
+	--index_size_;
+}
+
+void DependencyGraph::GrowIndex() {
+	std::vector<std::uint64_t> old_index(index_.size() * 2, EMPTY_SLOT);
+	old_index.swap(index_);
+	const std::size_t mask = index_.size() - 1;
+	for (std::uint64_t entry : old_index) {
+		if (entry == EMPTY_SLOT) {
+			continue;
+		}
+		std::size_t slot = GetSlot(static_cast<std::uint32_t>(entry >> 32));
+		while (index_[slot] != EMPTY_SLOT) {
+			slot = (slot + 1) & mask;
+		}
+		index_[slot] = entry;
+	}
+}
+
+void DependencyGraph::AddRanges(NodeId id, std::vector<Range> ranges) {
+	for (const Range& range : ranges) {
+		ForEachRangeTile(range, [this, &range, id](std::uint32_t key) {
+			range_tiles_[key].push_back({ range, id });
+		});
+	}
+	node_ranges_.emplace(id, std::move(ranges));
+}
+
+void DependencyGraph::RemoveRanges(NodeId id) {
+	auto it = node_ranges_.find(id);
+	if (it == node_ranges_.end()) {
+		return;
+	}
+	for (const Range& range : it->second) {
+		ForEachRangeTile(range, [this, &range, id](std::uint32_t key) {
+			auto tile_it = range_tiles_.find(key);
+			auto& edges = tile_it->second;
+			auto edge_it = std::find_if(edges.begin(), edges.end(), [&range, id](const RangeEdge& edge) {
+				return edge.dependent == id && edge.range == range;
+			});
+			assert(edge_it != edges.end());
+			*edge_it = edges.back();
+			edges.pop_back();
+			if (edges.empty()) {
+				range_tiles_.erase(tile_it);
+			}
+		});
+	}
+	node_ranges_.erase(it);
+}
+
+std::uint32_t DependencyGraph::GetRangeTileKey(Position pos) {
+	return static_cast<std::uint32_t>(pos.row >> RANGE_TILE_BITS) * RANGE_TILES_PER_ROW
+		+ static_cast<std::uint32_t>(pos.col >> RANGE_TILE_BITS);
+}
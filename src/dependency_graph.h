@@ -0,0 +1,244 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class SnapshotReader;
+class SnapshotWriter;
+
+struct PositionHasher {
+	std::size_t operator()(const Position& pos) const {
+		return static_cast<std::size_t>(pos.row) * Position::MAX_COLS + static_cast<std::size_t>(pos.col);
+	}
+};
+
+// Граф зависимостей между позициями таблицы. Хранится отдельно от ячеек:
+// ребро на позицию, где ячейки ещё нет или где она очищена, существует, пока
+// формула, которая на неё ссылается, не изменится. Поэтому ячейка, заполненная
+// позже формулы, сбрасывает кэш формулы так же, как и существующая.
+//
+// Узлы лежат подряд в одном векторе и ссылаются друг на друга 32-битными
+// номерами. Позиция переводится в номер узла через хэш-таблицу с открытой
+// адресацией. Списки смежности небольшой длины хранятся прямо в узле, так что
+// у типичной формулы с парой ссылок нет ни одного отдельного выделения памяти.
+// Узел существует, только пока у позиции есть хотя бы одно ребро.
+//
+// Ссылки на диапазоны не разворачиваются в рёбра к каждой ячейке. У формулы
+// хранится список её диапазонов, а для поиска зависимых таблица разбита на
+// квадраты 64 x 64 ячейки: диапазон записан в каждый
+// квадрат, который он задевает. Так SUM(A1:A10000) стоит сотни байт, а не
+// десять тысяч рёбер.
+class DependencyGraph {
+public:
+	DependencyGraph();
+
+	// Заменяет ссылки ячейки pos на references и ranges. Недопустимые позиции
+	// пропускаются: такая ссылка вычисляется в #REF! и ни от чего не зависит.
+	void SetReferences(Position pos, std::vector<Position> references, std::vector<Range> ranges = {});
+
+	// Вызывает callback(Position) для каждой позиции, на которую ссылается
+	// формула в pos
+	template <typename Callback>
+	void ForEachReference(Position pos, Callback callback) const;
+
+	// Вызывает callback(Range) для каждого диапазона, на который ссылается
+	// формула в pos
+	template <typename Callback>
+	void ForEachReferencedRange(Position pos, Callback callback) const;
+
+	// Вызывает callback(Position) для каждой позиции, формула в которой
+	// ссылается на pos сама или через диапазон. Формула, в диапазоны которой
+	// pos входит несколько раз, может встретиться несколько раз.
+	template <typename Callback>
+	void ForEachDependent(Position pos, Callback callback) const;
+
+	// Вызывает callback(Position) для каждой позиции внутри range, которая
+	// ссылается на ячейки или диапазоны. Перебирается меньшее из двух: ячейки
+	// диапазона или узлы графа.
+	template <typename Callback>
+	void ForEachReferencingPosition(Range range, Callback callback) const;
+
+	bool HasDependents(Position pos) const;
+	// Есть ли у pos ссылки на ячейки или диапазоны
+	bool HasReferences(Position pos) const;
+	// Совпадают ли ссылки pos с references и ranges. Недопустимые позиции и
+	// повторы не учитываются, как в SetReferences.
+	bool HasSameReferences(Position pos, std::vector<Position> references, std::vector<Range> ranges) const;
+
+	std::size_t GetNodeCount() const;
+	std::size_t GetEdgeCount() const;
+	// Память под узлы, индекс и вынесенные в кучу списки смежности
+	std::size_t GetMemoryUsage() const;
+
+	// Записывает граф в снимок таблицы: узлы нумеруются заново подряд по
+	// возрастанию позиций, без освобождённых. Load восстанавливает записанный
+	// граф в пустом графе и бросает SnapshotException, если номера узлов или
+	// позиции недопустимы.
+	void Save(SnapshotWriter& writer) const;
+	void Load(SnapshotReader& reader);
+
+private:
+	using NodeId = std::uint32_t;
+	static constexpr NodeId NO_NODE = UINT32_MAX;
+
+	// Вектор номеров узлов, первые INLINE_CAPACITY из которых хранятся в самом
+	// объекте. Порядок элементов не сохраняется при удалении.
+	class EdgeList {
+	public:
+		EdgeList() = default;
+		EdgeList(EdgeList&& other) noexcept;
+		EdgeList& operator=(EdgeList&& other) noexcept;
+		~EdgeList();
+
+		EdgeList(const EdgeList&) = delete;
+		EdgeList& operator=(const EdgeList&) = delete;
+
+		const NodeId* begin() const {
+			return IsInline() ? inline_ : heap_;
+		}
+		const NodeId* end() const {
+			return begin() + size_;
+		}
+		bool empty() const {
+			return size_ == 0;
+		}
+		std::uint32_t size() const {
+			return size_;
+		}
+
+		void push_back(NodeId id);
+		void Erase(NodeId id);
+		void clear();
+		std::size_t GetHeapBytes() const;
+
+	private:
+		static constexpr std::uint32_t INLINE_CAPACITY = 2;
+
+		std::uint32_t size_ = 0;
+		std::uint32_t capacity_ = INLINE_CAPACITY;
+		union {
+			NodeId inline_[INLINE_CAPACITY];
+			NodeId* heap_;
+		};
+
+		bool IsInline() const {
+			return capacity_ == INLINE_CAPACITY;
+		}
+	};
+
+	struct Node {
+		Position pos;
+		EdgeList references;
+		EdgeList dependents;
+	};
+
+	static constexpr int RANGE_TILE_BITS = 6;
+	static constexpr int RANGE_TILES_PER_ROW = Position::MAX_COLS >> RANGE_TILE_BITS;
+
+	struct RangeEdge {
+		Range range;
+		NodeId dependent;
+	};
+
+	// Ячейка индекса: ключ позиции в старших 32 битах, номер узла в младших
+	static constexpr std::uint64_t EMPTY_SLOT = UINT64_MAX;
+
+	std::vector<Node> nodes_;
+	std::vector<NodeId> free_nodes_;
+	std::vector<std::uint64_t> index_;
+	std::size_t index_size_ = 0;
+	std::size_t edge_count_ = 0;
+	// Диапазоны формул и они же, разложенные по квадратам таблицы
+	std::unordered_map<NodeId, std::vector<Range>> node_ranges_;
+	std::unordered_map<std::uint32_t, std::vector<RangeEdge>> range_tiles_;
+
+	static std::uint32_t GetKey(Position pos);
+	std::size_t GetSlot(std::uint32_t key) const;
+	NodeId FindNode(Position pos) const;
+	NodeId GetOrCreateNode(Position pos);
+	bool HasReferences(NodeId id) const;
+	void ReleaseNodeIfUnused(NodeId id);
+	void AddRanges(NodeId id, std::vector<Range> ranges);
+	void RemoveRanges(NodeId id);
+	static std::uint32_t GetRangeTileKey(Position pos);
+	template <typename Callback>
+	static void ForEachRangeTile(Range range, Callback callback);
+	void EraseFromIndex(std::uint32_t key);
+	void GrowIndex();
+};
+
+template <typename Callback>
+void DependencyGraph::ForEachReference(Position pos, Callback callback) const {
+	if (const NodeId id = FindNode(pos); id != NO_NODE) {
+		for (NodeId ref_id : nodes_[id].references) {
+			callback(nodes_[ref_id].pos);
+		}
+	}
+}
+
+template <typename Callback>
+void DependencyGraph::ForEachReferencedRange(Position pos, Callback callback) const {
+	if (node_ranges_.empty()) {
+		return;
+	}
+	if (const NodeId id = FindNode(pos); id != NO_NODE) {
+		if (auto it = node_ranges_.find(id); it != node_ranges_.end()) {
+			for (const Range& range : it->second) {
+				callback(range);
+			}
+		}
+	}
+}
+
+template <typename Callback>
+void DependencyGraph::ForEachDependent(Position pos, Callback callback) const {
+	if (const NodeId id = FindNode(pos); id != NO_NODE) {
+		for (NodeId dependent_id : nodes_[id].dependents) {
+			callback(nodes_[dependent_id].pos);
+		}
+	}
+	if (range_tiles_.empty()) {
+		return;
+	}
+	if (auto it = range_tiles_.find(GetRangeTileKey(pos)); it != range_tiles_.end()) {
+		for (const RangeEdge& edge : it->second) {
+			if (edge.range.Contains(pos)) {
+				callback(nodes_[edge.dependent].pos);
+			}
+		}
+	}
+}
+
+template <typename Callback>
+void DependencyGraph::ForEachReferencingPosition(Range range, Callback callback) const {
+	if (range.GetCellCount() <= GetNodeCount()) {
+		for (int row = range.first.row; row <= range.last.row; ++row) {
+			for (int col = range.first.col; col <= range.last.col; ++col) {
+				const Position pos{ row, col };
+				if (const NodeId id = FindNode(pos); id != NO_NODE && HasReferences(id)) {
+					callback(pos);
+				}
+			}
+		}
+		return;
+	}
+	for (NodeId id = 0; id < nodes_.size(); ++id) {
+		// у освобождённых узлов ссылок нет
+		if (HasReferences(id) && range.Contains(nodes_[id].pos)) {
+			callback(nodes_[id].pos);
+		}
+	}
+}
+
+template <typename Callback>
+void DependencyGraph::ForEachRangeTile(Range range, Callback callback) {
+	for (int tile_row = range.first.row >> RANGE_TILE_BITS; tile_row <= range.last.row >> RANGE_TILE_BITS; ++tile_row) {
+		for (int tile_col = range.first.col >> RANGE_TILE_BITS; tile_col <= range.last.col >> RANGE_TILE_BITS; ++tile_col) {
+			callback(static_cast<std::uint32_t>(tile_row) * RANGE_TILES_PER_ROW + static_cast<std::uint32_t>(tile_col));
+		}
+	}
+}
@@ -1,11 +1,15 @@
 ﻿#include "formula.h"
 
 #include "FormulaAST.h"
+#include "numeric_columns.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <mutex>
+#include <optional>
 #include <sstream>
+#include <unordered_map>
 
 using namespace std::literals;
 
@@ -14,72 +18,282 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 }
 
 namespace {
+	// Ссылки программы - смещения от anchor_, ячейки формулы. Программу могут
+	// делить несколько формул с разными ячейками.
 	class Formula : public FormulaInterface {
 	public:
-		explicit Formula(std::string expression)
-			: ast_(ParseFormulaAST(expression)) {
+		Formula(std::shared_ptr<const FormulaAST> ast, Position anchor)
+			: ast_(std::move(ast))
+			, anchor_(anchor) {
 		}
 
 		Value Evaluate(const SheetInterface& sheet) const override {
-			std::function<double(Position)> get_value_by_position = [&sheet](Position pos) {
-				double result = 0.0;
+			if (const NumericColumns* columns = sheet.GetNumericColumns()) {
+				return EvaluateColumns(sheet, *columns);
+			}
 
+			auto get_value_by_position = [&](Position offset) -> Value {
+				const Position pos = ASTImpl::Translate(offset, anchor_);
 				if (!pos.IsValid()) {
-					throw FormulaError(FormulaError::Category::Ref);
+					return FormulaError(FormulaError::Category::Ref);
 				}
 
 				const CellInterface* cell = sheet.GetCell(pos);
 				if (!cell) {
-					return result;
+					return 0.0;
 				}
 
-				std::visit(CellValueGetter{ result }, cell->GetValue());
+				return cell->GetNumericValue();
+			};
 
-				return result;
+			// Числа диапазона собираются в буфер на стеке и сворачиваются
+			// пачками. Пустые ячейки и текст, который не читается как число,
+			// пропускаются, ошибка формулы в диапазоне становится результатом.
+			// Диапазон обходится по столбцам, как и в EvaluateColumns, чтобы из
+			// нескольких ошибок выбиралась та же.
+			auto for_each_range_values = [&](Range offset, auto&& consume) -> std::optional<FormulaError> {
+				const Range range = ASTImpl::Translate(offset, anchor_);
+				double buffer[RANGE_BUFFER_SIZE];
+				size_t size = 0;
+				for (int col = range.first.col; col <= range.last.col; ++col) {
+					for (int row = range.first.row; row <= range.last.row; ++row) {
+						const CellInterface* cell = sheet.GetCell({ row, col });
+						if (!cell) {
+							continue;
+						}
+						const auto value = cell->GetValueView();
+						double number;
+						if (const auto* value_number = std::get_if<double>(&value)) {
+							number = *value_number;
+						}
+						else if (const auto* error = std::get_if<FormulaError>(&value)) {
+							return *error;
+						}
+						else if (std::get<std::string_view>(value).empty()) {
+							continue;
+						}
+						else if (const auto numeric = cell->GetNumericValue(); std::holds_alternative<double>(numeric)) {
+							number = std::get<double>(numeric);
+						}
+						else {
+							continue;
+						}
+						buffer[size++] = number;
+						if (size == RANGE_BUFFER_SIZE) {
+							consume(buffer, size);
+							size = 0;
+						}
+					}
+				}
+				consume(buffer, size);
+				return std::nullopt;
 			};
 
-			try {
-				return ast_.Execute(get_value_by_position);
-			}
-			catch (const FormulaError& formula_error) {
-				return formula_error;
-			}
+			return ast_->Execute(get_value_by_position, for_each_range_values);
 		}
 
 		std::string GetExpression() const override {
 			std::stringstream ss;
-			ast_.PrintFormula(ss);
+			ast_->PrintFormula(ss, anchor_);
 			return ss.str();
 		}
 
+		// сдвиг на anchor_ не меняет порядок, списки остаются отсортированными
 		std::vector<Position> GetReferencedCells() const override {
-			const auto& cells = ast_.GetCells();
-			return { cells.begin(), cells.end() };
+			std::vector<Position> cells;
+			cells.reserve(ast_->GetCells().size());
+			for (const Position offset : ast_->GetCells()) {
+				cells.push_back(ASTImpl::Translate(offset, anchor_));
+			}
+			return cells;
+		}
+
+		std::vector<Range> GetReferencedRanges() const override {
+			std::vector<Range> ranges;
+			ranges.reserve(ast_->GetRanges().size());
+			for (const Range& offset : ast_->GetRanges()) {
+				ranges.push_back(ASTImpl::Translate(offset, anchor_));
+			}
+			return ranges;
+		}
+
+		const std::shared_ptr<const FormulaAST>& GetProgram() const {
+			return ast_;
 		}
 
 	private:
-		FormulaAST ast_;
+		static constexpr size_t RANGE_BUFFER_SIZE = 64;
+		// отрезок столбца целиком помещается в буфер
+		static_assert(RANGE_BUFFER_SIZE >= NumericColumns::CHUNK_SIZE);
 
-		struct CellValueGetter {
-			double& result;
-			void operator()(const double value) {
-				result = value;
-			}
-			void operator()(const std::string& value) {
-				try {
-					result = std::stod(value);
+		std::shared_ptr<const FormulaAST> ast_;
+		Position anchor_;
+
+		// Значения читаются из столбцов таблицы. К ячейке приходится обращаться
+		// только за формулой, которая ещё не вычислена: вычисляясь, она сама
+		// записывает значение в столбец. Отрезок диапазона, в котором все ячейки -
+		// числа, сворачивается прямо в памяти столбца, без копирования.
+		Value EvaluateColumns(const SheetInterface& sheet, const NumericColumns& columns) const {
+			using Kind = NumericColumns::Kind;
+			auto get_entry = [&](Position pos) {
+				NumericColumns::Entry entry = columns.Get(pos);
+				if (entry.kind == Kind::Pending) {
+					sheet.GetCell(pos)->GetValueView();
+					entry = columns.Get(pos);
 				}
-				catch (const std::invalid_argument& /* err */) {
-					throw FormulaError(FormulaError::Category::Value);
+				return entry;
+			};
+			auto get_value_by_position = [&](Position offset) -> Value {
+				const Position pos = ASTImpl::Translate(offset, anchor_);
+				if (!pos.IsValid()) {
+					return FormulaError(FormulaError::Category::Ref);
 				}
-			}
-			void operator()(const FormulaError& formula_error) {
-				throw formula_error;
-			}
-		};
+				const NumericColumns::Entry entry = get_entry(pos);
+				switch (entry.kind) {
+				case Kind::Empty:
+					return 0.0;
+				case Kind::Number:
+					return entry.number;
+				case Kind::Text:
+					return FormulaError(FormulaError::Category::Value);
+				default:
+					return NumericColumns::ToError(entry.kind);
+				}
+			};
+
+			auto for_each_range_values = [&](Range offset, auto&& consume) -> std::optional<FormulaError> {
+				std::optional<FormulaError> error;
+				columns.ForEachSegment(ASTImpl::Translate(offset, anchor_), [&](Position first, const double* numbers, const Kind* kinds, size_t count) {
+					if (std::all_of(kinds, kinds + count, [](Kind kind) { return kind == Kind::Number; })) {
+						consume(numbers, count);
+						return true;
+					}
+					double buffer[RANGE_BUFFER_SIZE];
+					size_t size = 0;
+					for (size_t i = 0; i < count; ++i) {
+						// чтение через get_entry вычисляет формулу, если нужно
+						const NumericColumns::Entry entry = kinds[i] == Kind::Pending
+							? get_entry({ first.row + static_cast<int>(i), first.col })
+							: NumericColumns::Entry{ kinds[i], numbers[i] };
+						if (entry.kind == Kind::Number) {
+							buffer[size++] = entry.number;
+						}
+						else if (NumericColumns::IsError(entry.kind)) {
+							error = NumericColumns::ToError(entry.kind);
+							return false;
+						}
+					}
+					consume(buffer, size);
+					return true;
+				});
+				return error;
+			};
+
+			return ast_->Execute(get_value_by_position, for_each_range_values);
+		}
 	};
+
+	template <typename Parser>
+	std::shared_ptr<const FormulaAST> ParseOrThrow(Parser parser) {
+		try {
+			return std::make_shared<const FormulaAST>(parser());
+		}
+		catch (const FormulaException&) {
+			throw;
+		}
+		catch (...) {
+			throw FormulaException("Formula parsing error"s);
+		}
+	}
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-	return std::make_unique<Formula>(std::move(expression));
+	auto ast = ParseOrThrow([&expression] {
+		return ParseFormulaASTFast(expression);
+	});
+	return std::make_unique<Formula>(std::move(ast), Position{ 0, 0 });
+}
+
+// Записи хранят слабые ссылки, чтобы программа освобождалась вместе с
+// последней формулой. Записи освобождённых программ удаляются, когда таблица
+// вырастает вдвое с прошлой чистки, так что чистка в среднем стоит O(1) на
+// добавление.
+struct FormulaInterner::Impl {
+	static constexpr size_t MIN_SWEEP_SIZE = 1024;
+
+	mutable std::mutex mutex;
+	std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> entries;
+	size_t sweep_size = MIN_SWEEP_SIZE;
+
+	void SweepIfNeeded() {
+		if (entries.size() < sweep_size) {
+			return;
+		}
+		for (auto it = entries.begin(); it != entries.end();) {
+			if (it->second.expired()) {
+				it = entries.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		sweep_size = std::max(MIN_SWEEP_SIZE, 2 * entries.size());
+	}
+};
+
+FormulaInterner::FormulaInterner()
+	: impl_(std::make_unique<Impl>()) {
+}
+
+FormulaInterner::~FormulaInterner() = default;
+
+std::unique_ptr<FormulaInterface> FormulaInterner::Parse(std::string_view expression, Position anchor) {
+	auto parse = [expression, anchor] {
+		return ParseFormulaASTFast(expression, anchor);
+	};
+	// ключ строится в буфере потока, память выделяется только для новой записи
+	thread_local std::string key;
+	if (!MakeRelativeFormulaKey(expression, anchor, key)) {
+		// формула с ошибкой: разбор бросит исключение
+		return std::make_unique<Formula>(ParseOrThrow(parse), anchor);
+	}
+
+	{
+		std::lock_guard lock(impl_->mutex);
+		const auto it = impl_->entries.find(key);
+		if (it != impl_->entries.end()) {
+			if (auto ast = it->second.lock()) {
+				return std::make_unique<Formula>(std::move(ast), anchor);
+			}
+		}
+	}
+
+	// разбор идёт без блокировки; если другой поток успел добавить ту же
+	// формулу, используется его программа
+	auto ast = ParseOrThrow(parse);
+	std::lock_guard lock(impl_->mutex);
+	auto& entry = impl_->entries[key];
+	if (auto existing = entry.lock()) {
+		ast = std::move(existing);
+	}
+	else {
+		entry = ast;
+		impl_->SweepIfNeeded();
+	}
+	return std::make_unique<Formula>(std::move(ast), anchor);
+}
+
+size_t FormulaInterner::GetSize() const {
+	std::lock_guard lock(impl_->mutex);
+	return std::count_if(impl_->entries.begin(), impl_->entries.end(), [](const auto& entry) {
+		return !entry.second.expired();
+	});
+}
+
+const FormulaAST* FormulaInterner::GetProgram(const FormulaInterface& formula) {
+	return static_cast<const Formula&>(formula).GetProgram().get();
+}
+
+std::unique_ptr<FormulaInterface> FormulaInterner::Share(const FormulaInterface& formula, Position anchor) {
+	return std::make_unique<Formula>(static_cast<const Formula&>(formula).GetProgram(), anchor);
 }
\ No newline at end of file
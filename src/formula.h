@@ -3,8 +3,11 @@
 #include "common.h"
 
 #include <memory>
+#include <string_view>
 #include <vector>
 
+class FormulaAST;
+
 // ,      .
 //  :
 // *     , : 1+2*3, 2.5*(2+3.5/7)
@@ -34,8 +37,43 @@ public:
 	// .        
 	// .
 	virtual std::vector<Position> GetReferencedCells() const = 0;
+
+	//  ,    . 
+	//     .     
+	// GetReferencedCells().
+	virtual std::vector<Range> GetReferencedRanges() const = 0;
 };
 
 //       .
 //  FormulaException  ,    .
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+//      .   
+//    ,    R1C1,  ,  
+//  (=A1*B1, =A2*B2, ...),     ,  
+//          . 
+//  ,       .  
+//     .
+class FormulaInterner {
+public:
+	FormulaInterner();
+	~FormulaInterner();
+
+	//  ,  ParseFormula,    anchor.   
+	// ,          .
+	std::unique_ptr<FormulaInterface> Parse(std::string_view expression, Position anchor);
+
+	//   ,   
+	size_t GetSize() const;
+
+	//  ,   ParseFormula  Parse:   
+	//     
+	static const FormulaAST* GetProgram(const FormulaInterface& formula);
+	//     ,    formula,   anchor. 
+	//  ; formula     ParseFormula  Parse.
+	static std::unique_ptr<FormulaInterface> Share(const FormulaInterface& formula, Position anchor);
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> impl_;
+};
\ No newline at end of file
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
+#define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
+#define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profile_guard_, __LINE__)
+#define LOG_DURATION(x) LogDuration UNIQUE_VAR_NAME_PROFILE(x)
+
+class LogDuration {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	explicit LogDuration(std::string id, std::ostream& out = std::cerr)
+		: id_(std::move(id))
+		, out_(out) {
+	}
+
+	~LogDuration() {
+		out_ << id_ << ": " << GetElapsedMs() << " ms" << std::endl;
+	}
+
+	double GetElapsedMs() const {
+		return std::chrono::duration<double, std::milli>(Clock::now() - start_time_).count();
+	}
+
+private:
+	const std::string id_;
+	std::ostream& out_;
+	const Clock::time_point start_time_ = Clock::now();
+};
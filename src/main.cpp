@@ -1,5 +1,30 @@
-﻿#include "common.h"
+﻿#include "FormulaAST.h"
+#include "aggregate_kernels.h"
+#include "allocation_counter.h"
+#include "arena.h"
+#include "benchmarks.h"
+#include "common.h"
+#include "dependency_graph.h"
+#include "output_buffer.h"
+#include "sheet.h"
+#include "sheet_import.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <set>
+#include <string_view>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
 	return output << "(" << pos.row << ", " << pos.col << ")";
@@ -154,9 +179,1550 @@ namespace {
 		}
 	}
 
+	void TestFormulaCache() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "1");
+		sheet.SetCell("A2"_pos, "=A1+1");
+		sheet.SetCell("A3"_pos, "=A2+A2");
+		sheet.SetCell("A4"_pos, "=A3*A2");
+
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValue()), 8);
+		const CacheStats first = sheet.GetCacheStats();
+		ASSERT_EQUAL(first.misses, 3u);
+
+		std::ostringstream out;
+		sheet.PrintValues(out);
+		sheet.PrintValues(out);
+		ASSERT_EQUAL(sheet.GetCacheStats().misses, 3u);
+		ASSERT_EQUAL(sheet.GetCacheStats().hits, first.hits + 6u);
+
+		sheet.SetCell("A1"_pos, "2");
+		ASSERT_EQUAL(sheet.GetCacheStats().invalidations, 3u);
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValue()), 18);
+		ASSERT_EQUAL(sheet.GetCacheStats().misses, 6u);
+	}
+	void TestCacheInvalidation() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("C1"_pos, "=A1*B1");
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 0);
+
+		sheet->SetCell("A1"_pos, "2");
+		sheet->SetCell("B1"_pos, "=A1+1");
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 6);
+
+		sheet->ClearCell("A1"_pos);
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 0);
+
+		sheet->SetCell("B1"_pos, "text");
+		const auto c1_value = sheet->GetCell("C1"_pos)->GetValue();
+		ASSERT(std::holds_alternative<FormulaError>(c1_value));
+	}
+
+	void TestFarCell() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("XFD16384"_pos, "far");
+		sheet->SetCell("B2"_pos, "=XFD16383+1");
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ Position::MAX_ROWS, Position::MAX_COLS }));
+		ASSERT_EQUAL(sheet->GetCell("XFD16384"_pos)->GetText(), "far");
+		ASSERT(sheet->GetCell("XFD16383"_pos) == nullptr);
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("B2"_pos)->GetValue()), 1);
+
+		sheet->ClearCell("XFD16384"_pos);
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 2 }));
+	}
+
+	void TestPrintableSizeTracking() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("C1"_pos, "x");
+		sheet->SetCell("A5"_pos, "y");
+		sheet->SetCell("C5"_pos, "z");
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5, 3 }));
+
+		sheet->ClearCell("C5"_pos);
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5, 3 }));
+		sheet->SetCell("A5"_pos, "");
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 3 }));
+		sheet->SetCell("C1"_pos, "=D7");
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 3 }));
+		sheet->ClearCell("C1"_pos);
+		sheet->ClearCell("C1"_pos);
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
+	}
+
+	void TestCircularDependencyDetection() {
+		auto sheet = CreateSheet();
+		auto expect_circular = [&](Position pos, std::string text) {
+			const std::string old_text = sheet->GetCell(pos) ? sheet->GetCell(pos)->GetText() : "";
+			try {
+				sheet->SetCell(pos, text);
+				ASSERT(false);
+			}
+			catch (const CircularDependencyException&) {
+			}
+			ASSERT_EQUAL(sheet->GetCell(pos) ? sheet->GetCell(pos)->GetText() : "", old_text);
+		};
+
+		expect_circular("A1"_pos, "=A1");
+		expect_circular("A1"_pos, "=B1+A1*2");
+
+		// ромб: D1 зависит от B1 и C1, которые обе зависят от A1
+		sheet->SetCell("B1"_pos, "=A1+1");
+		sheet->SetCell("C1"_pos, "=A1*2");
+		sheet->SetCell("D1"_pos, "=B1+C1");
+		expect_circular("A1"_pos, "=D1");
+		expect_circular("A1"_pos, "=C1");
+		sheet->SetCell("A1"_pos, "=E1");
+		expect_circular("E1"_pos, "=5+D1");
+
+		// длинная цепочка не должна переполнять стек при проверке
+		const int length = 15000;
+		for (int row = 1; row < length; ++row) {
+			sheet->SetCell({ row, 5 }, "=" + Position{ row - 1, 5 }.ToString() + "+1");
+		}
+		expect_circular({ 0, 5 }, "=" + Position{ length - 1, 5 }.ToString());
+		sheet->SetCell({ 0, 5 }, "=" + Position{ length - 1, 6 }.ToString());
+	}
+
+	void TestSyntaxError() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("A1"_pos, "=B1*2");
+		for (const std::string text : { "=A1+*", "=1+", "=(B2", "=B2)", "=b2", "=ZZZZ1", "=1 2" }) {
+			try {
+				sheet->SetCell("A1"_pos, text);
+				ASSERT(false);
+			}
+			catch (const FormulaException&) {
+			}
+			ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=B1*2");
+		}
+		sheet->SetCell("B1"_pos, "4");
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 8);
+	}
+
+	// Результат разбора в виде строки: дерево и формула либо признак ошибки
+	template <typename ParseFunc>
+	std::string DescribeParse(ParseFunc parse, const std::string& formula) {
+		try {
+			FormulaAST ast = parse(formula);
+			std::ostringstream out;
+			ast.Print(out);
+			out << " | ";
+			ast.PrintFormula(out);
+			out << " | ";
+			ast.PrintCells(out);
+			return out.str();
+		}
+		catch (const std::exception&) {
+			return "error";
+		}
+	}
+
+	std::string GenerateFormula(std::mt19937& gen, int depth) {
+		static const std::vector<std::string> atoms = { "A1", "B12", "XFD16384", "3", "2.5", ".5", "1e3", "7E-2", "0" };
+		static const std::vector<std::string> spaces = { "", "", " ", "\t" };
+		auto pick = [&gen](const std::vector<std::string>& items) {
+			return items[std::uniform_int_distribution<size_t>(0, items.size() - 1)(gen)];
+		};
+		switch (depth > 0 ? std::uniform_int_distribution<int>(0, 4)(gen) : 0) {
+		case 0:
+			return pick(atoms);
+		case 1:
+			return pick({ "-", "+" }) + pick(spaces) + GenerateFormula(gen, depth - 1);
+		case 2:
+			return "(" + GenerateFormula(gen, depth - 1) + ")";
+		case 3: {
+			std::string result = pick({ "SUM", "MIN", "MAX", "AVERAGE", "COUNT" }) + "(";
+			for (int i = std::uniform_int_distribution<int>(0, 3)(gen); i > 0; --i) {
+				result += pick({ "A1:B2", "C3:A1", "B12" + pick(spaces) + ":" + pick(spaces) + "B12" })
+					+ pick(spaces) + "," + pick(spaces);
+			}
+			return result + GenerateFormula(gen, depth - 1) + ")";
+		}
+		default:
+			return GenerateFormula(gen, depth - 1) + pick(spaces) + pick({ "+", "-", "*", "/" })
+				+ pick(spaces) + GenerateFormula(gen, depth - 1);
+		}
+	}
+
+	void TestFastParserMatchesAntlr() {
+		auto antlr_parse = [](const std::string& formula) {
+			return ParseFormulaAST(formula);
+		};
+		auto fast_parse = [](const std::string& formula) {
+			return ParseFormulaASTFast(formula);
+		};
+		auto check = [&](const std::string& formula) {
+			ASSERT_EQUAL(DescribeParse(fast_parse, formula), DescribeParse(antlr_parse, formula));
+		};
+
+		for (const std::string formula : {
+			"1", "A1", "-1+2", "-A1*B2", "1-2-3", "1/2/3", "2*(3+4)", "+-+-1", "(((A1)))",
+			" 1 +\t2\n", ".5", "1e3", "1.5E-2", "1e+2", "0.000001", "1e-400", "1e400",
+			"", "1.", "1.e5", "1e", "1 2", "A", "a1", "A0", "ZZZZ1", "XFD16384", "XFE1",
+			"A1B2", "(1", "1)", "()", "1+", "*1", "1..5", "1#", "A1:B2",
+			"SUM(A1:B2)", "SUM()", "SUM(A1, 2, B3:A1)", "AVERAGE(1)+MIN(A1:A1)*2", "COUNT(A1+1,B2)",
+			"-SUM((A1))", "MAX(A1:XFD16384)", "SUM(A1:)", "SUM(:B2)", "SUM(A1:B2+1)", "SUM(,)",
+			"SUM(1,)", "SUM", "SUM(1)(2)", "SUMA1", "FOO(1)", "sum(A1)", "MAX(A1:ZZZZ1)", "SUM(A1:B2:C3)" }) {
+			check(formula);
+		}
+
+		const std::vector<std::string> pieces = {
+			"A1", "B12", "ZZ3", "1", "2.5", ".5", "1e3", "E-2", "+", "-", "*", "/",
+			"(", ")", " ", "e", ".", "a", "ZZZZ1", "A0", "7", "SUM(", "MAX(", ",", ":" };
+		std::mt19937 gen(2024);
+		std::uniform_int_distribution<size_t> piece_index(0, pieces.size() - 1);
+		std::uniform_int_distribution<int> length(1, 10);
+		for (int i = 0; i < 5000; ++i) {
+			std::string formula;
+			for (int n = length(gen); n > 0; --n) {
+				formula += pieces[piece_index(gen)];
+			}
+			check(formula);
+		}
+		for (int i = 0; i < 2000; ++i) {
+			check(GenerateFormula(gen, 5));
+		}
+	}
+
+	void TestFormulaEvaluation() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("A1"_pos, "2");
+		auto value_of = [&](const std::string& formula) {
+			sheet->SetCell("B1"_pos, formula);
+			return sheet->GetCell("B1"_pos)->GetValue();
+		};
+
+		ASSERT_EQUAL(std::get<double>(value_of("=-A1*3")), -6);
+		ASSERT_EQUAL(std::get<double>(value_of("=--A1-+-1")), 3);
+		ASSERT_EQUAL(std::get<double>(value_of("=10/4/A1")), 1.25);
+		ASSERT_EQUAL(std::get<double>(value_of("=A1-(3-A1*(5-1))")), 7);
+
+		// глубина стека вычислений больше встроенного буфера
+		std::string deep = "=1";
+		for (int i = 2; i <= 50; ++i) {
+			deep = "=" + std::to_string(i) + "+(" + deep.substr(1) + ")";
+		}
+		ASSERT_EQUAL(std::get<double>(value_of(deep)), 1275);
+
+		ASSERT_EQUAL(std::get<FormulaError>(value_of("=1+A1/(A1-2)*3")).ToString(), "#DIV/0!");
+		ASSERT_EQUAL(std::get<FormulaError>(value_of("=1e200*1e200-1")).ToString(), "#DIV/0!");
+	}
+
+	void TestRangeFunctions() {
+		auto sheet = CreateSheet();
+		for (int row = 0; row < 5; ++row) {
+			sheet->SetCell({ row, 0 }, std::to_string(row + 1));
+		}
+		sheet->SetCell("A6"_pos, "abc");
+		sheet->SetCell("A8"_pos, "=A1*10");
+		auto value_of = [&](const std::string& formula) {
+			sheet->SetCell("B1"_pos, formula);
+			return sheet->GetCell("B1"_pos)->GetValue();
+		};
+
+		// пустые ячейки и текст, который не читается как число, пропускаются
+		ASSERT_EQUAL(std::get<double>(value_of("=SUM(A1:A8)")), 25);
+		ASSERT_EQUAL(std::get<double>(value_of("=MIN(A1:A8)")), 1);
+		ASSERT_EQUAL(std::get<double>(value_of("=MAX(A1:A8)")), 10);
+		ASSERT_EQUAL(std::get<double>(value_of("=AVERAGE(A1:A8)")), 25.0 / 6);
+		ASSERT_EQUAL(std::get<double>(value_of("=COUNT(A1:A8)")), 6);
+		ASSERT_EQUAL(std::get<double>(value_of("=SUM(A1:A3,10,A4)+COUNT(A6,A7)")), 20);
+		ASSERT_EQUAL(std::get<double>(value_of("=SUM()+MIN(C1:D9)+MAX(C1:D9)+COUNT(C1:D9)")), 0);
+		ASSERT_EQUAL(std::get<FormulaError>(value_of("=AVERAGE(C1:D9)")).ToString(), "#DIV/0!");
+		ASSERT_EQUAL(std::get<FormulaError>(value_of("=SUM(A1:A2,1/0)")).ToString(), "#DIV/0!");
+		// одиночная ссылка вне функции по-прежнему требует числа
+		ASSERT_EQUAL(std::get<FormulaError>(value_of("=SUM(A1:A2)+A6")).ToString(), "#VALUE!");
+
+		// углы диапазона упорядочиваются, выражение печатается без лишних скобок
+		value_of("=SUM(D9:C2) * 2 + MAX((A1), A2 : A3)");
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=SUM(C2:D9)*2+MAX(A1,A2:A3)");
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector<Position>({ "A1"_pos }));
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedRanges().size(), 2u);
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedRanges().back().ToString(), std::string("C2:D9"));
+
+		// изменение ячейки внутри диапазона, в том числе ранее пустой,
+		// сбрасывает кэш формулы
+		sheet->SetCell("C1"_pos, "=SUM(A1:A10)");
+		sheet->SetCell("C2"_pos, "=C1+COUNT(A1:A10)");
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("C2"_pos)->GetValue()), 31);
+		sheet->SetCell("A10"_pos, "100");
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("C2"_pos)->GetValue()), 132);
+		sheet->SetCell("A6"_pos, "=1/0");
+		ASSERT_EQUAL(std::get<FormulaError>(sheet->GetCell("C2"_pos)->GetValue()).ToString(), "#DIV/0!");
+		sheet->ClearCell("A6"_pos);
+		sheet->SetCell("A1"_pos, "11");
+		sheet->Recalculate();
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 235);
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("C2"_pos)->GetValue()), 242);
+	}
+
+	// Таблица без столбцов значений: формулы читают её ячейки через GetCell()
+	class CellOnlySheet : public SheetInterface {
+	public:
+		explicit CellOnlySheet(const SheetInterface& sheet)
+			: sheet_(sheet) {
+		}
+		void SetCell(Position, std::string) override {}
+		void SetCells(const std::vector<std::pair<Position, std::string_view>>&) override {}
+		const CellInterface* GetCell(Position pos) const override {
+			return sheet_.GetCell(pos);
+		}
+		CellInterface* GetCell(Position) override {
+			return nullptr;
+		}
+		void ClearCell(Position) override {}
+		Size GetPrintableSize() const override {
+			return sheet_.GetPrintableSize();
+		}
+		void PrintValues(std::ostream&) const override {}
+		void PrintTexts(std::ostream&) const override {}
+		void Recalculate() override {}
+
+	private:
+		const SheetInterface& sheet_;
+	};
+
+	void TestNumericColumns() {
+		// случайные правки на участке, пересекающем границу блоков столбца;
+		// формулы ссылаются только на строки выше себя, чтобы не было циклов
+		Sheet sheet;
+		const CellOnlySheet cell_only_sheet(sheet);
+		const NumericColumns& columns = *sheet.GetNumericColumns();
+		const int first_row = NumericColumns::CHUNK_SIZE - 4;
+		const int rows = 8;
+		const int cols = 3;
+		std::mt19937 gen(11);
+		std::uniform_int_distribution<int> row_dist(0, rows - 1);
+		std::uniform_int_distribution<int> col_dist(0, cols - 1);
+		auto random_reference = [&](int below_row) {
+			return Position{ first_row + std::uniform_int_distribution<int>(0, below_row - 1)(gen), col_dist(gen) };
+		};
+		auto make_text = [&](Position pos) -> std::string {
+			const int row = pos.row - first_row;
+			switch (std::uniform_int_distribution<int>(0, row == 0 ? 4 : 9)(gen)) {
+			case 0: case 1: case 2:
+				return std::to_string(std::uniform_int_distribution<int>(-9, 9)(gen));
+			case 3:
+				return "text";
+			case 4:
+				return {};
+			case 5:
+				return "=1/0";
+			case 6:
+				return "=" + random_reference(row).ToString() + "+1";
+			case 7:
+				return "=SUM(" + random_reference(row).ToString() + ":" + random_reference(row).ToString() + ")";
+			case 8:
+				return "=MIN(" + random_reference(row).ToString() + ":" + random_reference(row).ToString() + ",3)";
+			default:
+				return "=AVERAGE(" + random_reference(row).ToString() + ":" + random_reference(row).ToString() + ")";
+			}
+		};
+
+		for (int step = 0; step < 2000; ++step) {
+			const Position pos{ first_row + row_dist(gen), col_dist(gen) };
+			sheet.SetCell(pos, make_text(pos));
+			if (step % 3 == 0) {
+				sheet.Recalculate();
+			}
+			for (int row = first_row; row < first_row + rows; ++row) {
+				for (int col = 0; col < cols; ++col) {
+					const Position cell_pos{ row, col };
+					const CellInterface* cell = sheet.GetCell(cell_pos);
+					const NumericColumns::Entry entry = columns.Get(cell_pos);
+					if (!cell) {
+						ASSERT(entry.kind == NumericColumns::Kind::Empty);
+						continue;
+					}
+					const std::string text = cell->GetText();
+					if (text[0] != FORMULA_SIGN) {
+						const auto value = cell->GetNumericValue();
+						ASSERT(std::holds_alternative<double>(value)
+							? entry.kind == NumericColumns::Kind::Number && entry.number == std::get<double>(value)
+							: entry.kind == NumericColumns::Kind::Text);
+						continue;
+					}
+					// значение в столбце есть, только пока формула вычислена
+					ASSERT_EQUAL(entry.kind == NumericColumns::Kind::Pending, static_cast<const Cell*>(cell)->IsDirty());
+					// сумма диапазона через столбцы складывается по отрезкам блоков,
+					// поэтому может отличаться в последних битах
+					auto is_close = [](const FormulaInterface::Value& lhs, const FormulaInterface::Value& rhs) {
+						if (lhs.index() != rhs.index()) {
+							return false;
+						}
+						if (const auto* number = std::get_if<double>(&lhs)) {
+							return std::abs(*number - std::get<double>(rhs)) <= 1e-9 * std::max(1.0, std::abs(*number));
+						}
+						return lhs == rhs;
+					};
+					const auto expected = ParseFormula(text.substr(1))->Evaluate(cell_only_sheet);
+					ASSERT(is_close(ParseFormula(text.substr(1))->Evaluate(sheet), expected));
+					const auto value = cell->GetNumericValue();
+					ASSERT(is_close(value, expected));
+					const NumericColumns::Entry computed = columns.Get(cell_pos);
+					if (const auto* number = std::get_if<double>(&value)) {
+						ASSERT(computed.kind == NumericColumns::Kind::Number && computed.number == *number);
+					}
+					else {
+						ASSERT(NumericColumns::IsError(computed.kind));
+						ASSERT(NumericColumns::ToError(computed.kind) == std::get<FormulaError>(expected));
+					}
+				}
+			}
+		}
+		ASSERT(columns.GetChunkCount() <= static_cast<size_t>(cols) * 2);
+	}
+
+	void TestRangeCircularDependency() {
+		auto sheet = CreateSheet();
+		auto expect_circular = [&](Position pos, std::string text) {
+			try {
+				sheet->SetCell(pos, text);
+				ASSERT(false);
+			}
+			catch (const CircularDependencyException&) {
+			}
+		};
+		expect_circular("B2"_pos, "=SUM(A1:C3)");
+		sheet->SetCell("D1"_pos, "=SUM(A1:A100)");
+		sheet->SetCell("E1"_pos, "=D1*2");
+		expect_circular("A50"_pos, "=E1");
+		expect_circular("A50"_pos, "=MAX(E1:E1)");
+		sheet->SetCell("A50"_pos, "=SUM(F1:F10)");
+		expect_circular("F5"_pos, "=E1");
+		ASSERT(sheet->GetCell("F5"_pos) == nullptr);
+		// формула, которая больше не ссылается на диапазон, не зависит от него
+		sheet->SetCell("D1"_pos, "=A1");
+		sheet->SetCell("F5"_pos, "=E1");
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("A50"_pos)->GetValue()), 0);
+
+		// в пакете цикл через диапазон находится и для ещё пустых ячеек
+		try {
+			sheet->SetCells({ { "H1"_pos, "=SUM(H2:H1000)" }, { "H500"_pos, "=G1" }, { "G1"_pos, "=H1+1" }, { "H2"_pos, "1" } });
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException& e) {
+			ASSERT_EQUAL(std::string(e.what()), std::string("Circular dependency found: G1 H1 H500"));
+		}
+		ASSERT(sheet->GetCell("H1"_pos) == nullptr);
+		sheet->SetCells({ { "H1"_pos, "=SUM(H2:H1000)" }, { "H500"_pos, "=G1" }, { "G1"_pos, "=J1+1" } });
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("H1"_pos)->GetValue()), 1);
+		try {
+			sheet->SetCells({ { "J1"_pos, "=AVERAGE(H1:H1)" } });
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException& e) {
+			ASSERT_EQUAL(std::string(e.what()), std::string("Circular dependency found: G1 H1 J1 H500"));
+		}
+	}
+
+	void TestAggregateKernels() {
+		std::mt19937 gen(5);
+		std::uniform_int_distribution<int> values(-1000, 1000);
+		for (size_t count = 0; count < 40; ++count) {
+			std::vector<double> data(count + 1);
+			for (auto& value : data) {
+				value = values(gen);
+			}
+			// невыровненное начало массива
+			const double* begin = data.data() + 1;
+			ASSERT_EQUAL(SumValues(begin, count), std::accumulate(begin, begin + count, 0.0));
+			ASSERT_EQUAL(MinValue(begin, count), count ? *std::min_element(begin, begin + count) : INFINITY);
+			ASSERT_EQUAL(MaxValue(begin, count), count ? *std::max_element(begin, begin + count) : -INFINITY);
+		}
+	}
+
+	void TestErrorPropagation() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("A1"_pos, "=1/0");
+		sheet->SetCell("A2"_pos, "abc");
+		sheet->SetCell("A3"_pos, "1e999");
+		sheet->SetCell("A4"_pos, " 2.5");
+		sheet->SetCell("B1"_pos, "=A4*2+A1");
+		sheet->SetCell("B2"_pos, "=A2+A1");
+		sheet->SetCell("B3"_pos, "=A3");
+		sheet->SetCell("B4"_pos, "=A4*2");
+		sheet->SetCell("C1"_pos, "=B1+B2");
+
+		auto error_of = [&](Position pos) {
+			return std::get<FormulaError>(sheet->GetCell(pos)->GetValue()).ToString();
+		};
+		ASSERT_EQUAL(error_of("B1"_pos), "#DIV/0!");
+		ASSERT_EQUAL(error_of("B2"_pos), "#VALUE!");
+		ASSERT_EQUAL(error_of("B3"_pos), "#VALUE!");
+		ASSERT_EQUAL(error_of("C1"_pos), "#DIV/0!");
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("B4"_pos)->GetValue()), 5);
+	}
+
+	void TestReadsDoNotAllocate() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "2");
+		sheet.SetCell("A2"_pos, "'=escaped text that does not fit into SSO");
+		sheet.SetCell("A3"_pos, "=A1*3+B1");
+		sheet.SetCell("A4"_pos, "=A3/(A1-2)");
+		sheet.SetCell("B1"_pos, "=A1+1");
+		// прогрев кэша формул
+		sheet.GetCell("A3"_pos)->GetValue();
+		sheet.GetCell("A4"_pos)->GetValue();
+
+		const SheetInterface& const_sheet = sheet;
+		double sum = 0.0;
+		size_t text_size = 0;
+		AllocationCounter counter;
+		for (int i = 0; i < 100; ++i) {
+			for (const Position pos : { "A1"_pos, "A2"_pos, "A3"_pos, "A4"_pos, "B1"_pos, "C7"_pos }) {
+				const CellInterface* cell = const_sheet.GetCell(pos);
+				if (!cell) {
+					continue;
+				}
+				const auto value = cell->GetValueView();
+				if (const auto* number = std::get_if<double>(&value)) {
+					sum += *number;
+				}
+				else if (const auto* text = std::get_if<std::string_view>(&value)) {
+					text_size += text->size();
+				}
+				text_size += static_cast<const Cell*>(cell)->GetTextView().size();
+			}
+			sum += std::get<double>(sheet.GetCell("A3"_pos)->GetValue());
+		}
+		const size_t allocations = counter.GetCount();
+		ASSERT_EQUAL(allocations, 0u);
+		ASSERT_EQUAL(sum, 100 * (9 + 3 + 9));
+		ASSERT_EQUAL(text_size, 100u * (1 + 40 + 41 + 8 + 11 + 5));
+	}
+
+	void TestFormulaArena() {
+		Arena arena(64);
+		std::vector<std::pair<std::uint64_t*, std::uint64_t>> values;
+		for (std::uint64_t i = 0; i < 100; ++i) {
+			arena.Make<char>('x');
+			values.emplace_back(arena.Make<std::uint64_t>(i * i), i * i);
+		}
+		ASSERT(arena.GetBlockCount() > 1);
+		Arena moved = std::move(arena);
+		ASSERT_EQUAL(arena.GetBlockCount(), 0u);
+		for (const auto& [ptr, value] : values) {
+			ASSERT_EQUAL(reinterpret_cast<std::uintptr_t>(ptr) % alignof(std::uint64_t), 0u);
+			ASSERT_EQUAL(*ptr, value);
+		}
+
+		// прогрев буферов разбора, которые переиспользуются между вызовами
+		ParseFormulaASTFast("A1+B2*A1");
+		std::optional<FormulaAST> ast;
+		{
+			AllocationCounter counter;
+			ast.emplace(ParseFormulaASTFast("A1+B2*A1"));
+			const size_t allocations = counter.GetCount();
+			ASSERT_EQUAL(allocations, 1u);
+		}
+		FormulaAST moved_ast = std::move(*ast);
+		ast.reset();
+		const auto cells = moved_ast.GetCells();
+		ASSERT_EQUAL(std::vector<Position>(cells.begin(), cells.end()), std::vector<Position>({ "A1"_pos, "B2"_pos }));
+		auto get_value = [](Position pos) -> FormulaAST::Value {
+			return static_cast<double>(pos.row + pos.col + 1);
+		};
+		ASSERT_EQUAL(std::get<double>(moved_ast.Execute(get_value)), 1 + 3 * 1);
+		std::ostringstream out;
+		moved_ast.PrintFormula(out);
+		ASSERT_EQUAL(out.str(), "A1+B2*A1");
+
+		ASSERT_EQUAL(ParseFormula("A1+B2*A1")->GetReferencedCells(), std::vector<Position>({ "A1"_pos, "B2"_pos }));
+	}
+
+	void TestFormulaOptimization() {
+		using OpCode = ASTImpl::Instruction::OpCode;
+		size_t loads = 0;
+		auto get_value = [&loads](Position pos) -> FormulaAST::Value {
+			++loads;
+			return static_cast<double>(pos.row + pos.col + 2);
+		};
+		auto print = [](const FormulaAST& ast) {
+			std::ostringstream out;
+			ast.PrintFormula(out);
+			return out.str();
+		};
+
+		// константы свёрнуты, дерево для печати осталось как было
+		const FormulaAST folded = ParseFormulaASTFast("2*3+A1*(4/2)-SUM(1,-2)");
+		ASSERT_EQUAL(folded.GetProgram().size(), 7u);
+		ASSERT_EQUAL(print(folded), "2*3+A1*4/2-SUM(1,-2)");
+		ASSERT_EQUAL(std::get<double>(folded.Execute(get_value)), 11);
+
+		// ячейка и повторяющееся подвыражение вычисляются один раз
+		const FormulaAST shared = ParseFormulaASTFast("A1*A1+A1*A1");
+		loads = 0;
+		ASSERT_EQUAL(std::get<double>(shared.Execute(get_value)), 8);
+		ASSERT_EQUAL(loads, 1u);
+		const auto program = shared.GetProgram();
+		ASSERT_EQUAL(std::count_if(program.begin(), program.end(), [](const auto& instruction) {
+			return instruction.op == OpCode::Multiply;
+		}), 1);
+
+		// бесконечный результат не сворачивается: ошибка остаётся за вычислением,
+		// и ошибка ячейки, которая читается раньше, по-прежнему побеждает
+		auto value_error = [](Position) -> FormulaAST::Value {
+			return FormulaError(FormulaError::Category::Value);
+		};
+		ASSERT_EQUAL(std::get<FormulaError>(ParseFormulaASTFast("1/0+A1").Execute(value_error)).ToString(), "#DIV/0!");
+		ASSERT_EQUAL(std::get<FormulaError>(ParseFormulaASTFast("A1+1/0").Execute(value_error)).ToString(), "#VALUE!");
+		ASSERT_EQUAL(std::get<FormulaError>(ParseFormulaASTFast("AVERAGE()").Execute(get_value)).ToString(), "#DIV/0!");
+
+		// на случайных формулах результат совпадает с неоптимизированным до бита
+		const FormulaAST::Value cell_values[] = { 0.0, -0.0, 1.0, 2.5, -3.0, 1e308,
+			FormulaError(FormulaError::Category::Value), FormulaError(FormulaError::Category::Div0) };
+		auto same_value = [](const FormulaAST::Value& lhs, const FormulaAST::Value& rhs) {
+			if (lhs.index() != rhs.index()) {
+				return false;
+			}
+			if (const auto* number = std::get_if<double>(&lhs)) {
+				const double other = std::get<double>(rhs);
+				return std::memcmp(number, &other, sizeof(double)) == 0;
+			}
+			return lhs == rhs;
+		};
+		std::mt19937 gen(77);
+		for (int i = 0; i < 3000; ++i) {
+			const std::string formula = GenerateFormula(gen, 6);
+			const FormulaAST optimized = ParseFormulaASTFast(formula);
+			const FormulaAST plain = ParseFormulaASTFast(formula, false);
+			ASSERT_EQUAL(print(optimized), print(plain));
+			for (int trial = 0; trial < 4; ++trial) {
+				const size_t seed = gen();
+				auto get_cell_value = [&](Position pos) -> FormulaAST::Value {
+					++loads;
+					return cell_values[(PositionHasher{}(pos) ^ seed) % std::size(cell_values)];
+				};
+				loads = 0;
+				const auto expected = plain.Execute(get_cell_value);
+				const size_t plain_loads = loads;
+				loads = 0;
+				ASSERT(same_value(optimized.Execute(get_cell_value), expected));
+				ASSERT(loads <= plain_loads);
+			}
+		}
+	}
+
+	void TestFormulaInterning() {
+		Sheet sheet;
+		const int rows = 100;
+		for (int row = 0; row < rows; ++row) {
+			const std::string r = std::to_string(row + 1);
+			sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+			sheet.SetCell(Position{ row, 1 }, "2");
+			// пробелы не мешают общей программе
+			sheet.SetCell(Position{ row, 2 }, row % 2 ? "=A" + r + "*B" + r : "= A" + r + " * B" + r);
+			sheet.SetCell(Position{ row, 3 }, "=SUM(A" + r + ":C" + r + ")");
+		}
+		ASSERT_EQUAL(sheet.GetFormulaProgramCount(), 2u);
+		for (int row = 0; row < rows; ++row) {
+			const std::string r = std::to_string(row + 1);
+			const CellInterface* cell = sheet.GetCell(Position{ row, 2 });
+			ASSERT_EQUAL(cell->GetText(), "=A" + r + "*B" + r);
+			ASSERT_EQUAL(std::get<double>(cell->GetValue()), row * 2.0);
+			ASSERT_EQUAL(cell->GetReferencedCells(), std::vector<Position>({ { row, 0 }, { row, 1 } }));
+			const CellInterface* sum = sheet.GetCell(Position{ row, 3 });
+			ASSERT_EQUAL(sum->GetText(), "=SUM(A" + r + ":C" + r + ")");
+			ASSERT_EQUAL(std::get<double>(sum->GetValue()), row * 3.0 + 2.0);
+		}
+
+		// одинаковый текст в разных ячейках - разные относительные формулы
+		sheet.SetCell("E1"_pos, "=A1");
+		sheet.SetCell("E2"_pos, "=A1");
+		ASSERT_EQUAL(sheet.GetFormulaProgramCount(), 4u);
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell("E2"_pos)->GetValue()), 0.0);
+
+		// токены ключа разделены: "1 2" не совпадает с "12"
+		sheet.SetCell("F1"_pos, "=12");
+		try {
+			sheet.SetCell("F2"_pos, "=1 2");
+			ASSERT(false);
+		}
+		catch (const FormulaException&) {
+		}
+		try {
+			sheet.SetCell("F2"_pos, "=A1+ZZZZ1");
+			ASSERT(false);
+		}
+		catch (const FormulaException&) {
+		}
+
+		// программа освобождается вместе с последней формулой
+		for (int row = 0; row < rows; ++row) {
+			sheet.ClearCell(Position{ row, 3 });
+		}
+		ASSERT_EQUAL(sheet.GetFormulaProgramCount(), 4u);
+		for (int row = 0; row < rows; ++row) {
+			sheet.SetCell(Position{ row, 2 }, "1");
+		}
+		ASSERT_EQUAL(sheet.GetFormulaProgramCount(), 3u);
+
+		// пакетная загрузка разбирает формулы параллельно
+		Sheet batch_sheet(4);
+		std::vector<std::string> texts;
+		for (int row = 0; row < 2000; ++row) {
+			texts.push_back("=" + Position{ row, 0 }.ToString() + "+1");
+		}
+		std::vector<std::pair<Position, std::string_view>> cells;
+		for (int row = 0; row < 2000; ++row) {
+			cells.push_back({ { row, 1 }, texts[row] });
+		}
+		batch_sheet.SetCells(cells);
+		ASSERT_EQUAL(batch_sheet.GetFormulaProgramCount(), 1u);
+		ASSERT_EQUAL(batch_sheet.GetCell("B2000"_pos)->GetText(), std::string("=A2000+1"));
+
+		// относительная формула совпадает с разобранной напрямую
+		std::mt19937 gen(22);
+		std::uniform_int_distribution<int> row_dist(0, Position::MAX_ROWS - 1);
+		std::uniform_int_distribution<int> col_dist(0, Position::MAX_COLS - 1);
+		FormulaInterner interner;
+		std::vector<std::unique_ptr<FormulaInterface>> formulas;
+		for (int i = 0; i < 2000; ++i) {
+			const std::string text = GenerateFormula(gen, 5);
+			const Position anchor{ row_dist(gen), col_dist(gen) };
+			const auto expected = ParseFormula(text);
+			auto formula = interner.Parse(text, anchor);
+			ASSERT_EQUAL(formula->GetExpression(), expected->GetExpression());
+			ASSERT_EQUAL(formula->GetReferencedCells(), expected->GetReferencedCells());
+			ASSERT(formula->GetReferencedRanges() == expected->GetReferencedRanges());
+			formulas.push_back(std::move(formula));
+		}
+	}
+
+	void TestOutputBuffer() {
+		// числа форматируются так же, как их выводит std::ostream
+		std::mt19937_64 gen(24);
+		std::vector<double> numbers = { 0.0, -0.0, 1.0, -1.5, 0.1, 1e-5, 123456.0, 1234567.0, 1e100, -2.5e-300,
+			std::numeric_limits<double>::max(), std::numeric_limits<double>::denorm_min(), 1.0 / 3.0 };
+		for (int i = 0; i < 10000; ++i) {
+			double number;
+			const std::uint64_t bits = gen();
+			std::memcpy(&number, &bits, sizeof(number));
+			if (std::isfinite(number)) {
+				numbers.push_back(number);
+			}
+			numbers.push_back(static_cast<double>(gen() % 2000000) / 8 - 100000);
+		}
+		std::ostringstream expected;
+		std::ostringstream actual;
+		{
+			OutputBuffer buffer(actual);
+			for (double number : numbers) {
+				expected << number << ' ';
+				buffer.Append(number);
+				buffer.Append(' ');
+			}
+			// строка длиннее буфера
+			const std::string long_text(OutputBuffer::CAPACITY + 10, 'x');
+			expected << long_text;
+			buffer.Append(long_text);
+			expected << std::string(OutputBuffer::CAPACITY * 2, '\t');
+			buffer.AppendRepeated('\t', OutputBuffer::CAPACITY * 2);
+			buffer.Flush();
+		}
+		ASSERT(actual.str() == expected.str());
+
+		// вывод таблицы не зависит от настроек потока и совпадает с записью в файл
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "=1/3");
+		sheet.SetCell("C1"_pos, "'text");
+		sheet.SetCell("B3"_pos, "=1/0");
+		sheet.SetCell("L2"_pos, "12345678");
+		sheet.SetCell("M2"_pos, "=L2*10");
+		std::ostringstream values;
+		values.precision(2);
+		values.setf(std::ios::fixed);
+		sheet.PrintValues(values);
+		const std::string expected_values = "0.333333\t\ttext\t\t\t\t\t\t\t\t\t\t\n"
+			"\t\t\t\t\t\t\t\t\t\t\t12345678\t1.23457e+08\n"
+			"\t#DIV/0!\t\t\t\t\t\t\t\t\t\t\t\n";
+		ASSERT_EQUAL(values.str(), expected_values);
+
+		const auto path = std::filesystem::temp_directory_path() / "spreadsheet_output_test.tsv";
+		for (bool texts : { false, true }) {
+			{
+				std::FILE* file = std::fopen(path.string().c_str(), "wb");
+				ASSERT(file != nullptr);
+				texts ? sheet.WriteTexts(fileno(file)) : sheet.WriteValues(fileno(file));
+				std::fclose(file);
+			}
+			std::ifstream file(path, std::ios::binary);
+			const std::string written{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+			std::ostringstream printed;
+			texts ? sheet.PrintTexts(printed) : sheet.PrintValues(printed);
+			ASSERT_EQUAL(written, printed.str());
+		}
+		std::filesystem::remove(path);
+	}
+
+	void TestNumericText() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("B1"_pos, "=A1");
+		auto value_of = [&](const std::string& text) {
+			sheet->SetCell("A1"_pos, text);
+			return sheet->GetCell("B1"_pos)->GetValue();
+		};
+		auto is_value_error = [](const CellInterface::Value& value) {
+			return std::holds_alternative<FormulaError>(value)
+				&& std::get<FormulaError>(value).GetCategory() == FormulaError::Category::Value;
+		};
+
+		ASSERT_EQUAL(std::get<double>(value_of("12")), 12);
+		ASSERT_EQUAL(std::get<double>(value_of(" \t-3.5e2")), -350);
+		ASSERT_EQUAL(std::get<double>(value_of("+.5")), 0.5);
+		ASSERT_EQUAL(std::get<double>(value_of("'42")), 42);
+		ASSERT_EQUAL(std::get<double>(value_of("3 apples")), 3);
+		ASSERT_EQUAL(std::get<double>(value_of("1e")), 1);
+		ASSERT_EQUAL(std::get<double>(value_of("0x1A")), 26);
+		ASSERT_EQUAL(std::get<double>(value_of("0xg")), 0);
+		ASSERT(is_value_error(value_of("+-5")));
+		ASSERT(is_value_error(value_of("apples")));
+		ASSERT(is_value_error(value_of("  ")));
+		ASSERT(is_value_error(value_of("1e999")));
+	}
+
+	void TestSetCells() {
+		auto sheet = CreateSheet();
+		// ссылки вперёд, повтор позиции (действует последний) и пустой текст
+		sheet->SetCells({
+			{ "A1"_pos, "=B1+C1" },
+			{ "B1"_pos, "=C1*2" },
+			{ "C1"_pos, "1" },
+			{ "C1"_pos, "3" },
+			{ "D5"_pos, "" },
+		});
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 9);
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 3 }));
+
+		// пакет сбрасывает кэш зависимых ячеек, в том числе вне пакета
+		sheet->SetCell("E1"_pos, "=A1+1");
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("E1"_pos)->GetValue()), 10);
+		sheet->SetCells({ { "C1"_pos, "4" }, { "C3"_pos, "text" } });
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("E1"_pos)->GetValue()), 13);
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 3, 5 }));
+		sheet->SetCells({ { "C3"_pos, "" } });
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 5 }));
+
+		auto texts_of = [&]() {
+			std::ostringstream out;
+			sheet->PrintTexts(out);
+			return out.str();
+		};
+		const std::string texts_before = texts_of();
+
+		try {
+			sheet->SetCells({ { "F1"_pos, "5" }, { "F2"_pos, "=F1+" } });
+			ASSERT(false);
+		}
+		catch (const FormulaException& e) {
+			ASSERT(std::string(e.what()).find("F2") != std::string::npos);
+		}
+		ASSERT_EQUAL(texts_of(), texts_before);
+
+		// в сообщении перечислены все ячейки всех циклов, в том числе ячейки
+		// вне пакета, и ничего из пакета не записано
+		try {
+			sheet->SetCells({
+				{ "F1"_pos, "5" },
+				{ "C1"_pos, "=E1" },
+				{ "G1"_pos, "=G2" },
+				{ "G2"_pos, "=G1" },
+				{ "H1"_pos, "=H1" },
+				{ "J1"_pos, "=A1" },
+			});
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException& e) {
+			ASSERT_EQUAL(std::string(e.what()), "Circular dependency found: A1 B1 C1 E1 G1 H1 G2");
+		}
+		ASSERT_EQUAL(texts_of(), texts_before);
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("E1"_pos)->GetValue()), 13);
+
+		// длинная цепочка, загруженная в обратном порядке
+		const int length = 15000;
+		std::vector<std::string> texts;
+		for (int row = length - 1; row > 0; --row) {
+			texts.push_back("=" + Position{ row - 1, 10 }.ToString() + "+1");
+		}
+		std::vector<std::pair<Position, std::string_view>> chain;
+		for (int row = length - 1; row > 0; --row) {
+			chain.push_back({ { row, 10 }, texts[length - 1 - row] });
+		}
+		chain.push_back({ { 0, 10 }, "0" });
+		sheet->SetCells(chain);
+		// значения читаются сверху вниз, чтобы ленивое вычисление не уходило
+		// в глубокую рекурсию
+		for (int row = 0; row < length; ++row) {
+			ASSERT_EQUAL(std::get<double>(sheet->GetCell({ row, 10 })->GetNumericValue()), row);
+		}
+
+		const std::string closing = "=" + Position{ length - 1, 10 }.ToString();
+		try {
+			sheet->SetCells({ { { 0, 10 }, closing } });
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException&) {
+		}
+		ASSERT_EQUAL(sheet->GetCell({ 0, 10 })->GetText(), "0");
+	}
+
+	void TestImportTexts() {
+		// больше мегабайта текста: загрузка идёт несколькими пакетами, формулы
+		// ссылаются и на ячейки следующих пакетов
+		const int rows = 3000;
+		const int cols = 30;
+		std::mt19937 gen(23);
+		std::uniform_int_distribution<int> kind_dist(0, 9);
+		std::uniform_int_distribution<int> row_dist(0, rows - 1);
+		std::vector<std::string> texts;
+		std::vector<Position> positions;
+		for (int row = 0; row < rows; ++row) {
+			for (int col = 0; col < cols; ++col) {
+				const int kind = kind_dist(gen);
+				const Position pos{ row, col };
+				std::string text;
+				if (kind < 2) {
+					continue;
+				}
+				else if (kind < 6) {
+					text = std::to_string(gen() % 100000);
+				}
+				else if (kind < 8) {
+					text = (kind == 6 ? "text " : "'=quoted ") + std::string(40, 'x') + std::to_string(row);
+				}
+				else if (col > 0) {
+					// ссылки только на столбец левее - циклов нет
+					text = "=" + Position{ row_dist(gen), col - 1 }.ToString() + "*2";
+				}
+				texts.push_back(std::move(text));
+				positions.push_back(pos);
+			}
+		}
+		std::vector<std::pair<Position, std::string_view>> cells;
+		for (size_t i = 0; i < texts.size(); ++i) {
+			cells.push_back({ positions[i], texts[i] });
+		}
+		Sheet reference(2);
+		reference.SetCells(cells);
+		std::ostringstream reference_texts;
+		std::ostringstream reference_values;
+		reference.PrintTexts(reference_texts);
+		reference.PrintValues(reference_values);
+		ASSERT(reference_texts.str().size() > (1u << 20));
+
+		auto check_round_trip = [&](const Sheet& sheet) {
+			std::ostringstream sheet_texts;
+			std::ostringstream sheet_values;
+			sheet.PrintTexts(sheet_texts);
+			sheet.PrintValues(sheet_values);
+			ASSERT(sheet_texts.str() == reference_texts.str());
+			ASSERT(sheet_values.str() == reference_values.str());
+		};
+		{
+			Sheet sheet(2);
+			std::istringstream input(reference_texts.str());
+			ImportTexts(sheet, input);
+			check_round_trip(sheet);
+		}
+		const auto path = std::filesystem::temp_directory_path() / "spreadsheet_import_test.tsv";
+		{
+			std::ofstream file(path, std::ios::binary);
+			file << reference_texts.str();
+		}
+		{
+			Sheet sheet(2);
+			ImportTextsFile(sheet, path.string());
+			check_round_trip(sheet);
+		}
+		std::filesystem::remove(path);
+		try {
+			Sheet sheet;
+			ImportTextsFile(sheet, path.string());
+			ASSERT(false);
+		}
+		catch (const std::system_error&) {
+		}
+
+		// перевод строки "\r\n", пустые строки и поля, строка без перевода в конце
+		{
+			Sheet sheet;
+			std::istringstream input("1\t\t=A1+1\r\n\r\n\ttext\n=C1*2");
+			ImportTexts(sheet, input);
+			ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 4, 3 }));
+			ASSERT_EQUAL(sheet.GetCell("B1"_pos), nullptr);
+			ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2.0);
+			ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), std::string("text"));
+			ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValue()), 4.0);
+		}
+
+		{
+			Sheet sheet;
+			std::istringstream input("1,\"a,b\",\"say \"\"hi\"\"\"\r\n\"two\nlines\",=A1+1,\"x\"y\n\"\"");
+			ImportTexts(sheet, input, TextFormat::Csv);
+			ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 3 }));
+			ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), std::string("a,b"));
+			ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), std::string("say \"hi\""));
+			ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), std::string("two\nlines"));
+			ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 2.0);
+			ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), std::string("xy"));
+			ASSERT_EQUAL(sheet.GetCell("A3"_pos), nullptr);
+		}
+
+		// незакрытая кавычка забирает остаток текста, из потока и из файла
+		{
+			const std::string text = "a,b\n\"unterminated,\"\"x\"\"\n1,2\n";
+			auto check_unterminated = [](const Sheet& sheet) {
+				ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 2 }));
+				ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), std::string("b"));
+				ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), std::string("unterminated,\"x\"\n1,2\n"));
+			};
+			{
+				Sheet sheet;
+				std::istringstream input(text);
+				ImportTexts(sheet, input, TextFormat::Csv);
+				check_unterminated(sheet);
+			}
+			const auto csv_path = std::filesystem::temp_directory_path() / "spreadsheet_import_test.csv";
+			{
+				std::ofstream file(csv_path, std::ios::binary);
+				file << text;
+			}
+			Sheet sheet;
+			ImportTextsFile(sheet, csv_path.string(), TextFormat::Csv);
+			std::filesystem::remove(csv_path);
+			check_unterminated(sheet);
+		}
+
+		try {
+			Sheet sheet;
+			std::istringstream input("=B1\t=A1\n");
+			ImportTexts(sheet, input);
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException&) {
+		}
+	}
+
+	void TestSheetSnapshot() {
+		// числа, тексты, формулы, протянутые вдоль столбцов (общие программы),
+		// диапазоны и ошибки
+		const int rows = 500;
+		Sheet sheet(2);
+		for (int row = 0; row < rows; ++row) {
+			const std::string n = std::to_string(row + 1);
+			sheet.SetCell({ row, 0 }, std::to_string(row % 7));
+			sheet.SetCell({ row, 1 }, row % 3 == 0 ? "text " + n : "'=escaped " + n);
+			sheet.SetCell({ row, 2 }, "=A" + n + "*2+1");
+			sheet.SetCell({ row, 3 }, "=C" + n + "/A" + n);
+			sheet.SetCell({ row, 4 }, "=SUM(A" + n + ":D" + n + ")");
+		}
+		sheet.SetCell("F1"_pos, "=B1+1");
+		sheet.SetCell("F2"_pos, "=F1/0");
+		sheet.SetCell("F3"_pos, "=F4");
+		sheet.SetCell("H10"_pos, "=");
+		std::ostringstream sheet_values;
+		sheet.PrintValues(sheet_values);
+		// формулы, зависящие от A2, остаются невычисленными
+		sheet.SetCell("A2"_pos, "100");
+		std::ostringstream sheet_texts;
+		sheet.PrintTexts(sheet_texts);
+
+		std::stringstream snapshot;
+		sheet.SaveSnapshot(snapshot);
+		const std::string data = snapshot.str();
+		const auto path = std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin";
+		{
+			std::ofstream file(path, std::ios::binary);
+			file << data;
+		}
+		std::vector<std::unique_ptr<Sheet>> loaded;
+		loaded.push_back(Sheet::LoadSnapshot(snapshot, 2));
+		loaded.push_back(Sheet::LoadSnapshotFile(path.string(), 2));
+		std::filesystem::remove(path);
+		const size_t misses = sheet.GetCacheStats().misses;
+		std::ostringstream expected_values;
+		sheet.PrintValues(expected_values);
+		const size_t pending_count = sheet.GetCacheStats().misses - misses;
+		ASSERT_EQUAL(pending_count, 3u);
+		for (const auto& copy : loaded) {
+			std::ostringstream texts;
+			copy->PrintTexts(texts);
+			ASSERT(texts.str() == sheet_texts.str());
+			ASSERT_EQUAL(copy->GetPrintableSize(), sheet.GetPrintableSize());
+			ASSERT_EQUAL(copy->GetFormulaProgramCount(), sheet.GetFormulaProgramCount());
+			ASSERT_EQUAL(copy->GetFormulaProgramCount(), 6u);
+			// вычисляются только формулы, которые не были вычислены до снимка
+			std::ostringstream values;
+			copy->PrintValues(values);
+			ASSERT(values.str() == expected_values.str());
+			ASSERT_EQUAL(copy->GetCacheStats().misses, pending_count);
+
+			// граф восстановлен: правки доходят до зависимых ячеек, циклы видны
+			copy->SetCell("A500"_pos, "50");
+			ASSERT_EQUAL(std::get<double>(copy->GetCell("C500"_pos)->GetValue()), 101.0);
+			try {
+				copy->SetCell("A1"_pos, "=E1");
+				ASSERT(false);
+			}
+			catch (const CircularDependencyException&) {
+			}
+			// новые формулы используют программы из снимка
+			copy->SetCell({ rows, 2 }, "=A" + std::to_string(rows + 1) + "*2+1");
+			ASSERT_EQUAL(copy->GetFormulaProgramCount(), 6u);
+		}
+
+		{
+			Sheet empty;
+			std::stringstream empty_snapshot;
+			empty.SaveSnapshot(empty_snapshot);
+			const auto copy = Sheet::LoadSnapshot(empty_snapshot);
+			ASSERT_EQUAL(copy->GetPrintableSize(), (Size{ 0, 0 }));
+		}
+
+		auto expect_error = [](const std::string& damaged, const std::string& message) {
+			try {
+				std::istringstream input(damaged);
+				Sheet::LoadSnapshot(input);
+				ASSERT(false);
+			}
+			catch (const SnapshotException& e) {
+				ASSERT_EQUAL(std::string(e.what()), message);
+			}
+		};
+		std::string damaged = data;
+		damaged[data.size() / 2] ^= 1;
+		expect_error(damaged, "Snapshot is damaged: checksum mismatch");
+		expect_error(data.substr(0, data.size() - 1), "Snapshot is damaged: checksum mismatch");
+		damaged = data;
+		damaged[8] = 2;
+		expect_error(damaged, "Unsupported snapshot version 2");
+		expect_error(sheet_texts.str(), "Not a sheet snapshot");
+		expect_error(std::string(), "Not a sheet snapshot");
+
+		// подделанные снимки с верной контрольной суммой: edit меняет данные
+		// перед контрольной суммой
+		auto save_forged = [](const Sheet& source, auto edit) {
+			std::ostringstream output;
+			source.SaveSnapshot(output);
+			std::string forged = output.str();
+			const size_t checksum_pos = forged.size() - sizeof(std::uint64_t);
+			edit(forged, checksum_pos);
+			SnapshotChecksum checksum;
+			checksum.Update(forged.data(), checksum_pos);
+			const std::uint64_t value = checksum.Get();
+			std::memcpy(forged.data() + checksum_pos, &value, sizeof(value));
+			return forged;
+		};
+		auto replace = [](const std::string& from, const std::string& to) {
+			return [from, to](std::string& forged, size_t) {
+				const size_t pos = forged.find(from);
+				ASSERT(pos != std::string::npos);
+				forged.replace(pos, from.size(), to);
+			};
+		};
+		{
+			Sheet source;
+			source.SetCell("A1"_pos, "=B1");
+			source.SetCell("B1"_pos, "2");
+			expect_error(save_forged(source, replace("=B1", "=C1")),
+				"Snapshot has a dependency graph that doesn't match the cells");
+			// A1 ссылается на себя и в тексте, и в графе: последнее перед
+			// контрольной суммой число - номер узла, на который ссылается A1
+			expect_error(save_forged(source, [&replace](std::string& forged, size_t checksum_pos) {
+				replace("=B1", "=A1")(forged, checksum_pos);
+				const std::uint32_t self_id = 0;
+				std::memcpy(forged.data() + checksum_pos - sizeof(self_id), &self_id, sizeof(self_id));
+			}), "Snapshot has circular dependencies");
+		}
+		{
+			// A2 использует программу A1, но его текст с ней не совпадает
+			Sheet source;
+			source.SetCell("A1"_pos, "=B1+1");
+			source.SetCell("A2"_pos, "=B2+1");
+			expect_error(save_forged(source, replace("=B2+1", "=B2-1")), "Snapshot has an invalid formula at A2");
+		}
+		{
+			Sheet source;
+			source.SetCell("A1"_pos, "=1");
+			source.SetCell("B1"_pos, "=A1+1");
+			std::ostringstream values;
+			source.PrintValues(values);
+			// значение A1 помечается невычисленным, а B1 остаётся вычисленной
+			const double one = 1.0;
+			const std::string computed = std::string(reinterpret_cast<const char*>(&one), sizeof(one))
+				+ static_cast<char>(NumericColumns::Kind::Number);
+			const std::string pending = computed.substr(0, sizeof(one)) + static_cast<char>(NumericColumns::Kind::Pending);
+			expect_error(save_forged(source, replace(computed, pending)),
+				"Snapshot has a computed formula that depends on a pending one");
+		}
+		try {
+			Sheet::LoadSnapshotFile(path.string());
+			ASSERT(false);
+		}
+		catch (const std::system_error&) {
+		}
+	}
+
+	void TestThreadPool() {
+		ThreadPool pool(4);
+		ASSERT_EQUAL(pool.GetThreadCount(), 4u);
+		for (size_t count : { 0u, 1u, 7u, 1000u, 12345u }) {
+			std::vector<std::atomic<int>> visits(count);
+			pool.ParallelFor(count, 10, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) {
+					visits[i].fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+			ASSERT(std::all_of(visits.begin(), visits.end(), [](const std::atomic<int>& value) {
+				return value.load() == 1;
+			}));
+		}
+	}
+
+	void TestSetCellsParallelParsing() {
+		const int rows = 2000;
+		std::vector<std::string> texts;
+		std::vector<std::pair<Position, std::string_view>> cells;
+		for (int row = 0; row < rows; ++row) {
+			texts.push_back("=" + Position{ row, 0 }.ToString() + "*2+" + std::to_string(row));
+		}
+		for (int row = 0; row < rows; ++row) {
+			cells.push_back({ { row, 1 }, texts[row] });
+		}
+
+		auto sheet = CreateSheet();
+		auto reference_sheet = CreateSheet();
+		for (int row = 0; row < rows; ++row) {
+			reference_sheet->SetCell({ row, 1 }, texts[row]);
+		}
+		sheet->SetCells(cells);
+		std::ostringstream values;
+		std::ostringstream reference_values;
+		sheet->PrintValues(values);
+		reference_sheet->PrintValues(reference_values);
+		ASSERT_EQUAL(values.str(), reference_values.str());
+
+		// сообщается первая по порядку пакета ошибка
+		auto bad_cells = cells;
+		bad_cells[1500].second = "=1+";
+		bad_cells[700].second = "=(";
+		try {
+			sheet->SetCells(bad_cells);
+			ASSERT(false);
+		}
+		catch (const FormulaException& e) {
+			const std::string expected_prefix = Position{ 700, 1 }.ToString() + ":";
+			ASSERT_EQUAL(std::string(e.what()).substr(0, expected_prefix.size()), expected_prefix);
+		}
+	}
+
+	void TestRecalculate() {
+		// свёртка: строка 0 - исходные числа, каждая следующая строка
+		// складывает соседние ячейки предыдущей
+		const int cols = 600;
+		const int rows = 6;
+		Sheet sheet;
+		auto lazy_sheet = CreateSheet();
+		for (int col = 0; col < cols; ++col) {
+			sheet.SetCell({ 0, col }, std::to_string(col % 7));
+			lazy_sheet->SetCell({ 0, col }, std::to_string(col % 7));
+		}
+		for (int row = 1; row < rows; ++row) {
+			for (int col = 0; col + row < cols; ++col) {
+				const std::string text = "=" + Position{ row - 1, col }.ToString() + "+" + Position{ row - 1, col + 1 }.ToString();
+				sheet.SetCell({ row, col }, text);
+				lazy_sheet->SetCell({ row, col }, text);
+			}
+		}
+		const size_t formula_count = (rows - 1) * cols - (rows - 1) * rows / 2;
+
+		auto values_of = [](const SheetInterface& sheet) {
+			std::ostringstream out;
+			sheet.PrintValues(out);
+			return out.str();
+		};
+		sheet.Recalculate();
+		ASSERT_EQUAL(sheet.GetCacheStats().misses, formula_count);
+		ASSERT_EQUAL(values_of(sheet), values_of(*lazy_sheet));
+		ASSERT_EQUAL(sheet.GetCacheStats().misses, formula_count);
+
+		// пересчитывается только то, что зависит от изменённой ячейки
+		sheet.SetCell({ 0, 300 }, "100");
+		lazy_sheet->SetCell({ 0, 300 }, "100");
+		sheet.Recalculate();
+		ASSERT_EQUAL(sheet.GetCacheStats().misses, formula_count + 20);
+		ASSERT_EQUAL(values_of(sheet), values_of(*lazy_sheet));
+
+		sheet.Recalculate();
+		ASSERT_EQUAL(sheet.GetCacheStats().misses, formula_count + 20);
+
+		// длинная цепочка вычисляется по уровням, без рекурсии
+		const int length = 15000;
+		sheet.SetCell({ 0, 700 }, "1");
+		for (int row = 1; row < length; ++row) {
+			sheet.SetCell({ row, 700 }, "=" + Position{ row - 1, 700 }.ToString() + "*2-1");
+		}
+		sheet.Recalculate();
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell({ length - 1, 700 })->GetValue()), 1);
+	}
+
+	// Двумерные префиксные суммы: P(r, c) = A(r, c) + P(r-1, c) + P(r, c-1) - P(r-1, c-1).
+	// Число путей от A(0, 0) до P(r, c) растёт как C(r+c, r), поэтому сброс кэша
+	// без отсечения посещённых ячеек на такой решётке не завершается.
+	// Исходные числа лежат в столбцах [0, n), суммы - в столбцах [n, 2n).
+	void FillPrefixSumGrid(SheetInterface& sheet, int n) {
+		for (int row = 0; row < n; ++row) {
+			for (int col = 0; col < n; ++col) {
+				sheet.SetCell({ row, col }, std::to_string(row + col));
+			}
+		}
+		for (int row = 0; row < n; ++row) {
+			for (int col = 0; col < n; ++col) {
+				std::string text = "=" + Position{ row, col }.ToString();
+				if (row > 0) {
+					text += "+" + Position{ row - 1, n + col }.ToString();
+				}
+				if (col > 0) {
+					text += "+" + Position{ row, n + col - 1 }.ToString();
+				}
+				if (row > 0 && col > 0) {
+					text += "-" + Position{ row - 1, n + col - 1 }.ToString();
+				}
+				sheet.SetCell({ row, n + col }, text);
+			}
+		}
+	}
+
+	void TestPrefixSumInvalidation() {
+		const int n = 60;
+		Sheet sheet;
+		FillPrefixSumGrid(sheet, n);
+		auto prefix_sum = [&](int row, int col) {
+			return std::get<double>(sheet.GetCell({ row, n + col })->GetValue());
+		};
+		sheet.Recalculate();
+		// сумма (i + j) по i <= r, j <= c
+		ASSERT_EQUAL(prefix_sum(n - 1, n - 1), 1.0 * n * n * (n - 1));
+		ASSERT_EQUAL(sheet.GetCacheStats().invalidations, 0u);
+
+		// правка угла сбрасывает каждую сумму ровно один раз
+		sheet.SetCell({ 0, 0 }, "1000");
+		ASSERT_EQUAL(sheet.GetCacheStats().invalidations, size_t(n * n));
+		// повторные правки до пересчёта ничего не обходят: всё уже грязное
+		sheet.SetCell({ 0, 0 }, "100");
+		sheet.SetCell({ 0, 1 }, "101");
+		ASSERT_EQUAL(sheet.GetCacheStats().invalidations, size_t(n * n));
+		sheet.Recalculate();
+		ASSERT_EQUAL(prefix_sum(n - 1, n - 1), 1.0 * n * n * (n - 1) + 100 + 100);
+		ASSERT_EQUAL(prefix_sum(0, 0), 100);
+
+		// правка в середине задевает только правый нижний квадрант
+		sheet.SetCell({ n / 2, n / 2 }, "0");
+		ASSERT_EQUAL(sheet.GetCacheStats().invalidations, size_t(n * n + (n / 2) * (n / 2)));
+		const size_t misses = sheet.GetCacheStats().misses;
+		prefix_sum(n / 2 - 1, n - 1);
+		prefix_sum(n - 1, n / 2 - 1);
+		ASSERT_EQUAL(sheet.GetCacheStats().misses, misses);
+		ASSERT_EQUAL(prefix_sum(n - 1, n - 1), 1.0 * n * n * (n - 1) + 200 - n);
+
+		// большая решётка: правка угла и пересчёт несколько раз подряд
+		const int big_n = 200;
+		Sheet big_sheet;
+		FillPrefixSumGrid(big_sheet, big_n);
+		big_sheet.Recalculate();
+		for (int i = 0; i < 3; ++i) {
+			big_sheet.SetCell({ 0, 0 }, std::to_string(i + 1));
+			big_sheet.Recalculate();
+		}
+		ASSERT_EQUAL(big_sheet.GetCacheStats().invalidations, size_t(3 * big_n * big_n));
+		ASSERT_EQUAL(std::get<double>(big_sheet.GetCell({ big_n - 1, 2 * big_n - 1 })->GetValue()),
+			1.0 * big_n * big_n * (big_n - 1) + 3);
+	}
+
+	void TestDependencyIndex() {
+		Sheet sheet;
+		auto value_of = [&](Position pos) {
+			return std::get<double>(sheet.GetCell(pos)->GetValue());
+		};
+
+		// ссылка на ячейку, которой ещё нет, не создаёт её
+		sheet.SetCell("C1"_pos, "=A1+B1");
+		ASSERT_EQUAL(value_of("C1"_pos), 0);
+		ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+		sheet.SetCell("A1"_pos, "2");
+		ASSERT_EQUAL(value_of("C1"_pos), 2);
+
+		// рёбра переживают очистку и повторное заполнение ячейки
+		sheet.ClearCell("A1"_pos);
+		ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+		ASSERT_EQUAL(value_of("C1"_pos), 0);
+		sheet.SetCell("A1"_pos, "5");
+		sheet.SetCell("B1"_pos, "=A1*2");
+		ASSERT_EQUAL(value_of("C1"_pos), 15);
+		sheet.SetCell("B1"_pos, "");
+		ASSERT_EQUAL(value_of("C1"_pos), 5);
+		sheet.SetCell("B1"_pos, "=A1*3");
+		ASSERT_EQUAL(value_of("C1"_pos), 20);
+
+		// после очистки формулы её ячейка больше не зависит от ссылок
+		const size_t invalidations = sheet.GetCacheStats().invalidations;
+		sheet.ClearCell("C1"_pos);
+		sheet.SetCell("A1"_pos, "6");
+		ASSERT_EQUAL(sheet.GetCacheStats().invalidations, invalidations + 1);
+		ASSERT_EQUAL(value_of("B1"_pos), 18);
+
+		// очищенная ячейка снова может ссылаться на бывших зависимых
+		sheet.SetCell("C1"_pos, "=B1");
+		sheet.ClearCell("C1"_pos);
+		sheet.SetCell("A1"_pos, "=C1+1");
+		ASSERT_EQUAL(value_of("B1"_pos), 3);
+		try {
+			sheet.SetCell("C1"_pos, "=B1");
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException&) {
+		}
+		ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+	}
+
+	void TestDependencyGraph() {
+		// сверка со словарём множеств на случайных правках; позиций немного,
+		// чтобы узлы часто удалялись и создавались заново
+		DependencyGraph graph;
+		std::map<Position, std::set<Position>> references;
+		std::mt19937 gen(17);
+		std::uniform_int_distribution<int> coord(0, 9);
+		std::uniform_int_distribution<int> reference_count(0, 5);
+		auto random_position = [&] {
+			return Position{ coord(gen) * 1000, coord(gen) * 7 };
+		};
+		auto expected_dependents = [&](Position pos) {
+			std::set<Position> result;
+			for (const auto& [cell_pos, cell_references] : references) {
+				if (cell_references.count(pos)) {
+					result.insert(cell_pos);
+				}
+			}
+			return result;
+		};
+
+		for (int step = 0; step < 20000; ++step) {
+			const Position pos = random_position();
+			std::vector<Position> new_references(reference_count(gen));
+			for (auto& ref_pos : new_references) {
+				ref_pos = random_position();
+			}
+			new_references.push_back(Position{ -1, 0 });
+			auto& expected = references[pos];
+			expected.clear();
+			for (const Position& ref_pos : new_references) {
+				if (ref_pos.IsValid()) {
+					expected.insert(ref_pos);
+				}
+			}
+			graph.SetReferences(pos, new_references);
+
+			const Position probe = random_position();
+			std::set<Position> actual_references;
+			graph.ForEachReference(probe, [&](Position ref_pos) {
+				ASSERT(actual_references.insert(ref_pos).second);
+			});
+			ASSERT(actual_references == references[probe]);
+			std::set<Position> actual_dependents;
+			graph.ForEachDependent(probe, [&](Position dependent_pos) {
+				ASSERT(actual_dependents.insert(dependent_pos).second);
+			});
+			ASSERT(actual_dependents == expected_dependents(probe));
+			ASSERT_EQUAL(graph.HasDependents(probe), !actual_dependents.empty());
+		}
+
+		size_t edge_count = 0;
+		for (const auto& [cell_pos, cell_references] : references) {
+			edge_count += cell_references.size();
+		}
+		ASSERT_EQUAL(graph.GetEdgeCount(), edge_count);
+		for (const auto& [cell_pos, cell_references] : references) {
+			graph.SetReferences(cell_pos, {});
+		}
+		ASSERT_EQUAL(graph.GetEdgeCount(), 0u);
+		ASSERT_EQUAL(graph.GetNodeCount(), 0u);
+	}
+
+	void TestDependencyGraphRanges() {
+		// диапазоны разного размера, в том числе пересекающие границы квадратов
+		// индекса; зависимые сверяются с прямым перебором
+		DependencyGraph graph;
+		std::map<Position, std::vector<Range>> ranges;
+		std::mt19937 gen(23);
+		std::uniform_int_distribution<int> coord(0, 200);
+		std::uniform_int_distribution<int> range_count(0, 3);
+		auto random_position = [&] {
+			return Position{ coord(gen), coord(gen) };
+		};
+
+		for (int step = 0; step < 3000; ++step) {
+			const Position pos = random_position();
+			std::vector<Range> new_ranges(range_count(gen));
+			for (auto& range : new_ranges) {
+				range = Range::FromCorners(random_position(), random_position());
+			}
+			graph.SetReferences(pos, {}, new_ranges);
+			std::sort(new_ranges.begin(), new_ranges.end());
+			new_ranges.erase(std::unique(new_ranges.begin(), new_ranges.end()), new_ranges.end());
+			ranges[pos] = new_ranges;
+
+			const Position probe = random_position();
+			std::vector<Range> actual_ranges;
+			graph.ForEachReferencedRange(probe, [&](Range range) {
+				actual_ranges.push_back(range);
+			});
+			std::sort(actual_ranges.begin(), actual_ranges.end());
+			ASSERT(actual_ranges == ranges[probe]);
+
+			std::set<Position> expected_dependents;
+			for (const auto& [cell_pos, cell_ranges] : ranges) {
+				for (const Range& range : cell_ranges) {
+					if (range.Contains(probe)) {
+						expected_dependents.insert(cell_pos);
+					}
+				}
+			}
+			std::set<Position> actual_dependents;
+			graph.ForEachDependent(probe, [&](Position dependent_pos) {
+				actual_dependents.insert(dependent_pos);
+			});
+			ASSERT(actual_dependents == expected_dependents);
+			ASSERT_EQUAL(graph.HasDependents(probe), !expected_dependents.empty());
+
+			const Range area = Range::FromCorners(random_position(), random_position());
+			std::set<Position> expected_referencing;
+			for (const auto& [cell_pos, cell_ranges] : ranges) {
+				if (!cell_ranges.empty() && area.Contains(cell_pos)) {
+					expected_referencing.insert(cell_pos);
+				}
+			}
+			std::set<Position> actual_referencing;
+			graph.ForEachReferencingPosition(area, [&](Position referencing_pos) {
+				ASSERT(actual_referencing.insert(referencing_pos).second);
+			});
+			ASSERT(actual_referencing == expected_referencing);
+		}
+
+		for (const auto& [cell_pos, cell_ranges] : ranges) {
+			graph.SetReferences(cell_pos, {});
+		}
+		ASSERT_EQUAL(graph.GetNodeCount(), 0u);
+	}
+
 }  // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
+	if (argc > 1 && std::string_view(argv[1]) == "--bench") {
+		RunBenchmarks(argc > 2 ? std::stoul(argv[2]) : DEFAULT_GRAPH_BENCHMARK_EDGES);
+		return 0;
+	}
+
 	TestRunner tr;
 	RUN_TEST(tr, TestEmpty);
 	RUN_TEST(tr, TestInvalidPosition);
@@ -168,5 +1734,34 @@ int main() {
 	RUN_TEST(tr, TestDiv0);
 	RUN_TEST(tr, TestValueError);
 	RUN_TEST(tr, TestCircularException);
+	RUN_TEST(tr, TestFormulaCache);
+	RUN_TEST(tr, TestCacheInvalidation);
+	RUN_TEST(tr, TestFarCell);
+	RUN_TEST(tr, TestPrintableSizeTracking);
+	RUN_TEST(tr, TestCircularDependencyDetection);
+	RUN_TEST(tr, TestSyntaxError);
+	RUN_TEST(tr, TestFastParserMatchesAntlr);
+	RUN_TEST(tr, TestFormulaEvaluation);
+	RUN_TEST(tr, TestRangeFunctions);
+	RUN_TEST(tr, TestRangeCircularDependency);
+	RUN_TEST(tr, TestNumericColumns);
+	RUN_TEST(tr, TestAggregateKernels);
+	RUN_TEST(tr, TestErrorPropagation);
+	RUN_TEST(tr, TestReadsDoNotAllocate);
+	RUN_TEST(tr, TestFormulaArena);
+	RUN_TEST(tr, TestFormulaOptimization);
+	RUN_TEST(tr, TestFormulaInterning);
+	RUN_TEST(tr, TestOutputBuffer);
+	RUN_TEST(tr, TestNumericText);
+	RUN_TEST(tr, TestSetCells);
+	RUN_TEST(tr, TestThreadPool);
+	RUN_TEST(tr, TestSetCellsParallelParsing);
+	RUN_TEST(tr, TestImportTexts);
+	RUN_TEST(tr, TestSheetSnapshot);
+	RUN_TEST(tr, TestRecalculate);
+	RUN_TEST(tr, TestPrefixSumInvalidation);
+	RUN_TEST(tr, TestDependencyIndex);
+	RUN_TEST(tr, TestDependencyGraph);
+	RUN_TEST(tr, TestDependencyGraphRanges);
 	return 0;
 }
\ No newline at end of file
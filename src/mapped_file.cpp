@@ -0,0 +1,87 @@
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <system_error>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+#ifndef _WIN32
+	class FileDescriptor {
+	public:
+		explicit FileDescriptor(int fd)
+			: fd_(fd) {
+		}
+
+		FileDescriptor(const FileDescriptor&) = delete;
+		FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+		~FileDescriptor() {
+			if (fd_ >= 0) {
+				close(fd_);
+			}
+		}
+
+		int Get() const {
+			return fd_;
+		}
+
+	private:
+		int fd_;
+	};
+#endif
+}  // namespace
+
+// Отображение не зависит от дескриптора, поэтому он закрывается сразу
+std::unique_ptr<MappedFile> MappedFile::Open(const std::string& path) {
+#ifdef _WIN32
+	return nullptr;
+#else
+	const FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	if (fd.Get() < 0) {
+		throw std::system_error(errno, std::generic_category(), path);
+	}
+	struct stat file_stat;
+	if (fstat(fd.Get(), &file_stat) != 0) {
+		throw std::system_error(errno, std::generic_category(), path);
+	}
+	if (!S_ISREG(file_stat.st_mode)) {
+		return nullptr;
+	}
+	const auto file_size = static_cast<std::size_t>(file_stat.st_size);
+	if (file_size == 0) {
+		return std::unique_ptr<MappedFile>(new MappedFile(nullptr, 0));
+	}
+	void* data = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd.Get(), 0);
+	if (data == MAP_FAILED) {
+		return nullptr;
+	}
+	return std::unique_ptr<MappedFile>(new MappedFile(data, file_size));
+#endif
+}
+
+MappedFile::MappedFile(void* data, std::size_t size)
+	: data_(data)
+	, size_(size) {
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+	if (data_) {
+		munmap(data_, size_);
+	}
+#endif
+}
+
+void MappedFile::AdviseSequential() const {
+#ifndef _WIN32
+	if (data_) {
+		madvise(data_, size_, MADV_SEQUENTIAL);
+	}
+#endif
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Файл, отображённый в память только для чтения
+class MappedFile {
+public:
+	// Возвращает nullptr, если файл нельзя отобразить: это не обычный файл,
+	// mmap завершился ошибкой или программа собрана под Windows. Тогда файл
+	// читается потоком. Бросает std::system_error, если файл не открывается.
+	static std::unique_ptr<MappedFile> Open(const std::string& path);
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile();
+
+	std::string_view GetData() const {
+		return { static_cast<const char*>(data_), size_ };
+	}
+
+	// Подсказывает ядру, что файл будет читаться от начала к концу
+	void AdviseSequential() const;
+
+private:
+	MappedFile(void* data, std::size_t size);
+
+	// у пустого файла отображения нет
+	void* data_;
+	std::size_t size_;
+};
@@ -0,0 +1,88 @@
+#include "numeric_columns.h"
+
+#include <cassert>
+
+NumericColumns::NumericColumns() = default;
+
+NumericColumns::~NumericColumns() = default;
+
+void NumericColumns::SetValue(Position pos, const std::variant<double, FormulaError>& value) {
+	if (const auto* number = std::get_if<double>(&value)) {
+		Set(pos, Kind::Number, *number);
+		return;
+	}
+	switch (std::get<FormulaError>(value).GetCategory()) {
+	case FormulaError::Category::Ref:
+		Set(pos, Kind::RefError, 0.0);
+		break;
+	case FormulaError::Category::Value:
+		Set(pos, Kind::ValueError, 0.0);
+		break;
+	case FormulaError::Category::Div0:
+		Set(pos, Kind::Div0Error, 0.0);
+		break;
+	}
+}
+
+void NumericColumns::SetText(Position pos) {
+	Set(pos, Kind::Text, 0.0);
+}
+
+void NumericColumns::SetPending(Position pos) {
+	Set(pos, Kind::Pending, 0.0);
+}
+
+void NumericColumns::SetEmpty(Position pos) {
+	// пустой ячейке блок не нужен
+	if (Chunk* chunk = FindChunk(pos)) {
+		chunk->numbers[pos.row & (CHUNK_SIZE - 1)] = 0.0;
+		chunk->kinds[pos.row & (CHUNK_SIZE - 1)] = Kind::Empty;
+	}
+}
+
+FormulaError NumericColumns::ToError(Kind kind) {
+	switch (kind) {
+	case Kind::RefError:
+		return FormulaError::Category::Ref;
+	case Kind::Div0Error:
+		return FormulaError::Category::Div0;
+	default:
+		assert(kind == Kind::ValueError);
+		return FormulaError::Category::Value;
+	}
+}
+
+std::size_t NumericColumns::GetChunkCount() const {
+	return chunk_count_;
+}
+
+std::size_t NumericColumns::GetMemoryUsage() const {
+	std::size_t result = columns_.capacity() * sizeof(Column) + chunk_count_ * sizeof(Chunk);
+	for (const Column& column : columns_) {
+		result += column.capacity() * sizeof(std::unique_ptr<Chunk>);
+	}
+	return result;
+}
+
+NumericColumns::Chunk& NumericColumns::GetOrCreateChunk(Position pos) {
+	assert(pos.IsValid());
+	if (static_cast<std::size_t>(pos.col) >= columns_.size()) {
+		columns_.resize(pos.col + 1);
+	}
+	Column& column = columns_[pos.col];
+	const auto chunk_index = static_cast<std::size_t>(pos.row >> CHUNK_BITS);
+	if (chunk_index >= column.size()) {
+		column.resize(chunk_index + 1);
+	}
+	if (!column[chunk_index]) {
+		column[chunk_index] = std::make_unique<Chunk>();
+		++chunk_count_;
+	}
+	return *column[chunk_index];
+}
+
+void NumericColumns::Set(Position pos, Kind kind, double number) {
+	Chunk& chunk = GetOrCreateChunk(pos);
+	chunk.numbers[pos.row & (CHUNK_SIZE - 1)] = number;
+	chunk.kinds[pos.row & (CHUNK_SIZE - 1)] = kind;
+}
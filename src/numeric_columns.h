@@ -0,0 +1,118 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <variant>
+#include <vector>
+
+// Последние вычисленные числовые значения ячеек, разложенные по столбцам.
+// Столбец хранится блоками по CHUNK_SIZE строк: в блоке подряд лежат числа и
+// байты вида ячеек, так что формулы читают соседние ячейки столбца линейно,
+// не проходя через объекты ячеек. Блок создаётся при первой записи в него
+// непустой ячейки. Вид хранится байтом, а не битом: при параллельном
+// пересчёте соседние ячейки пишутся разными потоками без атомарных операций.
+class NumericColumns {
+public:
+	static constexpr int CHUNK_BITS = 6;
+	static constexpr int CHUNK_SIZE = 1 << CHUNK_BITS;
+
+	enum class Kind : std::uint8_t {
+		Empty,    // пустая ячейка или ячейка без блока
+		Number,   // число: результат формулы или текст, который читается как число
+		Text,     // текст, который не читается как число
+		Pending,  // формула, значение которой ещё не вычислено
+		RefError,
+		ValueError,
+		Div0Error,
+	};
+
+	struct Entry {
+		Kind kind = Kind::Empty;
+		double number = 0.0;
+	};
+
+	NumericColumns();
+	~NumericColumns();
+
+	// Записывает число или ошибку
+	void SetValue(Position pos, const std::variant<double, FormulaError>& value);
+	void SetText(Position pos);
+	void SetPending(Position pos);
+	void SetEmpty(Position pos);
+
+	Entry Get(Position pos) const;
+
+	// Вызывает callback(Position first, const double* numbers, const Kind* kinds,
+	// std::size_t count) для каждого отрезка столбца внутри range, лежащего в
+	// одном блоке. Отрезки без блока пропускаются: все их ячейки пусты. Обход
+	// прекращается, если callback вернул false; тогда и функция возвращает false.
+	template <typename Callback>
+	bool ForEachSegment(Range range, Callback callback) const;
+
+	static bool IsError(Kind kind) {
+		return kind >= Kind::RefError;
+	}
+	static FormulaError ToError(Kind kind);
+
+	std::size_t GetChunkCount() const;
+	std::size_t GetMemoryUsage() const;
+
+private:
+	struct Chunk {
+		double numbers[CHUNK_SIZE] = {};
+		Kind kinds[CHUNK_SIZE] = {};
+	};
+	using Column = std::vector<std::unique_ptr<Chunk>>;
+
+	std::vector<Column> columns_;
+	std::size_t chunk_count_ = 0;
+
+	Chunk* FindChunk(Position pos) const;
+	Chunk& GetOrCreateChunk(Position pos);
+	void Set(Position pos, Kind kind, double number);
+};
+
+inline NumericColumns::Entry NumericColumns::Get(Position pos) const {
+	if (const Chunk* chunk = FindChunk(pos)) {
+		const int index = pos.row & (CHUNK_SIZE - 1);
+		return { chunk->kinds[index], chunk->numbers[index] };
+	}
+	return {};
+}
+
+inline NumericColumns::Chunk* NumericColumns::FindChunk(Position pos) const {
+	if (static_cast<std::size_t>(pos.col) >= columns_.size()) {
+		return nullptr;
+	}
+	const Column& column = columns_[pos.col];
+	const auto chunk_index = static_cast<std::size_t>(pos.row >> CHUNK_BITS);
+	return chunk_index < column.size() ? column[chunk_index].get() : nullptr;
+}
+
+template <typename Callback>
+bool NumericColumns::ForEachSegment(Range range, Callback callback) const {
+	const int last_col = std::min<int>(range.last.col, static_cast<int>(columns_.size()) - 1);
+	for (int col = range.first.col; col <= last_col; ++col) {
+		const Column& column = columns_[col];
+		const int last_chunk = std::min<int>(range.last.row >> CHUNK_BITS, static_cast<int>(column.size()) - 1);
+		for (int chunk_index = range.first.row >> CHUNK_BITS; chunk_index <= last_chunk; ++chunk_index) {
+			const Chunk* chunk = column[chunk_index].get();
+			if (!chunk) {
+				continue;
+			}
+			const int chunk_first_row = chunk_index << CHUNK_BITS;
+			const int first_row = std::max(range.first.row, chunk_first_row);
+			const int last_row = std::min(range.last.row, chunk_first_row + CHUNK_SIZE - 1);
+			const int offset = first_row - chunk_first_row;
+			if (!callback(Position{ first_row, col }, chunk->numbers + offset, chunk->kinds + offset,
+				static_cast<std::size_t>(last_row - first_row + 1))) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,94 @@
+#include "output_buffer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <system_error>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+	// Самая длинная запись числа в формате %g с 6 значащими цифрами:
+	// "-1.23457e-308"
+	constexpr std::size_t MAX_NUMBER_LENGTH = 16;
+}  // namespace
+
+OutputBuffer::OutputBuffer(std::ostream& output)
+	: data_(std::make_unique<char[]>(CAPACITY))
+	, output_(&output) {
+}
+
+OutputBuffer::OutputBuffer(int fd)
+	: data_(std::make_unique<char[]>(CAPACITY))
+	, fd_(fd) {
+}
+
+OutputBuffer::~OutputBuffer() = default;
+
+void OutputBuffer::Append(std::string_view text) {
+	if (text.empty()) {
+		return;
+	}
+	if (CAPACITY - size_ < text.size()) {
+		Flush();
+		// текст длиннее буфера пишется напрямую
+		if (text.size() >= CAPACITY) {
+			Write(text.data(), text.size());
+			return;
+		}
+	}
+	std::memcpy(data_.get() + size_, text.data(), text.size());
+	size_ += text.size();
+}
+
+void OutputBuffer::Append(double value) {
+	if (CAPACITY - size_ < MAX_NUMBER_LENGTH) {
+		Flush();
+	}
+	const auto result = std::to_chars(data_.get() + size_, data_.get() + CAPACITY, value, std::chars_format::general, 6);
+	size_ = result.ptr - data_.get();
+}
+
+void OutputBuffer::AppendRepeated(char c, std::size_t count) {
+	while (count > 0) {
+		if (size_ == CAPACITY) {
+			Flush();
+		}
+		const std::size_t part = std::min(count, CAPACITY - size_);
+		std::memset(data_.get() + size_, c, part);
+		size_ += part;
+		count -= part;
+	}
+}
+
+void OutputBuffer::Flush() {
+	Write(data_.get(), size_);
+	size_ = 0;
+}
+
+void OutputBuffer::Write(const char* data, std::size_t size) {
+	if (output_) {
+		output_->write(data, static_cast<std::streamsize>(size));
+		return;
+	}
+	while (size > 0) {
+#ifdef _WIN32
+		const int written = _write(fd_, data, static_cast<unsigned>(std::min<std::size_t>(size, CAPACITY)));
+#else
+		const ssize_t written = write(fd_, data, size);
+#endif
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::generic_category(), "write");
+		}
+		data += written;
+		size -= static_cast<std::size_t>(written);
+	}
+}
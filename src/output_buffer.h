@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <string_view>
+
+// Буфер вывода таблицы: текст собирается в блоке на CAPACITY байт и отдаётся
+// потоку или файловому дескриптору целыми блоками, одной записью на блок.
+// Числа форматируются std::to_chars так же, как их выводит std::ostream с
+// настройками по умолчанию (%g, 6 значащих цифр), но без локали и состояния
+// потока. Деструктор не сбрасывает буфер: ошибку записи бросает Flush.
+class OutputBuffer {
+public:
+	static constexpr std::size_t CAPACITY = 1 << 20;
+
+	explicit OutputBuffer(std::ostream& output);
+	explicit OutputBuffer(int fd);
+	~OutputBuffer();
+
+	OutputBuffer(const OutputBuffer&) = delete;
+	OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+	void Append(char c) {
+		if (size_ == CAPACITY) {
+			Flush();
+		}
+		data_[size_++] = c;
+	}
+	void Append(std::string_view text);
+	void Append(double value);
+	void AppendRepeated(char c, std::size_t count);
+
+	// Отдаёт накопленный текст; бросает std::system_error, если запись в
+	// дескриптор не удалась
+	void Flush();
+
+private:
+	std::unique_ptr<char[]> data_;
+	std::size_t size_ = 0;
+	std::ostream* output_ = nullptr;
+	int fd_ = -1;
+
+	void Write(const char* data, std::size_t size);
+};
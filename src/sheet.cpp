@@ -1,29 +1,128 @@
 ﻿#include "sheet.h"
 
 #include <algorithm>
+#include <atomic>
+#include <exception>
 #include <iostream>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <unordered_set>
 
 using namespace std::literals;
 
+Sheet::Sheet(size_t thread_count)
+	: thread_count_(thread_count) {
+}
+
 Sheet::~Sheet() {}
 
 void Sheet::SetCell(Position pos, std::string text) {
 	ThrowIfInvalidPosition(pos);
-	Resize(pos);
-	CellInterface* current_cell = GetCell(pos);
-	if (current_cell && current_cell->GetText() == text) {
+	const Cell* current_cell = GetCellObject(pos);
+	const bool was_empty = !current_cell || current_cell->IsEmpty();
+	if (!was_empty && current_cell->GetTextView() == text) {
 		return;
 	}
-	std::unique_ptr<Cell> tmp = std::make_unique<Cell>(*this);
-	tmp->Set(text);
-	std::unordered_set<Position, PositionHasher> visited;
-	ThrowIfCircularDependencyFound(pos, tmp->GetReferencedCells(), visited);
-	if (!cells_[pos.row][pos.col]) {
-		cells_[pos.row][pos.col] = std::make_unique<Cell>(*this);
+	std::unique_ptr<FormulaInterface> formula;
+	References references;
+	if (text.size() > 1u && text[0] == FORMULA_SIGN) {
+		formula = formulas_.Parse(std::string_view(text).substr(1), pos);
+		references = { formula->GetReferencedCells(), formula->GetReferencedRanges() };
+		ThrowIfCircularDependencyFound(pos, references);
+	}
+	InvalidateDependentCells({ pos });
+	StoreCell(pos, std::move(text), std::move(formula), std::move(references));
+	UpdatePrintableSize();
+}
+
+void Sheet::SetCells(const std::vector<std::pair<Position, std::string_view>>& cells) {
+	struct PendingCell {
+		Position pos;
+		std::string_view text;
+		std::unique_ptr<FormulaInterface> formula;
+		// ссылки ячейки записаны в new_references
+		bool has_references = false;
+	};
+	std::vector<PendingCell> pending;
+	pending.reserve(cells.size());
+	std::unordered_map<Position, size_t, PositionHasher> pending_index;
+	pending_index.reserve(cells.size());
+	for (const auto& [pos, text] : cells) {
+		ThrowIfInvalidPosition(pos);
+		auto [it, inserted] = pending_index.emplace(pos, pending.size());
+		if (inserted) {
+			pending.push_back({ pos, text, nullptr, false });
+		}
+		else {
+			pending[it->second].text = text;
+		}
+	}
+	pending.erase(std::remove_if(pending.begin(), pending.end(), [this](const PendingCell& cell) {
+		const Cell* current_cell = GetCellObject(cell.pos);
+		return (current_cell ? current_cell->GetTextView() : std::string_view{}) == cell.text;
+	}), pending.end());
+
+	// Разбор и проверка на циклы идут до первого изменения таблицы. Формулы
+	// независимы друг от друга и разбираются параллельно; ошибки собираются по
+	// индексам, чтобы сообщить о первой по порядку пакета некорректной формуле
+	// независимо от расписания потоков.
+	std::vector<std::exception_ptr> parse_errors(pending.size());
+	GetThreadPool().ParallelFor(pending.size(), PARSE_GRAIN_SIZE, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			auto& cell = pending[i];
+			if (cell.text.size() > 1u && cell.text[0] == FORMULA_SIGN) {
+				try {
+					cell.formula = formulas_.Parse(cell.text.substr(1), cell.pos);
+				}
+				catch (...) {
+					parse_errors[i] = std::current_exception();
+				}
+			}
+		}
+	});
+	for (size_t i = 0; i < pending.size(); ++i) {
+		if (!parse_errors[i]) {
+			continue;
+		}
+		try {
+			std::rethrow_exception(parse_errors[i]);
+		}
+		catch (const FormulaException& e) {
+			throw FormulaException(pending[i].pos.ToString() + ": "s + e.what());
+		}
+	}
+
+	// Для проверки на циклы нужны новые ссылки формул и ячеек, у которых были
+	// ссылки. Остальные ячейки ни на что не ссылались и не будут: их ссылки
+	// в графе и так пусты.
+	std::unordered_map<Position, References, PositionHasher> new_references;
+	for (auto& cell : pending) {
+		if (cell.formula) {
+			new_references[cell.pos] = { cell.formula->GetReferencedCells(), cell.formula->GetReferencedRanges() };
+			cell.has_references = true;
+		}
+		else if (GetCellObject(cell.pos) && graph_.HasReferences(cell.pos)) {
+			new_references[cell.pos];
+			cell.has_references = true;
+		}
+	}
+	ThrowIfCircularDependenciesFound(new_references);
+
+	std::vector<Position> changed_positions;
+	changed_positions.reserve(pending.size());
+	for (const auto& cell : pending) {
+		changed_positions.push_back(cell.pos);
+	}
+	InvalidateDependentCells(changed_positions);
+	for (auto& cell : pending) {
+		References references;
+		if (cell.has_references) {
+			references = std::move(new_references.at(cell.pos));
+		}
+		StoreCell(cell.pos, cell.formula ? std::string{} : std::string(cell.text), std::move(cell.formula),
+			std::move(references));
 	}
-	cells_[pos.row][pos.col]->Set(text);
 	UpdatePrintableSize();
 }
 
@@ -36,11 +135,9 @@ CellInterface* Sheet::GetCell(Position pos) {
 
 void Sheet::ClearCell(Position pos) {
 	ThrowIfInvalidPosition(pos);
-	if (pos.row > sheet_size_.rows - 1 || pos.col > sheet_size_.cols - 1) {
-		return;
-	}
-	if (cells_[pos.row][pos.col]) {
-		cells_[pos.row][pos.col]->Clear();
+	if (cells_.Find(pos)) {
+		InvalidateDependentCells({ pos });
+		StoreCell(pos, {}, nullptr, {});
 		UpdatePrintableSize();
 	}
 }
@@ -49,51 +146,153 @@ Size Sheet::GetPrintableSize() const {
 	return printable_size_;
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
+const CacheStats& Sheet::GetCacheStats() const {
+	return cache_stats_;
+}
+
+size_t Sheet::GetFormulaProgramCount() const {
+	return formulas_.GetSize();
+}
+
+const NumericColumns* Sheet::GetNumericColumns() const {
+	return &numeric_columns_;
+}
+
+// Строки без ячеек видны по non_empty_rows_ и выводятся одними табуляциями.
+// В остальных строках блок хранилища ищется один раз на TILE_SIZE столбцов.
+template <typename CellPrinter>
+void Sheet::PrintCells(OutputBuffer& output, CellPrinter print_cell) const {
+	const int cols = printable_size_.cols;
+	auto next_non_empty_row = non_empty_rows_.begin();
 	for (int row = 0; row < printable_size_.rows; ++row) {
-		bool first = true;
-		for (int col = 0; col < printable_size_.cols; ++col) {
-			if (!first) {
-				output << '\t';
-			}
-			else {
-				first = false;
-			}
-			if (cells_[row][col]) {
-				std::visit(CellInterfaceValuePrinter{ output }, cells_[row][col]->GetValue());
+		if (next_non_empty_row == non_empty_rows_.end() || next_non_empty_row->first != row) {
+			output.AppendRepeated('\t', static_cast<size_t>(cols - 1));
+			output.Append('\n');
+			continue;
+		}
+		++next_non_empty_row;
+		for (int tile_col = 0; tile_col < cols; tile_col += CellStorage::TILE_SIZE) {
+			const std::unique_ptr<Cell>* slots = cells_.FindTileRow({ row, tile_col });
+			const int tile_end = std::min(cols, tile_col + CellStorage::TILE_SIZE);
+			for (int col = tile_col; col < tile_end; ++col) {
+				if (col > 0) {
+					output.Append('\t');
+				}
+				if (slots && slots[col - tile_col]) {
+					print_cell(output, *slots[col - tile_col]);
+				}
 			}
 		}
-		output << '\n';
+		output.Append('\n');
 	}
 }
+
+void Sheet::PrintValues(OutputBuffer& output) const {
+	PrintCells(output, [](OutputBuffer& out, const Cell& cell) {
+		const auto value = cell.GetValueView();
+		if (const auto* number = std::get_if<double>(&value)) {
+			out.Append(*number);
+		}
+		else if (const auto* error = std::get_if<FormulaError>(&value)) {
+			out.Append(error->ToString());
+		}
+		else {
+			out.Append(std::get<std::string_view>(value));
+		}
+	});
+	output.Flush();
+}
+
+void Sheet::PrintTexts(OutputBuffer& output) const {
+	PrintCells(output, [](OutputBuffer& out, const Cell& cell) {
+		out.Append(cell.GetTextView());
+	});
+	output.Flush();
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+	OutputBuffer buffer(output);
+	PrintValues(buffer);
+}
+
 void Sheet::PrintTexts(std::ostream& output) const {
-	for (int row = 0; row < printable_size_.rows; ++row) {
-		bool first = true;
-		for (int col = 0; col < printable_size_.cols; ++col) {
-			if (!first) {
-				output << '\t';
-			}
-			else {
-				first = false;
-			}
-			if (cells_[row][col]) {
-				output << cells_[row][col]->GetText();
-			}
+	OutputBuffer buffer(output);
+	PrintTexts(buffer);
+}
+
+void Sheet::WriteValues(int fd) const {
+	OutputBuffer buffer(fd);
+	PrintValues(buffer);
+}
+
+void Sheet::WriteTexts(int fd) const {
+	OutputBuffer buffer(fd);
+	PrintTexts(buffer);
+}
+
+// Уровни строятся алгоритмом Кана по грязному подграфу: у каждой грязной
+// формулы считается число грязных ячеек, на которые она ссылается. Кэш
+// сбрасывается каскадом по зависимым ячейкам, поэтому все зависимые от
+// грязной ячейки тоже грязные и рёбра подграфа - все рёбра графа из них.
+// Вычислив ячейку, поток уменьшает счётчики её зависимых; ячейки, у которых
+// счётчик дошёл до нуля, образуют следующий уровень. Между уровнями пул
+// дожидается всех потоков, так что значения предыдущего уровня видны
+// следующему без дополнительной синхронизации.
+void Sheet::Recalculate() {
+	std::vector<const Cell*> dirty_cells;
+	std::vector<Position> dirty_positions;
+	cells_.ForEach([&](Position pos, const Cell& cell) {
+		if (cell.IsDirty()) {
+			dirty_cells.push_back(&cell);
+			dirty_positions.push_back(pos);
 		}
-		output << '\n';
+	});
+	if (dirty_cells.empty()) {
+		return;
+	}
+
+	for (size_t i = 0; i < dirty_cells.size(); ++i) {
+		dirty_cells[i]->recalculate_index_ = i;
+	}
+	std::vector<std::atomic<size_t>> dirty_references(dirty_cells.size());
+	for (Position pos : dirty_positions) {
+		graph_.ForEachDependent(pos, [&](Position dependent_pos) {
+			dirty_references[cells_.Find(dependent_pos)->recalculate_index_].fetch_add(1, std::memory_order_relaxed);
+		});
 	}
-}
 
-void Sheet::Resize(Position pos) {
-	const int old_rows = sheet_size_.rows;
-	sheet_size_.rows = std::max(pos.row + 1, sheet_size_.rows);
-	sheet_size_.cols = std::max(pos.col + 1, sheet_size_.cols);
-	cells_.resize(sheet_size_.rows);
-	for (int row = old_rows; row < sheet_size_.rows; ++row) {
-		cells_[row].resize(sheet_size_.cols);
+	std::vector<size_t> level;
+	for (size_t i = 0; i < dirty_cells.size(); ++i) {
+		if (dirty_references[i].load(std::memory_order_relaxed) == 0) {
+			level.push_back(i);
+		}
 	}
-	for (auto& row : cells_) {
-		row.resize(sheet_size_.cols);
+
+	ThreadPool& thread_pool = GetThreadPool();
+	std::mutex next_level_mutex;
+	std::vector<size_t> next_level;
+	while (!level.empty()) {
+		thread_pool.ParallelFor(level.size(), RECALCULATE_GRAIN_SIZE, [&](size_t begin, size_t end) {
+			CacheStats local_stats;
+			std::vector<size_t> ready;
+			{
+				CacheStatsRedirect redirect(local_stats);
+				for (size_t i = begin; i < end; ++i) {
+					dirty_cells[level[i]]->GetValueView();
+					graph_.ForEachDependent(dirty_positions[level[i]], [&](Position dependent_pos) {
+						const size_t index = cells_.Find(dependent_pos)->recalculate_index_;
+						if (dirty_references[index].fetch_sub(1, std::memory_order_relaxed) == 1) {
+							ready.push_back(index);
+						}
+					});
+				}
+			}
+			std::lock_guard lock(next_level_mutex);
+			next_level.insert(next_level.end(), ready.begin(), ready.end());
+			cache_stats_ += local_stats;
+		});
+		level.swap(next_level);
+		next_level.clear();
 	}
 }
 
@@ -103,61 +302,296 @@ void Sheet::ThrowIfInvalidPosition(Position pos) const {
 	}
 }
 
-void Sheet::UpdatePrintableSize() {
-	int max_non_empty_row = Position::NONE.row;
-	int max_non_empty_col = Position::NONE.col;
-	for (int row = 0; row < sheet_size_.rows; ++row) {
-		for (int col = 0; col < sheet_size_.cols; ++col) {
-			if (cells_[row][col] && !cells_[row][col]->GetText().empty()) {
-				if (row > max_non_empty_row) {
-					max_non_empty_row = row;
-				}
-				if (col > max_non_empty_col) {
-					max_non_empty_col = col;
-				}
-			}
+namespace {
+	void IncrementCount(std::map<int, int>& counts, int key) {
+		++counts[key];
+	}
+
+	void DecrementCount(std::map<int, int>& counts, int key) {
+		auto it = counts.find(key);
+		if (--it->second == 0) {
+			counts.erase(it);
 		}
 	}
-	printable_size_ = { max_non_empty_row + 1, max_non_empty_col + 1 };
+}  // namespace
+
+void Sheet::AddNonEmptyCell(Position pos) {
+	IncrementCount(non_empty_rows_, pos.row);
+	IncrementCount(non_empty_cols_, pos.col);
 }
 
-void Sheet::ThrowIfCircularDependencyFound(const Position& src_pos, const std::vector<Position>& referenced_cells, std::unordered_set<Position, PositionHasher>& visited) const {
+void Sheet::RemoveNonEmptyCell(Position pos) {
+	DecrementCount(non_empty_rows_, pos.row);
+	DecrementCount(non_empty_cols_, pos.col);
+}
+
+// Записывает содержимое ячейки: формулу, если она передана, иначе текст.
+// Пустая ячейка удаляется, рёбра графа от неё к ней не зависят. Кэш
+// зависимых ячеек должен быть сброшен заранее, печатаемая область
+// пересчитывается отдельно.
+void Sheet::StoreCell(Position pos, std::string text, std::unique_ptr<FormulaInterface> formula, References references) {
+	const Cell* current_cell = GetCellObject(pos);
+	const bool was_empty = !current_cell || current_cell->IsEmpty();
+	const bool is_formula = formula != nullptr;
+	const bool is_empty = !is_formula && text.empty();
+	if (is_formula) {
+		GetOrCreateCellObject(pos)->Set(std::move(formula));
+	}
+	else if (!is_empty) {
+		GetOrCreateCellObject(pos)->Set(std::move(text));
+	}
+	else if (current_cell) {
+		cells_[pos].reset();
+		numeric_columns_.SetEmpty(pos);
+	}
+	// у пустой ячейки ссылок нет, и текст их не добавляет
+	if (is_formula || !was_empty) {
+		graph_.SetReferences(pos, std::move(references.cells), std::move(references.ranges));
+	}
+	if (was_empty && !is_empty) {
+		AddNonEmptyCell(pos);
+	}
+	else if (!was_empty && is_empty) {
+		RemoveNonEmptyCell(pos);
+	}
+}
+
+// Кэш сбрасывается каскадом, поэтому все ячейки, зависящие от формулы без
+// кэша, тоже без кэша. Значит, обход можно не продолжать за уже грязной
+// ячейкой: флаг грязности служит отметкой о посещении, каждая ячейка
+// сбрасывается не более одного раза за правку, а уже грязные подграфы не
+// обходятся вовсе. Обход итеративный, глубина цепочек не ограничена стеком.
+void Sheet::InvalidateDependentCells(const std::vector<Position>& positions) {
+	std::vector<Position> stack;
+	auto invalidate_dependents = [this, &stack](Position pos) {
+		graph_.ForEachDependent(pos, [this, &stack](Position dependent_pos) {
+			Cell* dependent_cell = cells_.Find(dependent_pos);
+			if (!dependent_cell->IsDirty()) {
+				dependent_cell->ClearCache();
+				stack.push_back(dependent_pos);
+			}
+		});
+	};
+	for (Position pos : positions) {
+		invalidate_dependents(pos);
+	}
+	while (!stack.empty()) {
+		const Position pos = stack.back();
+		stack.pop_back();
+		invalidate_dependents(pos);
+	}
+}
+
+void Sheet::UpdatePrintableSize() {
+	printable_size_ = {
+		non_empty_rows_.empty() ? 0 : non_empty_rows_.rbegin()->first + 1,
+		non_empty_cols_.empty() ? 0 : non_empty_cols_.rbegin()->first + 1,
+	};
+}
+
+// Новые ссылки образуют цикл, только если какая-то из ячеек, на которые они
+// указывают, уже зависит от src_pos. Поэтому обход идёт от src_pos по обратным
+// рёбрам (к зависимым ячейкам) и затрагивает только область, которую изменение
+// и так инвалидирует. Каждая ячейка посещается не более одного раза. Диапазоны
+// не разворачиваются: зависимая ячейка проверяется на попадание в них.
+void Sheet::ThrowIfCircularDependencyFound(const Position& src_pos, const References& references) const {
 	using namespace std::literals;
-	for (const auto& ref_cell_pos : referenced_cells) {
+	std::unordered_set<Position, PositionHasher> targets;
+	for (const auto& ref_cell_pos : references.cells) {
 		if (!ref_cell_pos.IsValid()) {
 			continue;
 		}
 		if (src_pos == ref_cell_pos) {
 			throw CircularDependencyException("Circular dependency found"s);
 		}
-		visited.insert(ref_cell_pos);
-		const CellInterface* ref_cell = GetCell(ref_cell_pos);
-		if (!ref_cell) {
+		targets.insert(ref_cell_pos);
+	}
+	auto is_target = [&](Position pos) {
+		return targets.count(pos) || std::any_of(references.ranges.begin(), references.ranges.end(), [pos](const Range& range) {
+			return range.Contains(pos);
+		});
+	};
+	if (is_target(src_pos)) {
+		throw CircularDependencyException("Circular dependency found"s);
+	}
+	if ((targets.empty() && references.ranges.empty()) || !graph_.HasDependents(src_pos)) {
+		return;
+	}
+
+	std::unordered_set<Position, PositionHasher> visited{ src_pos };
+	std::vector<Position> stack{ src_pos };
+	while (!stack.empty()) {
+		const Position pos = stack.back();
+		stack.pop_back();
+		graph_.ForEachDependent(pos, [&](Position dependent_pos) {
+			if (is_target(dependent_pos)) {
+				throw CircularDependencyException("Circular dependency found"s);
+			}
+			if (visited.insert(dependent_pos).second) {
+				stack.push_back(dependent_pos);
+			}
+		});
+	}
+}
+
+// Существующий граф ацикличен, поэтому любой новый цикл проходит через ячейку
+// из пакета. Алгоритм Тарьяна обходит рёбра "ячейка -> ячейки, на которые она
+// ссылается" от ячеек пакета: для них берутся новые ссылки, для остальных -
+// текущие. Все компоненты сильной связности из нескольких ячеек и ячейки,
+// ссылающиеся сами на себя, попадают в сообщение исключения. Рекурсия заменена
+// явным стеком, чтобы длинные цепочки не переполняли стек вызовов. Из ячеек
+// диапазона в обход попадают только те, у которых есть ссылки: через
+// остальные цикл пройти не может.
+void Sheet::ThrowIfCircularDependenciesFound(const std::unordered_map<Position, References, PositionHasher>& new_references) const {
+	struct NodeState {
+		int index = 0;
+		int low_link = 0;
+		bool on_stack = false;
+	};
+	struct Frame {
+		Position pos;
+		std::vector<Position> references;
+		size_t next = 0;
+	};
+
+	std::unordered_map<Position, NodeState, PositionHasher> states;
+	std::vector<Position> component_stack;
+	std::vector<Frame> call_stack;
+	std::vector<Position> cyclic_cells;
+	int next_index = 0;
+
+	auto has_references = [](const References& references) {
+		return !references.cells.empty() || !references.ranges.empty();
+	};
+	auto append_referencing_positions = [&](Range range, std::vector<Position>& positions) {
+		graph_.ForEachReferencingPosition(range, [&](Position pos) {
+			if (!new_references.count(pos)) {
+				positions.push_back(pos);
+			}
+		});
+		if (range.GetCellCount() <= new_references.size()) {
+			for (int row = range.first.row; row <= range.last.row; ++row) {
+				for (int col = range.first.col; col <= range.last.col; ++col) {
+					auto it = new_references.find({ row, col });
+					if (it != new_references.end() && has_references(it->second)) {
+						positions.push_back(it->first);
+					}
+				}
+			}
+			return;
+		}
+		for (const auto& [pos, references] : new_references) {
+			if (range.Contains(pos) && has_references(references)) {
+				positions.push_back(pos);
+			}
+		}
+	};
+	auto enter = [&](Position pos) {
+		states[pos] = { next_index, next_index, true };
+		++next_index;
+		component_stack.push_back(pos);
+		std::vector<Position> references;
+		if (auto it = new_references.find(pos); it != new_references.end()) {
+			references = it->second.cells;
+			for (const Range& range : it->second.ranges) {
+				append_referencing_positions(range, references);
+			}
+		}
+		else {
+			graph_.ForEachReference(pos, [&references](Position ref_pos) {
+				references.push_back(ref_pos);
+			});
+			graph_.ForEachReferencedRange(pos, [&](Range range) {
+				append_referencing_positions(range, references);
+			});
+		}
+		call_stack.push_back({ pos, std::move(references) });
+	};
+
+	for (const auto& [root_pos, root_references] : new_references) {
+		if (states.count(root_pos)) {
 			continue;
 		}
-		ThrowIfCircularDependencyFound(src_pos, ref_cell->GetReferencedCells(), visited);
+		enter(root_pos);
+		while (!call_stack.empty()) {
+			Frame& frame = call_stack.back();
+			if (frame.next < frame.references.size()) {
+				const Position ref_pos = frame.references[frame.next++];
+				if (!ref_pos.IsValid()) {
+					continue;
+				}
+				if (ref_pos == frame.pos) {
+					cyclic_cells.push_back(ref_pos);
+					continue;
+				}
+				auto it = states.find(ref_pos);
+				if (it == states.end()) {
+					enter(ref_pos);
+				}
+				else if (it->second.on_stack) {
+					NodeState& state = states[frame.pos];
+					state.low_link = std::min(state.low_link, it->second.index);
+				}
+				continue;
+			}
+
+			const Position pos = frame.pos;
+			const NodeState state = states[pos];
+			call_stack.pop_back();
+			if (!call_stack.empty()) {
+				NodeState& parent_state = states[call_stack.back().pos];
+				parent_state.low_link = std::min(parent_state.low_link, state.low_link);
+			}
+			if (state.low_link != state.index) {
+				continue;
+			}
+			auto component_begin = std::find(component_stack.rbegin(), component_stack.rend(), pos).base() - 1;
+			for (auto it = component_begin; it != component_stack.end(); ++it) {
+				states[*it].on_stack = false;
+			}
+			if (component_stack.end() - component_begin > 1) {
+				cyclic_cells.insert(cyclic_cells.end(), component_begin, component_stack.end());
+			}
+			component_stack.erase(component_begin, component_stack.end());
+		}
 	}
+
+	if (cyclic_cells.empty()) {
+		return;
+	}
+	std::sort(cyclic_cells.begin(), cyclic_cells.end());
+	cyclic_cells.erase(std::unique(cyclic_cells.begin(), cyclic_cells.end()), cyclic_cells.end());
+	std::string message = "Circular dependency found:"s;
+	for (const auto& pos : cyclic_cells) {
+		message += ' ';
+		message += pos.ToString();
+	}
+	throw CircularDependencyException(message);
 }
 
-CellInterface* Sheet::GetCellImpl(Position pos) const {
-	ThrowIfInvalidPosition(pos);
-	if (pos.row > sheet_size_.rows - 1 || pos.col > sheet_size_.cols - 1) {
-		return nullptr;
+ThreadPool& Sheet::GetThreadPool() {
+	if (!thread_pool_) {
+		thread_pool_ = std::make_unique<ThreadPool>(thread_count_);
 	}
-	auto& cell = cells_.at(pos.row).at(pos.col);
-	return !cell || cell->GetText().empty() ? nullptr : cell.get();
+	return *thread_pool_;
 }
 
-void Sheet::CellInterfaceValuePrinter::operator()(const std::string& value) {
-	out << value;
+CellInterface* Sheet::GetCellImpl(Position pos) const {
+	ThrowIfInvalidPosition(pos);
+	Cell* cell = cells_.Find(pos);
+	return !cell || cell->IsEmpty() ? nullptr : cell;
 }
 
-void Sheet::CellInterfaceValuePrinter::operator()(double value) {
-	out << value;
+Cell* Sheet::GetCellObject(Position pos) const {
+	return cells_.Find(pos);
 }
 
-void Sheet::CellInterfaceValuePrinter::operator()(FormulaError value) {
-	out << value.ToString();
+Cell* Sheet::GetOrCreateCellObject(Position pos) {
+	auto& cell = cells_[pos];
+	if (!cell) {
+		cell = std::make_unique<Cell>(*this, pos);
+	}
+	return cell.get();
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
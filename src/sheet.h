@@ -2,16 +2,30 @@
 
 #include "common.h"
 #include "cell.h"
+#include "cell_storage.h"
+#include "dependency_graph.h"
+#include "numeric_columns.h"
+#include "output_buffer.h"
+#include "snapshot_io.h"
+#include "thread_pool.h"
 
 #include <functional>
+#include <map>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 class Sheet : public SheetInterface {
 public:
+	// thread_count - число потоков для пакетной загрузки и пересчёта
+	explicit Sheet(size_t thread_count = ThreadPool::GetDefaultThreadCount());
 	~Sheet();
 
 	void SetCell(Position pos, std::string text) override;
+	void SetCells(const std::vector<std::pair<Position, std::string_view>>& cells) override;
 
 	const CellInterface* GetCell(Position pos) const override;
 	CellInterface* GetCell(Position pos) override;
@@ -20,30 +34,85 @@ public:
 
 	Size GetPrintableSize() const override;
 
+	// Не зависят от настроек потока: числа выводятся как при настройках по
+	// умолчанию
 	void PrintValues(std::ostream& output) const override;
 	void PrintTexts(std::ostream& output) const override;
+	// То же с записью прямо в файловый дескриптор, минуя std::ostream
+	void WriteValues(int fd) const;
+	void WriteTexts(int fd) const;
+
+	void Recalculate() override;
+
+	// Двоичный снимок таблицы: тексты ячеек, программы формул, граф
+	// зависимостей и вычисленные значения. Загрузка не проверяет циклы и не
+	// пересчитывает формулы, а каждую различную программу разбирает один раз.
+	// Бросает SnapshotException, если снимок повреждён или записан в другой
+	// версии формата.
+	void SaveSnapshot(std::ostream& output) const;
+	static std::unique_ptr<Sheet> LoadSnapshot(std::istream& input,
+		size_t thread_count = ThreadPool::GetDefaultThreadCount());
+	// Файл отображается в память и читается на месте, а если это невозможно,
+	// читается потоком. Бросает std::system_error, если файл не открывается.
+	static std::unique_ptr<Sheet> LoadSnapshotFile(const std::string& path,
+		size_t thread_count = ThreadPool::GetDefaultThreadCount());
+
+	const NumericColumns* GetNumericColumns() const override;
+
+	const CacheStats& GetCacheStats() const;
+	// Число различных разобранных формул листа
+	size_t GetFormulaProgramCount() const;
 
 private:
-	Size sheet_size_;
-	Size printable_size_;
-	std::vector<std::vector<std::unique_ptr<Cell>>> cells_;
+	friend class Cell;
 
-	struct PositionHasher {
-		size_t operator()(const Position& pos) const {
-			return static_cast<size_t>(pos.row) + 37 * static_cast<size_t>(pos.col);
-		}
+	// Ссылки формулы: отдельные ячейки и диапазоны
+	struct References {
+		std::vector<Position> cells;
+		std::vector<Range> ranges;
 	};
 
-	void Resize(Position pos);
+	Size printable_size_;
+	CellStorage cells_;
+	// Значения ячеек по столбцам; их поддерживают сами ячейки
+	NumericColumns numeric_columns_;
+	// Разобранные формулы, общие для ячеек с одинаковыми относительными формулами
+	FormulaInterner formulas_;
+	// Число непустых ячеек в каждой строке и каждом столбце, в которых они есть.
+	// Границы печатаемой области - наибольшие ключи.
+	std::map<int, int> non_empty_rows_;
+	std::map<int, int> non_empty_cols_;
+	DependencyGraph graph_;
+	mutable CacheStats cache_stats_;
+	// Создаётся при первой пакетной загрузке или пересчёте
+	size_t thread_count_;
+	std::unique_ptr<ThreadPool> thread_pool_;
+
+	// Число формул, которые поток разбирает за один заход
+	static constexpr size_t PARSE_GRAIN_SIZE = 256;
+	// Число формул одного уровня, которые поток вычисляет за один заход
+	static constexpr size_t RECALCULATE_GRAIN_SIZE = 512;
+
 	void ThrowIfInvalidPosition(Position pos) const;
+	void AddNonEmptyCell(Position pos);
+	void RemoveNonEmptyCell(Position pos);
 	void UpdatePrintableSize();
-	void ThrowIfCircularDependencyFound(const Position& src_pos, const std::vector<Position>& referenced_calls, std::unordered_set<Position, PositionHasher>& visited) const;
+	void StoreCell(Position pos, std::string text, std::unique_ptr<FormulaInterface> formula, References references);
+	void InvalidateDependentCells(const std::vector<Position>& positions);
+	void ThrowIfCircularDependencyFound(const Position& src_pos, const References& references) const;
+	void ThrowIfCircularDependenciesFound(const std::unordered_map<Position, References, PositionHasher>& new_references) const;
+	ThreadPool& GetThreadPool();
 	CellInterface* GetCellImpl(Position pos) const;
+	Cell* GetCellObject(Position pos) const;
+	Cell* GetOrCreateCellObject(Position pos);
 
-	struct CellInterfaceValuePrinter {
-		std::ostream& out;
-		void operator()(const std::string& value);
-		void operator()(double value);
-		void operator()(FormulaError value);
-	};
+	// Заполняет пустую таблицу из снимка
+	void RestoreSnapshot(std::string_view data);
+
+	void PrintValues(OutputBuffer& output) const;
+	void PrintTexts(OutputBuffer& output) const;
+	// Выводит печатаемую область по строкам, вызывая print_cell(OutputBuffer&,
+	// const Cell&) для каждой ячейки
+	template <typename CellPrinter>
+	void PrintCells(OutputBuffer& output, CellPrinter print_cell) const;
 };
\ No newline at end of file
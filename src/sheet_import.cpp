@@ -0,0 +1,260 @@
+#include "sheet_import.h"
+
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace {
+	// Примерный объём текста одного пакета SetCells
+	constexpr size_t BATCH_BYTES = 1 << 20;
+
+	// Разбирает текст на записи и копит поля до вызова Flush. Запись, которая
+	// не закончилась в переданном тексте, не разбирается: её начало остаётся
+	// вызывающему, чтобы он дополнил его следующим куском входа.
+	class TextImporter {
+	public:
+		TextImporter(SheetInterface& sheet, TextFormat format)
+			: sheet_(sheet)
+			, format_(format) {
+		}
+
+		// Возвращает длину разобранной части text. Если at_end, text - конец
+		// входа и последняя запись может не заканчиваться переводом строки.
+		size_t Parse(std::string_view text, bool at_end) {
+			return format_ == TextFormat::Tsv ? ParseTsv(text, at_end) : ParseCsv(text, at_end);
+		}
+
+		// Передаёт накопленные поля таблице. Поля ссылаются на разобранный
+		// текст, поэтому он должен быть цел до вызова.
+		void Flush() {
+			if (!cells_.empty()) {
+				sheet_.SetCells(cells_);
+			}
+			cells_.clear();
+			unescaped_.clear();
+		}
+
+	private:
+		SheetInterface& sheet_;
+		TextFormat format_;
+		int row_ = 0;
+		std::vector<std::pair<Position, std::string_view>> cells_;
+		// поля CSV, которые пришлось переписать: с удвоенными кавычками или
+		// текстом после закрывающей кавычки
+		std::deque<std::string> unescaped_;
+
+		void AddField(int col, std::string_view field) {
+			if (!field.empty()) {
+				cells_.push_back({ { row_, col }, field });
+			}
+		}
+
+		static std::string_view StripCarriageReturn(std::string_view line) {
+			if (!line.empty() && line.back() == '\r') {
+				line.remove_suffix(1);
+			}
+			return line;
+		}
+
+		static bool IsLineEnd(std::string_view text, size_t pos) {
+			return pos == text.size() || text[pos] == '\n';
+		}
+
+		size_t ParseTsv(std::string_view text, bool at_end) {
+			size_t pos = 0;
+			while (pos < text.size()) {
+				const auto* newline = static_cast<const char*>(std::memchr(text.data() + pos, '\n', text.size() - pos));
+				if (!newline && !at_end) {
+					break;
+				}
+				const size_t line_end = newline ? newline - text.data() : text.size();
+				const std::string_view line = StripCarriageReturn(text.substr(pos, line_end - pos));
+				int col = 0;
+				for (size_t field_begin = 0;; ++col) {
+					const size_t tab = line.find('\t', field_begin);
+					AddField(col, line.substr(field_begin, tab - field_begin));
+					if (tab == std::string_view::npos) {
+						break;
+					}
+					field_begin = tab + 1;
+				}
+				++row_;
+				pos = newline ? line_end + 1 : line_end;
+			}
+			return pos;
+		}
+
+		size_t ParseCsv(std::string_view text, bool at_end) {
+			size_t pos = 0;
+			while (pos < text.size()) {
+				const size_t cell_count = cells_.size();
+				const size_t unescaped_count = unescaped_.size();
+				const size_t record_end = ParseCsvRecord(text, pos, at_end);
+				if (record_end == std::string_view::npos) {
+					// запись не закончилась: её поля будут разобраны заново
+					cells_.resize(cell_count);
+					unescaped_.resize(unescaped_count);
+					break;
+				}
+				++row_;
+				pos = record_end;
+			}
+			return pos;
+		}
+
+		// Возвращает позицию за концом записи, начинающейся с pos, или npos,
+		// если запись не закончилась в text
+		size_t ParseCsvRecord(std::string_view text, size_t pos, bool at_end) {
+			constexpr auto npos = std::string_view::npos;
+			for (int col = 0;; ++col) {
+				if (pos < text.size() && text[pos] == '"') {
+					pos = ParseQuotedField(text, pos, at_end, col);
+					if (pos == npos) {
+						return npos;
+					}
+				}
+				else {
+					const size_t field_end = text.find_first_of(",\n", pos);
+					if (field_end == npos && !at_end) {
+						return npos;
+					}
+					const size_t end = field_end == npos ? text.size() : field_end;
+					const std::string_view field = text.substr(pos, end - pos);
+					AddField(col, IsLineEnd(text, end) ? StripCarriageReturn(field) : field);
+					pos = end;
+				}
+				if (pos == text.size()) {
+					return pos;
+				}
+				if (text[pos++] == '\n') {
+					return pos;
+				}
+			}
+		}
+
+		// pos указывает на открывающую кавычку. Возвращает позицию за полем
+		// (на разделителе, переводе строки или конце текста) или npos. Поле,
+		// кавычка которого не закрыта до конца входа, занимает весь остаток.
+		size_t ParseQuotedField(std::string_view text, size_t pos, bool at_end, int col) {
+			constexpr auto npos = std::string_view::npos;
+			const size_t content_begin = pos + 1;
+			size_t quote = text.find('"', content_begin);
+			bool escaped = false;
+			// пока кавычка не последний символ текста, видно, удвоена ли она
+			while (quote != npos && quote + 1 < text.size() && text[quote + 1] == '"') {
+				escaped = true;
+				quote = text.find('"', quote + 2);
+			}
+			if (quote == npos && at_end) {
+				AddQuotedField(col, text.substr(content_begin), {}, escaped);
+				return text.size();
+			}
+			if (quote == npos || (quote + 1 == text.size() && !at_end)) {
+				return npos;
+			}
+			const std::string_view content = text.substr(content_begin, quote - content_begin);
+			size_t end = text.find_first_of(",\n", quote + 1);
+			if (end == npos) {
+				if (!at_end) {
+					return npos;
+				}
+				end = text.size();
+			}
+			std::string_view tail = text.substr(quote + 1, end - quote - 1);
+			if (IsLineEnd(text, end)) {
+				tail = StripCarriageReturn(tail);
+			}
+			AddQuotedField(col, content, tail, escaped);
+			return end;
+		}
+
+		// content - текст между кавычками, tail - текст после закрывающей
+		// кавычки, который добавляется к полю как есть
+		void AddQuotedField(int col, std::string_view content, std::string_view tail, bool escaped) {
+			if (!escaped && tail.empty()) {
+				AddField(col, content);
+				return;
+			}
+			std::string& field = unescaped_.emplace_back();
+			field.reserve(content.size() + tail.size());
+			for (size_t i = 0; i < content.size(); ++i) {
+				field += content[i];
+				if (content[i] == '"') {
+					++i;
+				}
+			}
+			field += tail;
+			AddField(col, field);
+		}
+	};
+
+	void ImportTextsFromStream(SheetInterface& sheet, const std::string& path, TextFormat format) {
+		std::ifstream input(path, std::ios::binary);
+		if (!input) {
+			throw std::system_error(errno, std::generic_category(), path);
+		}
+		ImportTexts(sheet, input, format);
+	}
+}  // namespace
+
+// Буфер дочитывается после разобранных записей. Если запись не поместилась
+// в буфер целиком, он растёт вдвое.
+void ImportTexts(SheetInterface& sheet, std::istream& input, TextFormat format) {
+	TextImporter importer(sheet, format);
+	std::vector<char> buffer(BATCH_BYTES);
+	size_t size = 0;
+	bool at_end = false;
+	while (!at_end) {
+		if (size == buffer.size()) {
+			buffer.resize(buffer.size() * 2);
+		}
+		input.read(buffer.data() + size, static_cast<std::streamsize>(buffer.size() - size));
+		size += static_cast<size_t>(input.gcount());
+		if (input.bad()) {
+			throw std::ios_base::failure("Error when reading the input");
+		}
+		at_end = !input;
+		const size_t parsed = importer.Parse({ buffer.data(), size }, at_end);
+		if (parsed == 0) {
+			continue;
+		}
+		importer.Flush();
+		std::copy(buffer.begin() + parsed, buffer.begin() + size, buffer.begin());
+		size -= parsed;
+	}
+}
+
+// Отображение разбирается окнами по BATCH_BYTES: окно расширяется, пока в
+// нём не закончится хотя бы одна запись.
+void ImportTextsFile(SheetInterface& sheet, const std::string& path, TextFormat format) {
+	const auto file = MappedFile::Open(path);
+	if (!file) {
+		ImportTextsFromStream(sheet, path, format);
+		return;
+	}
+	file->AdviseSequential();
+
+	const std::string_view text = file->GetData();
+	TextImporter importer(sheet, format);
+	size_t pos = 0;
+	size_t window = BATCH_BYTES;
+	while (pos < text.size()) {
+		const size_t window_end = std::min(text.size(), pos + window);
+		const size_t parsed = importer.Parse(text.substr(pos, window_end - pos), window_end == text.size());
+		if (parsed == 0) {
+			window *= 2;
+			continue;
+		}
+		importer.Flush();
+		pos += parsed;
+		window = BATCH_BYTES;
+	}
+}
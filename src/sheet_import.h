@@ -0,0 +1,30 @@
+#pragma once
+
+#include "common.h"
+
+#include <istream>
+#include <string>
+
+// Формат текста с разделителями. Строка текста - строка таблицы, начиная с
+// первой, поля строки - ячейки по порядку столбцов. Перевод строки может
+// быть как "\n", так и "\r\n".
+enum class TextFormat {
+	// Поля разделены табуляцией и не экранируются, как в выводе PrintTexts.
+	// Текст ячейки не может содержать табуляцию и перевод строки.
+	Tsv,
+	// Поля разделены запятыми (RFC 4180). Поле в двойных кавычках может
+	// содержать запятые, переводы строк и удвоенные кавычки. Поле, кавычка
+	// которого не закрыта, продолжается до конца текста.
+	Csv,
+};
+
+// Загружают текст в таблицу, начиная с ячейки A1. Пустые поля пропускаются:
+// ячейки на их месте не меняются. Поля не копируются, а передаются в
+// SetCells ссылками на буфер чтения пакетами примерно по мегабайту текста,
+// поэтому ошибки SetCells (некорректная формула, позиция или цикл)
+// оставляют в таблице пакеты, загруженные до ошибочного.
+void ImportTexts(SheetInterface& sheet, std::istream& input, TextFormat format = TextFormat::Tsv);
+// Файл отображается в память, а если это невозможно (не обычный файл или
+// Windows), читается потоком. Бросает std::system_error, если файл не
+// открывается.
+void ImportTextsFile(SheetInterface& sheet, const std::string& path, TextFormat format = TextFormat::Tsv);
@@ -0,0 +1,344 @@
+#include "sheet.h"
+
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <system_error>
+#include <unordered_map>
+
+using namespace std::literals;
+
+// Данные снимка таблицы, после заголовка SnapshotWriter:
+// 1. Строки: их число, смещения концов (uint64) и сами строки подряд.
+//    Одинаковые тексты ячеек хранятся один раз.
+// 2. Число программ формул. Программа - разобранная формула, общая для ячеек
+//    с одинаковыми относительными выражениями (см. FormulaInterner); она
+//    разбирается из текста первой ячейки, которая на неё ссылается.
+// 3. Число ячеек и число формул, затем записи CellRecord в порядке
+//    возрастания позиций и записи FormulaValueRecord формул в том же порядке.
+// 4. Граф зависимостей, см. DependencyGraph::Save.
+namespace {
+	constexpr std::uint32_t NO_PROGRAM = UINT32_MAX;
+
+	struct CellRecord {
+		Position pos;
+		// номер строки с текстом ячейки
+		std::uint32_t text = 0;
+		std::uint32_t program = NO_PROGRAM;
+	};
+
+	// Вычисленное значение формулы: число, ошибка или Pending, если значение
+	// не вычислено
+	struct FormulaValueRecord {
+		double number = 0.0;
+		std::uint8_t kind = 0;
+		// явное заполнение, чтобы в файл не попадал мусор
+		std::uint8_t padding[7] = {};
+	};
+
+	std::optional<FormulaInterface::Value> GetFormulaValue(const FormulaValueRecord& record) {
+		using Kind = NumericColumns::Kind;
+		const auto kind = static_cast<Kind>(record.kind);
+		switch (kind) {
+		case Kind::Pending:
+			return std::nullopt;
+		case Kind::Number:
+			return record.number;
+		case Kind::RefError:
+		case Kind::ValueError:
+		case Kind::Div0Error:
+			return NumericColumns::ToError(kind);
+		default:
+			throw SnapshotException("Snapshot has an invalid formula value"s);
+		}
+	}
+
+	// Алгоритм Кана: формулы, которые не ссылаются на оставшиеся формулы,
+	// снимаются вместе с рёбрами к зависимым, пока такие есть. Всё, что
+	// осталось, лежит на циклах. Ссылки бывают только у формул, так что
+	// другие ячейки в циклы не входят. formula_positions упорядочены по
+	// возрастанию и содержат всех зависимых.
+	bool HasCircularDependencies(const DependencyGraph& graph, const std::vector<Position>& formula_positions) {
+		auto get_index = [&formula_positions](Position pos) {
+			const auto it = std::lower_bound(formula_positions.begin(), formula_positions.end(), pos,
+				[](Position lhs, Position rhs) {
+					return lhs.row < rhs.row || (lhs.row == rhs.row && lhs.col < rhs.col);
+				});
+			return static_cast<std::uint32_t>(it - formula_positions.begin());
+		};
+		// зависимые формулы i-й формулы - dependents[dependents_begin[i]..dependents_begin[i + 1])
+		std::vector<size_t> dependents_begin(formula_positions.size() + 1);
+		std::vector<std::uint32_t> dependents;
+		std::vector<std::uint32_t> reference_counts(formula_positions.size());
+		for (size_t i = 0; i < formula_positions.size(); ++i) {
+			dependents_begin[i] = dependents.size();
+			graph.ForEachDependent(formula_positions[i], [&](Position dependent_pos) {
+				const std::uint32_t index = get_index(dependent_pos);
+				dependents.push_back(index);
+				++reference_counts[index];
+			});
+		}
+		dependents_begin.back() = dependents.size();
+
+		std::vector<std::uint32_t> ready;
+		for (size_t i = 0; i < formula_positions.size(); ++i) {
+			if (reference_counts[i] == 0) {
+				ready.push_back(static_cast<std::uint32_t>(i));
+			}
+		}
+		size_t removed_count = 0;
+		while (!ready.empty()) {
+			const std::uint32_t i = ready.back();
+			ready.pop_back();
+			++removed_count;
+			for (size_t j = dependents_begin[i]; j < dependents_begin[i + 1]; ++j) {
+				if (--reference_counts[dependents[j]] == 0) {
+					ready.push_back(dependents[j]);
+				}
+			}
+		}
+		return removed_count != formula_positions.size();
+	}
+}  // namespace
+
+// Ячейки обходятся по строкам, как при печати, и сразу идут по возрастанию
+// позиций
+void Sheet::SaveSnapshot(std::ostream& output) const {
+	size_t cell_count = 0;
+	for (const auto& [row, count] : non_empty_rows_) {
+		cell_count += static_cast<size_t>(count);
+	}
+	std::unordered_map<std::string_view, std::uint32_t> string_ids;
+	string_ids.reserve(cell_count);
+	std::vector<std::uint64_t> string_ends;
+	string_ends.reserve(cell_count);
+	std::string strings;
+	std::unordered_map<const FormulaAST*, std::uint32_t> program_ids;
+	std::vector<CellRecord> cells;
+	cells.reserve(cell_count);
+	std::vector<FormulaValueRecord> values;
+	for (const auto& [row, row_cell_count] : non_empty_rows_) {
+		for (int tile_col = 0; tile_col < printable_size_.cols; tile_col += CellStorage::TILE_SIZE) {
+			const std::unique_ptr<Cell>* slots = cells_.FindTileRow({ row, tile_col });
+			if (!slots) {
+				continue;
+			}
+			for (int i = 0; i < CellStorage::TILE_SIZE; ++i) {
+				const Cell* cell = slots[i].get();
+				if (!cell || cell->IsEmpty()) {
+					continue;
+				}
+				CellRecord record;
+				record.pos = { row, tile_col + i };
+				const std::string_view text = cell->GetTextView();
+				const auto [string_it, inserted] = string_ids.emplace(text, static_cast<std::uint32_t>(string_ends.size()));
+				if (inserted) {
+					strings += text;
+					string_ends.push_back(strings.size());
+				}
+				record.text = string_it->second;
+				if (const FormulaInterface* formula = cell->GetFormula()) {
+					const auto program_id = static_cast<std::uint32_t>(program_ids.size());
+					record.program = program_ids.emplace(FormulaInterner::GetProgram(*formula), program_id).first->second;
+					const NumericColumns::Entry entry = numeric_columns_.Get(record.pos);
+					FormulaValueRecord value;
+					value.number = entry.number;
+					value.kind = static_cast<std::uint8_t>(entry.kind);
+					values.push_back(value);
+				}
+				cells.push_back(record);
+			}
+		}
+	}
+
+	OutputBuffer buffer(output);
+	SnapshotWriter writer(buffer);
+	writer.Write(static_cast<std::uint32_t>(string_ends.size()));
+	writer.WriteArray(string_ends.data(), string_ends.size());
+	writer.WriteBytes(strings.data(), strings.size());
+	writer.Write(static_cast<std::uint32_t>(program_ids.size()));
+	writer.Write(static_cast<std::uint32_t>(cells.size()));
+	writer.Write(static_cast<std::uint32_t>(values.size()));
+	writer.WriteArray(cells.data(), cells.size());
+	writer.WriteArray(values.data(), values.size());
+	graph_.Save(writer);
+	writer.Finish();
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(std::istream& input, size_t thread_count) {
+	constexpr size_t READ_SIZE = 1 << 20;
+	std::string data;
+	while (input) {
+		const size_t size = data.size();
+		data.resize(size + READ_SIZE);
+		input.read(data.data() + size, static_cast<std::streamsize>(READ_SIZE));
+		data.resize(size + static_cast<size_t>(input.gcount()));
+	}
+	if (input.bad()) {
+		throw std::ios_base::failure("Error when reading the input"s);
+	}
+	auto sheet = std::make_unique<Sheet>(thread_count);
+	sheet->RestoreSnapshot(data);
+	return sheet;
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshotFile(const std::string& path, size_t thread_count) {
+	const auto file = MappedFile::Open(path);
+	if (!file) {
+		std::ifstream input(path, std::ios::binary);
+		if (!input) {
+			throw std::system_error(errno, std::generic_category(), path);
+		}
+		return LoadSnapshot(input, thread_count);
+	}
+	auto sheet = std::make_unique<Sheet>(thread_count);
+	sheet->RestoreSnapshot(file->GetData());
+	return sheet;
+}
+
+// Ячейки записываются напрямую, минуя SetCells: снимок сделан с корректной
+// таблицы, так что проверка на циклы не нужна, граф читается целиком, а
+// значения формул берутся готовыми. Записи ячеек и строки читаются прямо
+// из данных снимка. Данные проверяются настолько, чтобы повреждённый
+// снимок, прошедший контрольную сумму, не мог нарушить работу с памятью:
+// текст формулы должен совпадать с её выражением, граф - со ссылками
+// формул и не иметь циклов, а вычисленные формулы не должны зависеть от
+// невычисленных, как после сброса кэша каскадом. На этом держатся
+// вычисление и пересчёт.
+void Sheet::RestoreSnapshot(std::string_view data) {
+	SnapshotReader reader(data);
+	const auto string_count = reader.Read<std::uint32_t>();
+	const auto string_ends = reader.ReadArray<std::uint64_t>(string_count);
+	const std::uint64_t strings_size = string_count > 0 ? string_ends[string_count - 1] : 0;
+	if (strings_size > data.size()) {
+		throw SnapshotException("Snapshot is truncated"s);
+	}
+	const char* strings = reader.ReadBytes(static_cast<size_t>(strings_size));
+	auto get_string = [&](std::uint32_t index) -> std::string_view {
+		if (index >= string_count) {
+			throw SnapshotException("Snapshot has an invalid string index"s);
+		}
+		const std::uint64_t begin = index > 0 ? string_ends[index - 1] : 0;
+		const std::uint64_t end = string_ends[index];
+		if (begin > end || end > strings_size) {
+			throw SnapshotException("Snapshot has an invalid string offset"s);
+		}
+		return { strings + begin, static_cast<size_t>(end - begin) };
+	};
+
+	const auto program_count = reader.Read<std::uint32_t>();
+	const auto cell_count = reader.Read<std::uint32_t>();
+	const auto formula_count = reader.Read<std::uint32_t>();
+	const auto records = reader.ReadArray<CellRecord>(cell_count);
+	const auto values = reader.ReadArray<FormulaValueRecord>(formula_count);
+	if (program_count > formula_count || formula_count > cell_count) {
+		throw SnapshotException("Snapshot has an invalid number of formulas"s);
+	}
+	// формула, из которой берётся каждая программа
+	std::vector<const FormulaInterface*> programs(program_count, nullptr);
+	std::vector<Position> formula_positions;
+	formula_positions.reserve(formula_count);
+	std::vector<Position> pending_positions;
+	std::vector<int> col_counts(Position::MAX_COLS);
+	Position previous_pos = Position::NONE;
+	for (size_t i = 0; i < records.size(); ++i) {
+		const CellRecord record = records[i];
+		const Position pos = record.pos;
+		if (!pos.IsValid() || !(previous_pos < pos)) {
+			throw SnapshotException("Snapshot has an invalid cell position"s);
+		}
+		previous_pos = pos;
+		const std::string_view text = get_string(record.text);
+		const bool is_formula = text.size() > 1u && text[0] == FORMULA_SIGN;
+		if (text.empty() || is_formula != (record.program != NO_PROGRAM)
+			|| (is_formula && (record.program >= program_count || formula_positions.size() == formula_count))) {
+			throw SnapshotException("Snapshot has an invalid cell at "s + pos.ToString());
+		}
+
+		Cell* cell = GetOrCreateCellObject(pos);
+		if (!is_formula) {
+			cell->Set(std::string(text));
+		}
+		else {
+			const FormulaInterface*& program = programs[record.program];
+			std::unique_ptr<FormulaInterface> formula;
+			if (program) {
+				formula = FormulaInterner::Share(*program, pos);
+			}
+			else {
+				try {
+					formula = formulas_.Parse(text.substr(1), pos);
+				}
+				catch (const FormulaException& e) {
+					throw SnapshotException("Snapshot has an invalid formula at "s + pos.ToString() + ": "s + e.what());
+				}
+				program = formula.get();
+			}
+			// у ячеек с общей программой тексты сверяются с ней
+			if (formula->GetExpression() != text.substr(1)) {
+				throw SnapshotException("Snapshot has an invalid formula at "s + pos.ToString());
+			}
+			auto value = GetFormulaValue(values[formula_positions.size()]);
+			if (!value) {
+				pending_positions.push_back(pos);
+			}
+			cell->Restore(std::move(formula), std::string(text), std::move(value));
+			formula_positions.push_back(pos);
+		}
+
+		// ячейки идут по строкам, так что строки добавляются в конец
+		if (non_empty_rows_.empty() || non_empty_rows_.rbegin()->first != pos.row) {
+			non_empty_rows_.emplace_hint(non_empty_rows_.end(), pos.row, 1);
+		}
+		else {
+			++non_empty_rows_.rbegin()->second;
+		}
+		++col_counts[pos.col];
+	}
+	if (formula_positions.size() != formula_count) {
+		throw SnapshotException("Snapshot has an invalid number of formulas"s);
+	}
+	for (int col = 0; col < Position::MAX_COLS; ++col) {
+		if (col_counts[col] > 0) {
+			non_empty_cols_.emplace_hint(non_empty_cols_.end(), col, col_counts[col]);
+		}
+	}
+
+	graph_.Load(reader);
+	reader.Finish();
+	// Пересчёт и сброс кэша идут по рёбрам графа и ожидают формулу в каждой
+	// ячейке, у которой есть ссылки. Узлы графа после загрузки перебираются
+	// по возрастанию позиций, так что проверка - слияние двух списков. Затем
+	// ссылки каждой формулы сверяются с её рёбрами.
+	auto formula_it = formula_positions.begin();
+	graph_.ForEachReferencingPosition({ { 0, 0 }, { Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } }, [&](Position pos) {
+		while (formula_it != formula_positions.end() && *formula_it < pos) {
+			++formula_it;
+		}
+		if (formula_it == formula_positions.end() || !(*formula_it == pos)) {
+			throw SnapshotException("Snapshot has a dependency graph that doesn't match the cells"s);
+		}
+	});
+	for (Position pos : formula_positions) {
+		const Cell* cell = cells_.Find(pos);
+		if (!graph_.HasSameReferences(pos, cell->GetReferencedCells(), cell->GetReferencedRanges())) {
+			throw SnapshotException("Snapshot has a dependency graph that doesn't match the cells"s);
+		}
+	}
+	// зависимые ячейки - формулы, это проверено выше
+	for (Position pos : pending_positions) {
+		graph_.ForEachDependent(pos, [this](Position dependent_pos) {
+			if (!cells_.Find(dependent_pos)->IsDirty()) {
+				throw SnapshotException("Snapshot has a computed formula that depends on a pending one"s);
+			}
+		});
+	}
+	if (HasCircularDependencies(graph_, formula_positions)) {
+		throw SnapshotException("Snapshot has circular dependencies"s);
+	}
+	UpdatePrintableSize();
+}
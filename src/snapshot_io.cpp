@@ -0,0 +1,117 @@
+#include "snapshot_io.h"
+
+#include <algorithm>
+#include <string>
+
+using namespace std::literals;
+
+namespace {
+	constexpr char MAGIC[8] = { 'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P' };
+	constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+	constexpr std::size_t HEADER_SIZE = sizeof(MAGIC) + 2 * sizeof(std::uint32_t);
+
+	std::uint32_t LoadUint32(const char* data) {
+		std::uint32_t value;
+		std::memcpy(&value, data, sizeof(value));
+		return value;
+	}
+}  // namespace
+
+// Слова читаются целиком, а неполное слово на конце куска ждёт
+// продолжения в tail_
+void SnapshotChecksum::Update(const char* data, std::size_t size) {
+	total_size_ += size;
+	while (tail_size_ != 0 && size > 0) {
+		tail_[tail_size_++] = *data++;
+		--size;
+		if (tail_size_ == sizeof(tail_)) {
+			std::uint64_t word;
+			std::memcpy(&word, tail_, sizeof(word));
+			hash_ = Mix(hash_, word);
+			tail_size_ = 0;
+		}
+	}
+	for (; size >= sizeof(std::uint64_t); data += sizeof(std::uint64_t), size -= sizeof(std::uint64_t)) {
+		std::uint64_t word;
+		std::memcpy(&word, data, sizeof(word));
+		hash_ = Mix(hash_, word);
+	}
+	if (size > 0) {
+		std::memcpy(tail_ + tail_size_, data, size);
+		tail_size_ += size;
+	}
+}
+
+std::uint64_t SnapshotChecksum::Get() const {
+	std::uint64_t word = 0;
+	std::memcpy(&word, tail_, tail_size_);
+	return Mix(Mix(hash_, word), total_size_);
+}
+
+std::uint64_t SnapshotChecksum::Mix(std::uint64_t hash, std::uint64_t word) {
+	hash = (hash ^ word) * 0x100000001B3ull;
+	return hash ^ (hash >> 32);
+}
+
+SnapshotWriter::SnapshotWriter(OutputBuffer& output)
+	: output_(output) {
+	WriteBytes(MAGIC, sizeof(MAGIC));
+	Write(VERSION);
+	Write(BYTE_ORDER_MARK);
+}
+
+void SnapshotWriter::WriteBytes(const void* data, std::size_t size) {
+	checksum_.Update(static_cast<const char*>(data), size);
+	output_.Append(std::string_view(static_cast<const char*>(data), size));
+}
+
+void SnapshotWriter::Finish() {
+	const std::uint64_t checksum = checksum_.Get();
+	output_.Append(std::string_view(reinterpret_cast<const char*>(&checksum), sizeof(checksum)));
+	output_.Flush();
+}
+
+// Версия проверяется до контрольной суммы, чтобы снимок другой версии
+// отвергался с понятным сообщением
+SnapshotReader::SnapshotReader(std::string_view data)
+	: data_(data) {
+	if (data.size() < HEADER_SIZE + sizeof(std::uint64_t) || !std::equal(MAGIC, MAGIC + sizeof(MAGIC), data.data())) {
+		throw SnapshotException("Not a sheet snapshot"s);
+	}
+	const std::uint32_t version = LoadUint32(data.data() + sizeof(MAGIC));
+	if (version != SnapshotWriter::VERSION) {
+		throw SnapshotException("Unsupported snapshot version "s + std::to_string(version));
+	}
+	if (LoadUint32(data.data() + sizeof(MAGIC) + sizeof(version)) != BYTE_ORDER_MARK) {
+		throw SnapshotException("Snapshot has a different byte order"s);
+	}
+
+	data_.remove_suffix(sizeof(std::uint64_t));
+	SnapshotChecksum checksum;
+	checksum.Update(data_.data(), data_.size());
+	std::uint64_t expected_checksum;
+	std::memcpy(&expected_checksum, data.data() + data_.size(), sizeof(expected_checksum));
+	if (checksum.Get() != expected_checksum) {
+		throw SnapshotException("Snapshot is damaged: checksum mismatch"s);
+	}
+	pos_ = HEADER_SIZE;
+}
+
+const char* SnapshotReader::ReadBytes(std::size_t size) {
+	if (size > GetRemaining()) {
+		ThrowTruncated();
+	}
+	const char* result = data_.data() + pos_;
+	pos_ += size;
+	return result;
+}
+
+void SnapshotReader::Finish() const {
+	if (pos_ != data_.size()) {
+		throw SnapshotException("Snapshot has unexpected data at the end"s);
+	}
+}
+
+void SnapshotReader::ThrowTruncated() {
+	throw SnapshotException("Snapshot is truncated"s);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "output_buffer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+
+// Исключение, выбрасываемое при загрузке снимка, который повреждён, обрезан,
+// не является снимком или записан в неподдерживаемой версии формата
+class SnapshotException : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Хэш FNV-1a по 64-битным словам с подмешиванием старших битов в
+// младшие. Данные можно передавать кусками произвольной длины.
+class SnapshotChecksum {
+public:
+	void Update(const char* data, std::size_t size);
+	std::uint64_t Get() const;
+
+private:
+	std::uint64_t hash_ = 0xCBF29CE484222325ull;
+	std::uint64_t total_size_ = 0;
+	char tail_[8] = {};
+	std::size_t tail_size_ = 0;
+
+	static std::uint64_t Mix(std::uint64_t hash, std::uint64_t word);
+};
+
+// Последовательная запись снимка в OutputBuffer. Снимок состоит из
+// заголовка (сигнатура, версия формата и метка порядка байтов), данных в
+// том порядке, в котором их пишут и читают владельцы, и контрольной суммы
+// всего, что ей предшествует. Числа записываются в порядке байтов машины:
+// снимок с другим порядком отвергается по метке.
+class SnapshotWriter {
+public:
+	// Увеличивается при любом изменении формата
+	static constexpr std::uint32_t VERSION = 1;
+
+	// Пишет заголовок
+	explicit SnapshotWriter(OutputBuffer& output);
+
+	template <typename T>
+	void Write(const T& value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		WriteBytes(&value, sizeof(T));
+	}
+
+	template <typename T>
+	void WriteArray(const T* values, std::size_t count) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		WriteBytes(values, count * sizeof(T));
+	}
+
+	void WriteBytes(const void* data, std::size_t size);
+
+	// Пишет контрольную сумму и сбрасывает буфер
+	void Finish();
+
+private:
+	OutputBuffer& output_;
+	SnapshotChecksum checksum_;
+};
+
+// Массив, который читается прямо из байтов снимка. Элементы копируются
+// при обращении, поэтому выравнивание данных не важно.
+template <typename T>
+class SnapshotArray {
+public:
+	SnapshotArray(const char* data, std::size_t size)
+		: data_(data)
+		, size_(size) {
+	}
+
+	T operator[](std::size_t index) const {
+		T value;
+		std::memcpy(&value, data_ + index * sizeof(T), sizeof(T));
+		return value;
+	}
+
+	std::size_t size() const {
+		return size_;
+	}
+
+private:
+	const char* data_;
+	std::size_t size_;
+};
+
+// Последовательное чтение снимка из памяти: отображённого файла или
+// буфера. Данные не копируются. Чтение за концом данных бросает
+// SnapshotException.
+class SnapshotReader {
+public:
+	// Проверяет заголовок и контрольную сумму
+	explicit SnapshotReader(std::string_view data);
+
+	template <typename T>
+	T Read() {
+		static_assert(std::is_trivially_copyable_v<T>);
+		T value;
+		std::memcpy(&value, ReadBytes(sizeof(T)), sizeof(T));
+		return value;
+	}
+
+	template <typename T>
+	SnapshotArray<T> ReadArray(std::size_t count) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		if (count > GetRemaining() / sizeof(T)) {
+			ThrowTruncated();
+		}
+		return { ReadBytes(count * sizeof(T)), count };
+	}
+
+	const char* ReadBytes(std::size_t size);
+
+	// Проверяет, что все данные до контрольной суммы прочитаны
+	void Finish() const;
+
+private:
+	std::string_view data_;
+	std::size_t pos_ = 0;
+
+	std::size_t GetRemaining() const {
+		return data_.size() - pos_;
+	}
+	[[noreturn]] static void ThrowTruncated();
+};
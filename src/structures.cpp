@@ -1,8 +1,10 @@
 #include "common.h"
 
 #include <cctype>
+#include <charconv>
 #include <sstream>
 #include <algorithm>
+#include <tuple>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
@@ -59,8 +61,8 @@ Position Position::FromString(std::string_view str) {
     }
 
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    const auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (ec != std::errc{} || end != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
@@ -75,4 +77,35 @@ Position Position::FromString(std::string_view str) {
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+}
+
+bool Range::operator==(const Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(const Range rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(const Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+}
+
+size_t Range::GetCellCount() const {
+    return static_cast<size_t>(last.row - first.row + 1) * static_cast<size_t>(last.col - first.col + 1);
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return first.ToString() + ':' + last.ToString();
+}
+
+Range Range::FromCorners(const Position a, const Position b) {
+    return {{std::min(a.row, b.row), std::min(a.col, b.col)}, {std::max(a.row, b.row), std::max(a.col, b.col)}};
+}
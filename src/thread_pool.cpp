@@ -0,0 +1,84 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(std::size_t thread_count) {
+	thread_count = std::max<std::size_t>(thread_count, 1);
+	workers_.reserve(thread_count - 1);
+	for (std::size_t i = 1; i < thread_count; ++i) {
+		workers_.emplace_back([this] {
+			WorkerLoop();
+		});
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard lock(mutex_);
+		stopping_ = true;
+	}
+	job_ready_.notify_all();
+	for (auto& worker : workers_) {
+		worker.join();
+	}
+}
+
+std::size_t ThreadPool::GetThreadCount() const {
+	return workers_.size() + 1;
+}
+
+std::size_t ThreadPool::GetDefaultThreadCount() {
+	return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+void ThreadPool::Run(const Job& job, std::size_t count, std::size_t grain_size) {
+	{
+		std::lock_guard lock(mutex_);
+		job_ = &job;
+		count_ = count;
+		grain_size_ = grain_size;
+		next_begin_.store(0, std::memory_order_relaxed);
+		busy_workers_ = workers_.size();
+		++generation_;
+	}
+	job_ready_.notify_all();
+	ProcessChunks();
+
+	std::unique_lock lock(mutex_);
+	job_done_.wait(lock, [this] {
+		return busy_workers_ == 0;
+	});
+	job_ = nullptr;
+}
+
+void ThreadPool::ProcessChunks() {
+	for (;;) {
+		const std::size_t begin = next_begin_.fetch_add(grain_size_, std::memory_order_relaxed);
+		if (begin >= count_) {
+			break;
+		}
+		(*job_)(begin, std::min(begin + grain_size_, count_));
+	}
+}
+
+void ThreadPool::WorkerLoop() {
+	std::uint64_t seen_generation = 0;
+	for (;;) {
+		{
+			std::unique_lock lock(mutex_);
+			job_ready_.wait(lock, [&] {
+				return stopping_ || generation_ != seen_generation;
+			});
+			if (stopping_) {
+				return;
+			}
+			seen_generation = generation_;
+		}
+		ProcessChunks();
+		{
+			std::lock_guard lock(mutex_);
+			--busy_workers_;
+		}
+		job_done_.notify_one();
+	}
+}
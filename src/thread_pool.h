@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков для параллельных циклов. Потоки создаются один раз и ждут
+// задания; вызывающий поток участвует в работе наравне с ними. Отрезок
+// [0, count) режется на куски по grain_size элементов, свободный поток
+// забирает следующий кусок из общего атомарного счётчика, поэтому неравные
+// по стоимости куски распределяются сами собой.
+class ThreadPool {
+public:
+	// thread_count - общее число потоков вместе с вызывающим
+	explicit ThreadPool(std::size_t thread_count = GetDefaultThreadCount());
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	std::size_t GetThreadCount() const;
+	static std::size_t GetDefaultThreadCount();
+
+	// Вызывает func(begin, end) для всех кусков и возвращает управление, когда
+	// все они обработаны. func не должна бросать исключений.
+	template <typename Func>
+	void ParallelFor(std::size_t count, std::size_t grain_size, Func&& func);
+
+private:
+	using Job = std::function<void(std::size_t, std::size_t)>;
+
+	std::vector<std::thread> workers_;
+	std::mutex mutex_;
+	std::condition_variable job_ready_;
+	std::condition_variable job_done_;
+	const Job* job_ = nullptr;
+	std::size_t count_ = 0;
+	std::size_t grain_size_ = 1;
+	std::atomic<std::size_t> next_begin_{ 0 };
+	std::size_t busy_workers_ = 0;
+	std::uint64_t generation_ = 0;
+	bool stopping_ = false;
+
+	void Run(const Job& job, std::size_t count, std::size_t grain_size);
+	void ProcessChunks();
+	void WorkerLoop();
+};
+
+template <typename Func>
+void ThreadPool::ParallelFor(std::size_t count, std::size_t grain_size, Func&& func) {
+	if (grain_size == 0) {
+		grain_size = 1;
+	}
+	if (count == 0) {
+		return;
+	}
+	if (workers_.empty() || count <= grain_size) {
+		func(std::size_t{ 0 }, count);
+		return;
+	}
+	const Job job = std::ref(func);
+	Run(job, count, grain_size);
+}